@@ -0,0 +1,58 @@
+/*
+ * benchmark and check of CurlSmtp::add_header(): replacing a header must not
+ * allocate (AMONG tests and enum-string lookups are allocation-free, the stored
+ * value is reused once it has the capacity)
+ *
+ * global operator new is replaced with a counting one: headers Subject and From
+ * are set alternately, allocations and time per add_header() are reported; the
+ * exit code is non-zero if any allocation took place in the measured loop
+ *
+ * build and run:
+ *  c++ -o bench-add_header -std=c++14 -O2 bench/add_header.cpp -lcurl
+ *  ./bench-add_header
+ *
+ */
+
+#include <iostream>
+#include <chrono>
+#include <new>
+#include <stdlib.h>
+
+static size_t allocs = 0;                                       // calls of operator new
+
+void * operator new(size_t n) {
+ ++allocs;
+ void *p = malloc(n);
+ if(p == nullptr) throw std::bad_alloc();
+ return p;
+}
+__attribute__((noinline))                                       // not seen as a mismatched free
+void operator delete(void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { operator delete(p); }
+
+#include "../lib/Curl.hpp"
+
+using namespace std;
+
+
+#define ADDS 2000000                                            // add_header() pairs
+
+
+
+int main(void) {
+ CurlSmtp sm;
+ string subj = "Quarterly report for the board meeting (final)";
+ string from = "reporter@example.com";
+ sm.add_header(CurlSmtp::Subject, subj).add_header(CurlSmtp::From, from);  // headers exist
+
+ size_t before = allocs;
+ auto t0 = chrono::steady_clock::now();
+ for(int i = 0; i < ADDS; ++i)
+  sm.add_header(CurlSmtp::Subject, subj).add_header(CurlSmtp::From, from);
+ auto t1 = chrono::steady_clock::now();
+ size_t made = allocs - before;
+
+ cout << "add_header: " << chrono::duration<double, nano>(t1 - t0).count() / (2. * ADDS)
+      << " ns, allocations: " << made << " in " << 2 * ADDS << " calls" << endl;
+ return made == 0? 0: 1;
+}
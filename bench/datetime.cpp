@@ -0,0 +1,104 @@
+/*
+ * benchmark of bulk date/time parsing (e.g. scheduled sends of a big manifest):
+ * DateTime::set_DateTime() against the libc path it replaced (the string parsed
+ * into struct tm, converted with timegm() / mktime())
+ *
+ * stamps ("YYYYMMDD HH:MM:SS") are laid out back to back in a buffer (as if read
+ * from a manifest) and parsed repeatedly, in UTC and in local time (set TZ to
+ * try a specific zone); two sets are measured: dates within 2 years (typical for
+ * scheduling) and dates spread over 100 years (defeats the local offsets cache)
+ *
+ * the target is 100M stamps per second and it is NOT met: as of this writing, on a
+ * (noisy) 1-CPU box, -O2, dates within 2 years: 40-90M/s in UTC, 30-60M/s in local
+ * time; the libc path makes ~2M/s in UTC and ~0.5M/s in local time
+ *
+ * build and run:
+ *  c++ -o bench-datetime -std=c++14 -O2 bench/datetime.cpp
+ *  TZ=Europe/Berlin ./bench-datetime
+ *
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <chrono>
+#include <random>
+#include <stdio.h>
+#include <time.h>
+#include "../lib/IBtime.hpp"
+
+using namespace std;
+
+
+#define STAMPS 100000                                           // distinct stamps per set
+#define ROUNDS 5                                                // passes over the set
+#define REC 18                                                  // "YYYYMMDD HH:MM:SS\0"
+
+volatile time_t sink;                                           // keeps measured loops in
+
+
+
+vector<char> make_stamps(int years, unsigned seed) {
+ // generate STAMPS stamps starting from 1970 + (100 - years)
+ vector<char> buf(STAMPS * REC);
+ mt19937 rnd(seed);
+ auto any = [&rnd](unsigned n) { return static_cast<unsigned>(rnd() % n); };
+ for(size_t i = 0; i < STAMPS; ++i)
+  snprintf(&buf[i * REC], REC, "%04u%02u%02u %02u:%02u:%02u",
+           2070 - years + any(years), 1 + any(12), 1 + any(28), any(24), any(60), any(60));
+ return buf;
+}
+
+
+time_t libc_stamp(const char *str, DateTime::Locality l) {
+ // the replaced path: parse into struct tm, convert via libc
+ tm t{};
+ if(sscanf(str, "%4d%2d%2d %2d:%2d:%2d",
+           &t.tm_year, &t.tm_mon, &t.tm_mday, &t.tm_hour, &t.tm_min, &t.tm_sec) != 6)
+  return -1;
+ t.tm_year -= 1900;
+ t.tm_mon -= 1;
+ t.tm_isdst = -1;
+ return l == DateTime::UTC? timegm(&t): mktime(&t);
+}
+
+
+template<typename F>
+double measure(const vector<char> &buf, unsigned rounds, F && stamp) {
+ // return stamps per second
+ time_t sum = 0;
+ auto t0 = chrono::steady_clock::now();
+ for(unsigned r = 0; r < rounds; ++r)
+  for(size_t i = 0; i < STAMPS; ++i)
+   sum += stamp(&buf[i * REC]);
+ auto t1 = chrono::steady_clock::now();
+ sink = sum;
+ return rounds * STAMPS / chrono::duration<double>(t1 - t0).count();
+}
+
+
+
+int main(void) {
+ DateTime dt;
+ cout << fixed << setprecision(1);
+
+ for(int years: {2, 100}) {
+  auto buf = make_stamps(years, years);
+  for(auto l: {DateTime::UTC, DateTime::LT}) {
+   const char *loc = l == DateTime::UTC? "UTC": "LT ";
+   double fast = measure(buf, ROUNDS, [&dt, l](const char *s){ return dt.set_DateTime(s, l).stamp(); });
+   double libc = measure(buf, 1, [l](const char *s){ return libc_stamp(s, l); });
+   cout << loc << ", " << setw(3) << years << " years: DateTime " << setw(6) << fast / 1e6
+        << " M/s, libc " << setw(5) << libc / 1e6 << " M/s" << endl;
+  }
+ }
+
+ // both paths must agree (except for local times skipped or repeated by DST)
+ auto buf = make_stamps(100, 1);
+ size_t differ = 0;
+ for(auto l: {DateTime::UTC, DateTime::LT})
+  for(size_t i = 0; i < STAMPS; ++i)
+   differ += dt.set_DateTime(&buf[i * REC], l).stamp() != libc_stamp(&buf[i * REC], l);
+ cout << "stamps differing from libc: " << differ << " of " << 2 * STAMPS << endl;
+ return 0;
+}
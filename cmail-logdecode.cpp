@@ -0,0 +1,233 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <string>
+#include <map>
+#include "lib/getoptions.hpp"
+#include "lib/dbg.hpp"
+
+using namespace std;
+
+
+#define VERSION "1.00"
+
+// defined options
+#define OPT_TID T
+#define OPT_TST t
+#define ARG_LOG 0
+
+
+#define RETURN_CODES \
+        RC_OK, \
+        RC_NOK, \
+        RC_BADLOG, \
+        RC_END
+ENUM(ReturnCodes, RETURN_CODES)
+
+#define OFF_GETOPT RC_END                                       // offset for Getopt exceptions
+
+
+// facilitate option materialization
+#define STR(X) XSTR(X)
+#define XSTR(X) #X
+#define CHR(X) XCHR(X)
+#define XCHR(X) *#X
+
+
+
+struct Site {
+    unsigned            line;
+    string              file;
+    string              func;
+};
+
+
+class BinReader {
+ // sequential reader of binary debug log values
+ public:
+                        BinReader(const string &buf): buf_(buf) {}
+
+    bool                eof(void) const { return pos_ >= buf_.size(); }
+    char                tag(void) { need_(1); return buf_[pos_++]; }
+    char                peek(void) const { return buf_[pos_]; }
+    template<typename T>
+    T                   raw(void) {
+                         T v;
+                         need_(sizeof(v));
+                         memcpy(&v, buf_.data() + pos_, sizeof(v));
+                         pos_ += sizeof(v);
+                         return v;
+                        }
+    string              str(void) {
+                         auto len = raw<uint32_t>();
+                         need_(len);
+                         pos_ += len;
+                         return buf_.substr(pos_ - len, len);
+                        }
+    size_t              pos(void) const { return pos_; }
+
+ private:
+    const string &      buf_;
+    size_t              pos_{0};
+
+    void                need_(size_t n) const
+                         { if(pos_ + n > buf_.size()) throw runtime_error("truncated record"); }
+};
+
+
+// forward declarations
+void collect_sites(BinReader br, map<uint32_t, Site> &sites);
+void decode(BinReader &br, const map<uint32_t, Site> &sites, Getopt &opt);
+void skip_args(BinReader &br);
+bool is_record(char tag);
+string stamp_str(int64_t ns);
+
+
+
+
+int main(int argc, char *argv[])
+{
+ Getopt opt;
+ opt.prolog("\nDecoder of binary debug logs produced by cmail (option -l)\n" \
+            "Version " VERSION ", developed by Dmitry Lyssenko (ldn.softdev@gmail.com)\n");
+ opt[CHR(OPT_TID)].desc("print thread ids");
+ opt[CHR(OPT_TST)].desc("print time-stamps");
+ opt[ARG_LOG].name("binlog").desc("binary debug log to decode");
+
+ try { opt.parse(argc,argv); }
+ catch(Getopt::stdException & e)
+  { opt.usage(); return e.code() + OFF_GETOPT; }
+
+ ifstream fin(opt[ARG_LOG].str(), ios::in | ios::binary);
+ if(not fin)
+  { cerr << "error: could not open '" << opt[ARG_LOG].str() << "'" << endl; return RC_NOK; }
+ string buf{istreambuf_iterator<char>(fin), istreambuf_iterator<char>{}};
+
+ if(buf.compare(0, strlen(DBG_BINLOG_MAGIC), DBG_BINLOG_MAGIC) != 0)
+  { cerr << "error: '" << opt[ARG_LOG].str() << "' is not a binary log" << endl; return RC_BADLOG; }
+ buf.erase(0, strlen(DBG_BINLOG_MAGIC));
+
+ map<uint32_t, Site> sites;
+ BinReader br(buf);
+ try {
+  collect_sites(br, sites);                                     // site records may come later
+  decode(br, sites, opt);                                       // than their first entries
+ }
+ catch(runtime_error & e) {
+  cerr << "error: " << e.what() << " at offset " << br.pos() + strlen(DBG_BINLOG_MAGIC) << endl;
+  return RC_BADLOG;
+ }
+
+ return RC_OK;
+}
+
+
+
+void collect_sites(BinReader br, map<uint32_t, Site> &sites) {
+ // 1st pass: collect all site definitions (entries from multiple threads may arrive
+ // before the site definition recorded by another thread)
+ while(not br.eof())
+  switch(br.tag()) {
+   case Debug::bin_site: {
+    auto id = br.raw<uint32_t>();
+    auto & site = sites[id];
+    site.line = br.raw<uint32_t>();
+    site.file = br.str();
+    site.func = br.str();
+    break;
+   }
+   case Debug::bin_entry:
+    br.raw<uint32_t>(); br.raw<int16_t>(); br.raw<int64_t>(); br.raw<uint32_t>();
+    skip_args(br);
+    break;
+   case Debug::bin_cont:
+    br.raw<uint32_t>();
+    skip_args(br);
+    break;
+   default:
+    throw runtime_error("unknown record");
+  }
+}
+
+
+void decode(BinReader &br, const map<uint32_t, Site> &sites, Getopt &opt) {
+ // 2nd pass: render entries the way Debug's prompt would do
+ while(not br.eof()) {
+  char tag = br.tag();
+  if(tag == Debug::bin_site)
+   { br.raw<uint32_t>(); br.raw<uint32_t>(); br.str(); br.str(); continue; }
+  if(tag != Debug::bin_entry and tag != Debug::bin_cont)
+   throw runtime_error("unknown record");
+
+  if(tag == Debug::bin_entry) {                                 // print prompt
+   auto id = br.raw<uint32_t>();
+   auto sev = br.raw<int16_t>();
+   auto ns = br.raw<int64_t>();
+   auto tid = br.raw<uint32_t>();
+   for(int i = sev; i >= 0; --i) cout << DBG_INDENT;
+   auto found = sites.find(id);
+   cout << (found == sites.end()? "<unknown>": found->second.func) << "()";
+   if(opt[CHR(OPT_TST)].hits() > 0) cout << " [" << stamp_str(ns) << "]";
+   if(opt[CHR(OPT_TID)].hits() > 0) cout << " {" << hex << tid << dec << "}";
+   cout << DBG_SUFFIX;
+  }
+  else
+   br.raw<uint32_t>();                                          // continuation's thread id
+
+  while(not br.eof() and not is_record(br.peek()))
+   switch(br.tag()) {
+    case Debug::arg_int: cout << br.raw<int64_t>(); break;
+    case Debug::arg_uint: cout << br.raw<uint64_t>(); break;
+    case Debug::arg_dbl: cout << br.raw<double>(); break;
+    case Debug::arg_chr: cout << br.raw<char>(); break;
+    case Debug::arg_bool: cout << br.raw<bool>(); break;
+    case Debug::arg_str: cout << br.str(); break;
+    case Debug::arg_eol: cout << endl; break;
+    default: throw runtime_error("unknown argument");
+   }
+ }
+}
+
+
+void skip_args(BinReader &br) {
+ // skip arguments of an entry/continuation record
+ while(not br.eof() and not is_record(br.peek()))
+  switch(br.tag()) {
+   case Debug::arg_int: br.raw<int64_t>(); break;
+   case Debug::arg_uint: br.raw<uint64_t>(); break;
+   case Debug::arg_dbl: br.raw<double>(); break;
+   case Debug::arg_chr: br.raw<char>(); break;
+   case Debug::arg_bool: br.raw<bool>(); break;
+   case Debug::arg_str: br.str(); break;
+   case Debug::arg_eol: break;
+   default: throw runtime_error("unknown argument");
+  }
+}
+
+
+bool is_record(char tag) {
+ // check if tag starts a new record
+ return tag == Debug::bin_site or tag == Debug::bin_entry or tag == Debug::bin_cont;
+}
+
+
+string stamp_str(int64_t ns) {
+ // build a time-stamp (local TZ) in Debug's format: YYYY-MMM-DD hh:mm:ss.mmm.uuu
+ static const char * month[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+                                "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+ time_t sec = ns / 1000000000;
+ long usec = ns % 1000000000 / 1000;
+ tm tms;
+ localtime_r(&sec, &tms);
+
+ stringstream so;
+ so << tms.tm_year+1900 << '-' << month[tms.tm_mon] << '-'
+    << setfill('0') << setw(2) << tms.tm_mday << ' '
+    << setfill('0') << setw(2) << tms.tm_hour << ':'
+    << setfill('0') << setw(2) << tms.tm_min << ':'
+    << setfill('0') << setw(2) << tms.tm_sec << '.'
+    << setfill('0') << setw(3) << usec / 1000 << '.'
+    << setfill('0') << setw(3) << usec % 1000;
+ return so.str();
+}
@@ -2,8 +2,23 @@
 #include <string>
 #include <fstream>
 #include <iterator>
+#include <functional>
+#include <thread>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <cmath>
+#include <poll.h>
+#include <signal.h>
 #include "lib/getoptions.hpp"
 #include "lib/Curl.hpp"
+#include "lib/Transport.hpp"
+#include "lib/ShmRing.hpp"
+#include "lib/SmtpListener.hpp"
+#include "lib/TimerWheel.hpp"
+#include "lib/Throttle.hpp"
+#include "lib/ThreadPool.hpp"
 
 using namespace std;
 
@@ -13,15 +28,29 @@ using namespace std;
 // defined options
 #define OPT_RDT -
 #define OPT_ATT a
+#define OPT_BWD b
+#define OPT_CLT c
 #define OPT_DBG d
 #define OPT_APH H
+#define OPT_MNF m
+#define OPT_DRY n
 #define OPT_PWD p
+#define OPT_RTR r
+#define OPT_DMN S
 #define OPT_SBJ s
+#define OPT_TIM t
+#define OPT_BLG l
+#define OPT_LSN L
+#define OPT_DBC D
 #define OPT_USR u
+#define OPT_DKM k                                               // only with -DCMAIL_DKIM
 #define ARG_TO 0
 #define ARG_SRV 1
 
 #define SPACES " \t"
+#define LSN_QUEUE 1000                                          // emails queued by listener (-L)
+#define DMN_READ (64 * 1024)                                    // daemon's client read size
+#define DMN_WAIT 3600                                           // max poll wait for queued (sec)
 
 
 // facilitate option materialization
@@ -38,9 +67,26 @@ using namespace std;
         RC_MISSUSR, \
         RC_MISSPWD, \
         RC_MISSMTP, \
+        RC_INVTIM, \
+        RC_INVMNF, \
+        RC_INVRTR, \
+        RC_INVBWD, \
+        RC_INVDKM, \
+        RC_INVDRY, \
+        RC_INVSCK, \
+        RC_INVLSN, \
         RC_END
 ENUM(ReturnCodes, RETURN_CODES)
 
+#ifdef CMAIL_DKIM
+#define DKIM_EPILOG "\
+- option -" STR(OPT_DKM) " takes a DKIM selector and a PEM file with the private key (rsa, or\n\
+  ed25519), e.g.: -" STR(OPT_DKM) " 'mail:/etc/dkim/mail.pem'; the signing domain is the one\n\
+  of the sender (header 'From:'), headers and the body are canonicalized relaxed\n"
+#else
+#define DKIM_EPILOG ""
+#endif
+
 #define OFF_GETOPT RC_END                                       // offset for Getopt exceptions
 #define OFF_CSMTP (OFF_GETOPT + Getopt::end_of_throw)           // offset for Curl SMTP exceptions
 
@@ -48,11 +94,45 @@ ENUM(ReturnCodes, RETURN_CODES)
 struct SharedResource {
     Getopt              opt;
     CurlSmtp            sm;                                     // send mail
+    TimerWheel<std::function<void(void)>>
+                        pending;                                // scheduled (deferred) sends
+    OptLine             ol;                                     // parser of manifest lines
+    ifstream            manifest;
+    string              input;                                  // email body
+    size_t              failed{0};                              // failed manifest sends
+    map<string, Throttle>
+                        throttle;                               // per relay (smtp server)
+    mutex               throttle_mtx;                           // relays deliver concurrently
+    unsigned            retries{0};                             // of transient failures
+    ofstream            dry_file;
+    ostream *           dry{nullptr};                           // dry run output (-n)
+    unique_ptr<Transport>
+                        transport;                              // delivers rendered emails
+    struct Relay {                                              // daemon's warm transport
+        unique_ptr<CurlSmtp>
+                            sm;
+        unique_ptr<Transport>
+                            tr;
+        ThreadPool          worker{1};                          // delivers in order submitted
+    };
+    map<string, Relay>  relays;                                 // per destination, credentials
+ #ifdef __linux__
+    ShmRing             ring;                                   // daemon's local submissions
+ #endif
 
     DEBUGGABLE()
 };
 
 
+struct DaemonClient {                                           // a connection to the daemon
+                        DaemonClient(int f): fd(f) {}
+                       ~DaemonClient(void) { close(fd); }
+    int                 fd;
+    string              in;                                     // a frame being received
+    bool                busy{false};                            // a request is being delivered
+};
+
+
 #define __REFX__(A) auto & A = __common_resource__.A;
 #define REVEAL(X, ARGS...) \
         auto & __common_resource__ = X; \
@@ -62,12 +142,36 @@ struct SharedResource {
 
 // forward declarations
 void post_parse(SharedResource &r);
+void setup_headers(SharedResource &r);
+void setup_debug_control(SharedResource &r);
+time_t scheduled_time(SharedResource &r);
+void parse_retries(SharedResource &r);
+void parse_bandwidth(SharedResource &r);
+void setup_dkim(SharedResource &r);
+void setup_transport(SharedResource &r);
+Transport * select_transport(const string &dst, CurlSmtp &sm);
+bool deliver(SharedResource &r, const Message &msg);
+bool deliver(SharedResource &r, Transport &tr, const Message &msg, unsigned retries);
+int serve(SharedResource &r);
+bool serve_client(SharedResource &r, shared_ptr<DaemonClient> &cl);
+void serve_ring(SharedResource &r);
+void process_request(SharedResource &r, vector<string> &rq,
+                     function<void(const vector<string> &)> reply);
+int listen_smtp(SharedResource &r);
+void catch_signals(void);
+SharedResource::Relay &
+     relay(SharedResource &r, const string &dst, const string &user, const string &pwd);
+void release_pending(SharedResource &r);
+void send_manifest(SharedResource &r);
+bool parse_manifest_line(SharedResource &r, const string &line, size_t ln);
+void send_manifest_line(SharedResource &r, size_t ln);
 void parse_headers(SharedResource &r);
-void append_email_header(CurlSmtp::Headers hdr, string hdr_str, SharedResource &r);
-CurlSmtp::Headers match_header(string hdr_str);
+void apply_header(const char *opt_hdr, SharedResource &r);
+void append_email_header(CurlSmtp::Headers hdr, const char *hdr_str, SharedResource &r);
 vector<string> split_by(char dlm, const string &str);
 void try_recovering_from(SharedResource &r);
 string trim_spaces(std::string str);
+void trim_spaces(const char *&begin, const char *&end);
 
 
 
@@ -80,24 +184,44 @@ int main(int argc, char *argv[])
  opt.prolog("\nAn easy utility based on libcurl to send emails from the command line\n" \
             "Version " VERSION ", developed by Dmitry Lyssenko (ldn.softdev@gmail.com)\n");
  opt[CHR(OPT_ATT)].desc("attach file").name("attachment");
+ opt[CHR(OPT_BWD)].desc("limit outbound bandwidth, bytes per second (see below)").name("rate");
+ opt[CHR(OPT_CLT)].desc("hand emails over to the daemon listening on socket (see below)")
+                  .name("socket");
  opt[CHR(OPT_DBG)].desc("turn on debugs (multiple calls increase verbosity)");
+ opt[CHR(OPT_BLG)].desc("write debugs into binary log (decode with cmail-logdecode)").name("binlog");
+ opt[CHR(OPT_DBC)].desc("throttle debug outputs (see below)").name("control");
  opt[CHR(OPT_APH)].desc("append email header").name("header");
+ opt[CHR(OPT_LSN)].desc("run as a local smtp relay listening on address (see below)")
+                  .name("host:port");
+ opt[CHR(OPT_MNF)].desc("send a batch of emails listed in manifest (see below)").name("manifest");
+ opt[CHR(OPT_DRY)].desc("dry run: write emails into file instead of sending (see below)")
+                  .name("file");
  opt[CHR(OPT_PWD)].desc("password to use with username to access smtp server").name("password");
+ opt[CHR(OPT_RTR)].desc("retry temporary failures given number of times (see below)")
+                  .name("retries").bind("3");
+ opt[CHR(OPT_DMN)].desc("run as a daemon serving clients (-" STR(OPT_CLT) ") on the unix socket")
+                  .name("socket");
  opt[CHR(OPT_SBJ)].desc("set email subject").name("subject");
+ opt[CHR(OPT_TIM)].desc("send at given local time (see below)").name("at");
  opt[CHR(OPT_USR)].desc("username to access smtp server with").name("username");
- opt[ARG_TO].name("to").desc("'to' recipient(s)");
- opt[ARG_SRV].name("smtp").desc("smtp server to connect to").bind("<recover from username>");
+ #ifdef CMAIL_DKIM
+ opt[CHR(OPT_DKM)].desc("DKIM sign emails with the private key (see below)").name("selector:key");
+ #endif
+ opt[ARG_TO].name("to").desc("'to' recipient(s)").bind("<from manifest>");
+ opt[ARG_SRV].name("smtp").desc("smtp server to connect to (or local delivery, see below)")
+             .bind("<recover from username>");
  opt.epilog("\n\
 if there are attachments or inputs contain unicode, the mail is sent using\n\
 mime/base64 encoding, otherwise it is sent as plain text\n\n\
 to send attachments only and suppress inputs, specify a bare qualifier `-',\n\
 predicated at least one option -" STR(OPT_ATT) " is given\n\n\
-- Option -" STR(OPT_APH) " supports headers: `From', `To', `Cc', `Bcc', `Subject'\n\
-  headers should be given one per option and in the following format, e.g.:\n\
+- Option -" STR(OPT_APH) " supports headers: `From', `To', `Cc', `Bcc', `Subject' (names\n\
+  are case-insensitive) as well as any custom header (e.g.: `Reply-To'), except\n\
+  `Date'; headers should be given one per option and in the following format:\n\
    -" STR(OPT_APH) " 'Subject: this is a subject'\n\
 - Headers `To', `Cc', `Bcc' are additive (multiple arguments could be given,\n\
-  listed over comma), while `From' and `Subject' are overridable (only the last\n\
-  given will be recorded)\n\
+  listed over comma), while `From', `Subject' and custom headers are overridable\n\
+  (only the last given will be recorded)\n\
 - Argument `to' also may contain multiple recipients (like additive headers in\n\
   option -" STR(OPT_APH) ")\n\
 - Argument `smtp', if not given, is attempted to be recovered from the username\n\
@@ -113,7 +237,48 @@ predicated at least one option -" STR(OPT_ATT) " is given\n\n\
   (instead of default `smtp://')\n\
 - subject could be passed either via -" STR(OPT_SBJ) " or via -" STR(OPT_APH)
   " 'Subject: ...'; the latter\n\
-  option overrides the former one\n");
+  option overrides the former one\n\
+- option -" STR(OPT_TIM) " defers sending till the given local time, the time format is\n\
+  'YYYYMMDD HH:MM:SS', e.g.: -" STR(OPT_TIM) " '20180704 07:00:00'; the input is read right\n\
+  away, the program then waits till the time is due (past times are sent at once)\n\
+- option -" STR(OPT_MNF) " sends the input to every recipient listed in the manifest file, one\n\
+  email per line; lines are given in the same syntax as the command line options\n\
+  and arguments (quoting as in shell, `#' comments the rest of the line), e.g.:\n\
+   -s 'March report' -a report.pdf -t '20180704 07:00:00' john@acme.com\n\
+  only options -" STR(OPT_ATT) ", -" STR(OPT_APH) ", -" STR(OPT_SBJ) ", -" STR(OPT_TIM) \
+  " and argument `to' are accepted in lines; options given\n\
+  in the command line apply to all the lines (-" STR(OPT_SBJ) " and -" STR(OPT_TIM) \
+  " could be overridden per line);\n\
+  with -" STR(OPT_MNF) " argument `to' is optional: if only one argument is given, it's `smtp'\n\
+- sends are paced per smtp server once the server throttles (replies 4xx, e.g.\n\
+  421, 451): the sending rate is reduced and the email is retried (option -" STR(OPT_RTR) ")\n\
+  with an exponentially growing (jittered) delay; permanent failures (5xx) are\n\
+  not retried\n\
+- option -" STR(OPT_BWD) " caps the aggregate upload rate of all sends, suffixes `k' and `m'\n\
+  (case-insensitive) stand for KiB and MiB, e.g.: -" STR(OPT_BWD) " 512k\n" DKIM_EPILOG "\
+- argument `smtp' could also select a local delivery: `lmtp:<socket>' - to the LMTP\n\
+  server over a unix socket, `maildir:<dir>' - into a Maildir, `mbox:<file>' -\n\
+  appended to an mbox, e.g.: lmtp:/var/run/dovecot/lmtp; local deliveries are\n\
+  not paced\n\
+- option -" STR(OPT_DMN) " runs cmail as a resident daemon: it keeps connections to smtp\n\
+  servers (and LMTP) open and authenticated, clients (option -" STR(OPT_CLT) ", or environment\n\
+  variable CMAIL_SOCKET) render emails and hand them over to the daemon, which\n\
+  delivers them and replies the outcome (each relay delivers in its own thread);\n\
+  emails scheduled with -" STR(OPT_TIM) " are queued by the daemon in memory only: on exit\n\
+  (SIGINT, SIGTERM) the daemon completes received deliveries, but drops queued\n\
+  emails; if the daemon is unavailable, the client sends emails by itself;\n\
+  local programs could also submit emails to the daemon through a shared memory\n\
+  ring (linux only, see lib/ShmRing.hpp)\n\
+- option -" STR(OPT_LSN) " runs cmail as a local smtp relay (linux only): it accepts emails from\n\
+  local smtp clients (w/o authentication), queues them in memory and relays to\n\
+  `smtp' over a single connection, e.g.: cmail -" STR(OPT_LSN) " 127.0.0.1:2525 -" STR(OPT_USR) " ... smtp.host.net\n\
+- option -" STR(OPT_DRY) " renders emails and writes them into the file (`-' for stdout) exactly\n\
+  as they would be uploaded to the smtp server, nothing is sent; `smtp' is optional\n\
+- option -" STR(OPT_DBC) " takes a comma separated list of debug controls, e.g.:\n\
+   -" STR(OPT_DBC) " 'rate=100,sample=10,trunc=256'\n\
+  rate: let thru at most given number of outputs per second per debug placement,\n\
+  sample: let thru only each n'th output per debug placement,\n\
+  trunc: truncate debugged payloads (strings) to given number of chars\n");
 
  // parse options
  try { opt.parse(argc,argv); }
@@ -122,20 +287,49 @@ predicated at least one option -" STR(OPT_ATT) " is given\n\n\
 
  DBG().level(opt[CHR(OPT_DBG)].hits())
       .use_ostream(cerr)
+      .async(true)
       .increment(+1, sm, -1);
+ if(opt[CHR(OPT_BLG)].hits() > 0 and not DBG().binlog(opt[CHR(OPT_BLG)].str()).binary())
+  cerr << "fail: could not open binary log '" << opt[CHR(OPT_BLG)].str() << "', ignoring" << endl;
+ setup_debug_control(r);
+ if(opt[CHR(OPT_DMN)].hits() > 0)
+  { parse_bandwidth(r); return serve(r); }
+ if(opt[CHR(OPT_LSN)].hits() > 0)
+  { parse_retries(r); parse_bandwidth(r); return listen_smtp(r); }
 
  post_parse(r);
+ time_t due = scheduled_time(r);
+ parse_retries(r);
+ parse_bandwidth(r);
+ setup_dkim(r);
+ setup_transport(r);
 
  try {
   if(opt[CHR(OPT_USR)].hits() > 0)                              // setup ssl if username/password
    sm.ssl(opt[CHR(OPT_USR)].str(), opt[CHR(OPT_PWD)].str());
+  if(due < 0 and dynamic_cast<SmtpTransport *>(r.transport.get()) != nullptr)
+   sm.warm_up();                                                // handshakes overlap the input
 
-  sm.host(opt[ARG_SRV].str());
   for(auto &file: opt[CHR(OPT_ATT)])
    sm.attach_file(file);
   bool skip_input = opt[CHR(OPT_RDT)].hits() > 0 and opt[CHR(OPT_ATT)].hits() > 0;
-  sm.send(string{skip_input? istream_iterator<char>{}: istream_iterator<char>(cin>>noskipws),
-                 istream_iterator<char>{}});
+  r.input.assign(skip_input? istream_iterator<char>{}: istream_iterator<char>(cin>>noskipws),
+                 istream_iterator<char>{});
+  if(opt[CHR(OPT_MNF)].hits() > 0) {
+   send_manifest(r);
+   if(r.failed > 0)
+    { cerr << "sending error: " << r.failed << " email(s) failed" << endl; return RC_NOK; }
+   if(r.dry != &cout) cout << "sending ok" << endl;
+   return RC_OK;
+  }
+  Message msg = sm.render(r.input);
+  auto daemon = dynamic_cast<DaemonTransport *>(r.transport.get());
+  if(due < 0) deliver(r, msg);
+  else if(daemon != nullptr) daemon->send(msg, due);            // the daemon queues it
+  else {
+   r.pending.insert(due, [&r, msg]{ deliver(r, msg); });
+   release_pending(r);
+  }
  }
  catch (CurlSmtp::stdException & e) {
   DBG(0) DOUT() << "exception raised by: " << e.where() << endl;
@@ -143,10 +337,10 @@ predicated at least one option -" STR(OPT_ATT) " is given\n\n\
   return e.code() + OFF_CSMTP;
  }
 
- if(sm.rc() != CURLE_OK)
-  { cerr << "sending error: " << sm.error() << endl; return RC_NOK; }
+ if(r.transport->failed())
+  { cerr << "sending error: " << r.transport->error() << endl; return RC_NOK; }
 
- cout << "sending ok" << endl;
+ if(r.dry != &cout) cout << "sending ok" << endl;             // do not garble dumped mail
  return RC_OK;
 }
 
@@ -157,14 +351,15 @@ void post_parse(SharedResource &r) {
  REVEAL(r, opt, sm, DBG())
  DBG(0) DOUT() << "begin processing options" << endl;
 
- append_email_header(CurlSmtp::To, opt[ARG_TO].str(), r);       // append header 'To' from arg[0]
- if(sm.to().empty())
-  { cerr << "error: header 'To' must be a valid email" << endl; exit(RC_INVTO); }
-
- if(opt[CHR(OPT_SBJ)].hits() > 0)                               // append subj (if given)
-  sm.subject(opt[CHR(OPT_SBJ)].str());
+ bool manifest = opt[CHR(OPT_MNF)].hits() > 0;
+ if(manifest and opt[ARG_TO].hits() > 0 and opt[ARG_SRV].hits() == 0) {
+  opt[ARG_SRV] = opt[ARG_TO].str();                             // with manifest a sole arg is smtp
+  opt[ARG_TO].reset();
+ }
 
- parse_headers(r);
+ setup_headers(r);
+ if(sm.to().empty() and not manifest)
+  { cerr << "error: header 'To' must be a valid email" << endl; exit(RC_INVTO); }
 
  if(opt[CHR(OPT_USR)].hits() > 0 and opt[CHR(OPT_PWD)].hits() == 0) // -u given
   { cerr << "error: password is required but not provided" << endl; exit(RC_MISSPWD); }
@@ -190,62 +385,658 @@ void post_parse(SharedResource &r) {
    DBG(0) DOUT() << "recovered smtp from 'From:' header: " << opt[ARG_SRV] << endl;
    return;
   }
+  if(opt[CHR(OPT_DRY)].hits() > 0) return;                      // not needed for a dry run
   cerr << "error: smtp server is required but not provided" << endl;
   exit(RC_MISSMTP);
  }
 }
 
 
-void append_email_header(CurlSmtp::Headers hdr, string hdr_str, SharedResource &r) {
+void setup_headers(SharedResource &r) {
+ // setup headers given in the command line: argument 'to', options -s and -H
+ REVEAL(r, opt, sm)
+
+ if(opt[ARG_TO].hits() > 0)
+  append_email_header(CurlSmtp::To, opt[ARG_TO].c_str(), r);    // append header 'To' from arg[0]
+
+ if(opt[CHR(OPT_SBJ)].hits() > 0)                               // append subj (if given)
+  sm.subject(opt[CHR(OPT_SBJ)].str());
+
+ parse_headers(r);
+}
+
+
+void setup_debug_control(SharedResource &r) {
+ // process all -D options: rate, sample and trunc controls
+ REVEAL(r, opt, DBG())
+
+ for(const auto &opt_dbc: opt[CHR(OPT_DBC)])
+  for(const auto &ctl: split_by(',', opt_dbc)) {
+   auto eq = ctl.find('=');
+   char *end;
+   auto val = eq == string::npos? 0: strtoul(ctl.c_str() + eq + 1, &end, 10);
+   if(eq == string::npos or *end != '\0' or end == ctl.c_str() + eq + 1)
+    { cerr << "fail: invalid debug control '" << ctl << "', ignoring" << endl; continue; }
+
+   string name = trim_spaces(ctl.substr(0, eq));
+   if(name == "rate") DBG().rate_limit(val);
+   else if(name == "sample") DBG().sample(val);
+   else if(name == "trunc") DBG().truncate(val);
+   else
+    { cerr << "fail: unrecognized debug control '" << ctl << "', ignoring" << endl; continue; }
+   DBG(0) DOUT() << "debug control '" << name << "': " << val << endl;
+  }
+}
+
+
+time_t scheduled_time(SharedResource &r) {
+ // return epoch stamp of the time given in -t, or -1 if -t is not given
+ REVEAL(r, opt, DBG())
+ if(opt[CHR(OPT_TIM)].hits() == 0) return -1;
+
+ try {
+  DateTime at{opt[CHR(OPT_TIM)].str()};
+  DBG(0) DOUT() << "sending is scheduled at: " << at.str() << endl;
+  return at.stamp();
+ }
+ catch(DateTime::stdException & e) {
+  cerr << "error: invalid time '" << opt[CHR(OPT_TIM)].str() << "': " << e.what() << endl;
+  exit(RC_INVTIM);
+ }
+}
+
+
+void parse_retries(SharedResource &r) {
+ // setup number of retries of temporary failures (-r)
+ REVEAL(r, opt)
+ char *end;
+ r.retries = strtoul(opt[CHR(OPT_RTR)].c_str(), &end, 10);
+ if(opt[CHR(OPT_RTR)].str().empty() or *end != '\0' or opt[CHR(OPT_RTR)].str().front() == '-') {
+  cerr << "error: invalid number of retries '" << opt[CHR(OPT_RTR)].str() << "'" << endl;
+  exit(RC_INVRTR);
+ }
+}
+
+
+void parse_bandwidth(SharedResource &r) {
+ // setup outbound bandwidth budget (-b), shared by all sends
+ REVEAL(r, opt, DBG())
+ if(opt[CHR(OPT_BWD)].hits() == 0) return;
+
+ const string &str = opt[CHR(OPT_BWD)].str();
+ char *end;
+ unsigned long long rate = strtoull(str.c_str(), &end, 10);
+ if(*end != '\0' and end[1] == '\0')
+  switch(*end) {
+   case 'm': case 'M': rate *= 1024; // fall through
+   case 'k': case 'K': rate *= 1024; ++end;
+  }
+ if(str.empty() or not isdigit(str.front()) or *end != '\0' or rate == 0) {
+  cerr << "error: invalid bandwidth '" << str << "'" << endl;
+  exit(RC_INVBWD);
+ }
+ Bandwidth::global().rate(rate);
+ DBG(0) DOUT() << "outbound bandwidth is capped at " << rate << " bytes/s" << endl;
+}
+
+
+void setup_dkim(SharedResource &r) {
+ // load DKIM private key (-k) once, all rendered emails are signed with it
+ #ifdef CMAIL_DKIM
+ REVEAL(r, opt, sm, DBG())
+ if(opt[CHR(OPT_DKM)].hits() == 0) return;
+
+ const string &str = opt[CHR(OPT_DKM)].str();
+ size_t colon = str.find(':');
+ if(colon == 0 or colon == string::npos or colon + 1 == str.size()) {
+  cerr << "error: invalid DKIM selector:key '" << str << "'" << endl;
+  exit(RC_INVDKM);
+ }
+ try { sm.dkim(make_shared<const Dkim>(str.substr(colon + 1), str.substr(0, colon))); }
+ catch(Dkim::stdException & e) {
+  cerr << "error: DKIM key '" << str.substr(colon + 1) << "': " << e.what() << endl;
+  exit(RC_INVDKM);
+ }
+ DBG(0) DOUT() << "DKIM signing with selector '" << str.substr(0, colon) << "', "
+               << sm.dkim()->algorithm() << endl;
+ #else
+ (void)r;
+ #endif
+}
+
+
+void setup_transport(SharedResource &r) {
+ // select transport delivering emails: a dry run (-n), the daemon (-c), or per
+ // argument `smtp' (see select_transport())
+ REVEAL(r, opt, sm, dry_file, dry, transport, DBG())
+ const string &dst = opt[ARG_SRV].str();
+ const char *env = getenv("CMAIL_SOCKET");
+ string socket = opt[CHR(OPT_CLT)].hits() > 0? opt[CHR(OPT_CLT)].str(): env == nullptr? "": env;
+
+ if(opt[CHR(OPT_DRY)].hits() > 0) {                             // emails are written, not sent
+  if(opt[CHR(OPT_DRY)].str() == "-") dry = &cout;
+  else {
+   dry_file.open(opt[CHR(OPT_DRY)].str(), ios::binary | ios::trunc);
+   if(not dry_file)
+    { cerr << "error: could not open dry run output '" << opt[CHR(OPT_DRY)].str() << "'" << endl; exit(RC_INVDRY); }
+   dry = &dry_file;
+  }
+  transport.reset(new DumpTransport(sm, *dry));
+ }
+ else if(not socket.empty() and dst.compare(0, 8, "maildir:") != 0 and
+         dst.compare(0, 5, "mbox:") != 0) {                     // those have nothing to keep warm
+  string dest = dst;
+  char cwd[PATH_MAX];
+  if(dest.compare(0, 5, "lmtp:") == 0 and dest.size() > 5 and dest[5] != '/' and
+     getcwd(cwd, sizeof(cwd)) != nullptr)
+   dest.insert(5, string(cwd) + "/");                           // daemon runs elsewhere
+  unique_ptr<DaemonTransport> daemon{new DaemonTransport(socket, dest,
+       opt[CHR(OPT_USR)].hits() > 0? opt[CHR(OPT_USR)].str(): "",
+       opt[CHR(OPT_PWD)].hits() > 0? opt[CHR(OPT_PWD)].str(): "", r.retries)};
+  if(daemon->connect()) transport = move(daemon);
+  else if(opt[CHR(OPT_CLT)].hits() > 0)
+   cerr << "fail: " << daemon->error() << ", sending directly" << endl;
+ }
+ if(transport == nullptr)
+  transport.reset(select_transport(dst, sm));
+ DBG().increment(+1, *transport, -1);
+ DBG(0) DOUT() << "delivering via '" << transport->name() << "'" << endl;
+}
+
+
+Transport * select_transport(const string &dst, CurlSmtp &sm) {
+ // make transport per argument `smtp': an smtp server (relay), or prefixed with
+ // `lmtp:', `maildir:', `mbox:' - a local delivery
+ auto local = [&dst](const char *prefix) {
+  size_t len = strlen(prefix);
+  return dst.size() > len and dst.compare(0, len, prefix) == 0? dst.substr(len): string();
+ };
+
+ if(not local("lmtp:").empty()) return new LmtpTransport(local("lmtp:"));
+ if(not local("maildir:").empty()) return new MaildirTransport(local("maildir:"));
+ if(not local("mbox:").empty()) return new MboxTransport(local("mbox:"));
+ sm.host(dst);
+ return new SmtpTransport(sm);
+}
+
+
+bool deliver(SharedResource &r, const Message &msg) {
+ return deliver(r, *r.transport, msg, r.retries);
+}
+
+
+bool deliver(SharedResource &r, Transport &tr, const Message &msg, unsigned retries) {
+ // send rendered email paced by the relay's throttle; retry temporary failures with
+ // a backoff delay (the email is sent as is, no re-rendering takes place); only
+ // relays are paced, local transports deliver at full speed
+ REVEAL(r, DBG())
+ Throttle *tp;
+ {
+  lock_guard<mutex> lck(r.throttle_mtx);
+  tp = &r.throttle[tr.name()];
+ }
+ Throttle &thr = *tp;                                           // also makes retry delays
+
+ for(unsigned attempt = 0;; ++attempt) {
+  if(tr.paced()) {
+   this_thread::sleep_for(chrono::duration<double>(thr.acquire()));
+  }
+  tr.send(msg);
+  auto outcome = not tr.failed()? Throttle::success:
+                  tr.transient()? Throttle::transient: Throttle::permanent;
+  if(tr.paced()) thr.feedback(outcome);
+  DBG(0) DOUT() << "attempt " << attempt << ": " << ENUMS(Throttle::Outcome, outcome)
+                << " (reply " << tr.response() << "), rate: " << thr.rate() << "/s" << endl;
+  if(outcome != Throttle::transient) return outcome == Throttle::success;
+  if(attempt >= retries) return false;
+
+  double delay = thr.backoff(attempt);
+  cerr << "fail: " << tr.error();
+  if(tr.response() > 0) cerr << " (reply " << tr.response() << ")";
+  cerr << ", retrying in " << round(delay * 10) / 10 << "s" << endl;
+  this_thread::sleep_for(chrono::duration<double>(delay));
+ }
+}
+
+
+volatile sig_atomic_t serving = 1;                              // cleared by SIGINT, SIGTERM
+
+int serve(SharedResource &r) {
+ // run as a daemon (-S): accept clients and read their requests (a request is a
+ // rendered email), requests are handed over to the workers of warm transports
+ // (one per relay, thus a slow relay holds no one else): the worker delivers the
+ // email and replies the outcome; release queued (scheduled) emails when due; exit
+ // on SIGINT, SIGTERM: received requests are delivered, queued emails are dropped
+ REVEAL(r, opt, pending, relays, DBG())
+ const string &path = opt[CHR(OPT_DMN)].str();
+ sockaddr_un sa{};
+ sa.sun_family = AF_UNIX;
+ if(path.empty() or path.size() >= sizeof(sa.sun_path))
+  { cerr << "error: invalid socket path '" << path << "'" << endl; return RC_INVSCK; }
+ memcpy(sa.sun_path, path.c_str(), path.size() + 1);
+
+ DaemonTransport probe(path, "");
+ if(probe.connect())
+  { cerr << "error: a daemon is already serving '" << path << "'" << endl; return RC_INVSCK; }
+ unlink(path.c_str());                                          // a stale socket, if any
+ int lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+ mode_t mask = umask(0077);                                     // the owner only
+ bool ok = lfd >= 0 and ::bind(lfd, reinterpret_cast<sockaddr *>(&sa), sizeof(sa)) == 0 and
+           listen(lfd, SOMAXCONN) == 0;
+ umask(mask);
+ if(not ok)
+  { cerr << "error: could not listen on '" << path << "': " << strerror(errno) << endl; return RC_INVSCK; }
+ fcntl(lfd, F_SETFD, FD_CLOEXEC);
+
+ catch_signals();
+ #ifdef __linux__
+ r.ring = ShmRing::create();
+ if(not r.ring) cerr << "fail: could not set up submission ring, ignoring" << endl;
+ #endif
+ DBG(0) DOUT() << "serving on '" << path << "'" << endl;
+
+ vector<shared_ptr<DaemonClient>> clients;
+ vector<pollfd> pfd;
+ while(serving) {
+  time_t wait = pending.empty()? -1:                            // seconds, capped: int msec
+                min<time_t>(max<time_t>(pending.next_due() - time(nullptr), 0), DMN_WAIT);
+  int timeout = wait < 0? -1: static_cast<int>(wait) * 1000;
+  pfd.assign({{lfd, POLLIN, 0}, {-1, POLLIN, 0}});
+  #ifdef __linux__
+  if(r.ring and not r.ring.stalled()) {
+   pfd[1].fd = r.ring.eventfd();
+   if(not r.ring.idle()) timeout = 0;                           // submissions are waiting
+  }
+  #endif
+  for(auto &cl: clients) pfd.push_back({cl->fd, POLLIN, 0});
+  int n = poll(pfd.data(), pfd.size(), timeout);
+  pending.advance(time(nullptr), [](function<void(void)> &&send){ send(); });
+  serve_ring(r);
+  if(n <= 0) continue;
+
+  for(size_t i = clients.size(); i-- > 0;)                      // drop disconnected clients
+   if(pfd[i + 2].revents != 0 and not serve_client(r, clients[i]))
+    { clients[i] = move(clients.back()); clients.pop_back(); }
+  if(not (pfd[0].revents & POLLIN)) continue;
+  int fd = accept(lfd, nullptr, nullptr);
+  if(fd < 0) continue;
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+  clients.push_back(make_shared<DaemonClient>(fd));
+  DBG(1) DOUT() << "clients: " << clients.size() << endl;
+ }
+
+ close(lfd);
+ unlink(path.c_str());
+ clients.clear();                                               // those awaiting reply are kept
+ if(not pending.empty())
+  cerr << "fail: " << pending.size() << " queued email(s) dropped" << endl;
+ for(auto &rl: relays) rl.second.worker.resize(0);              // deliver received requests
+ DBG(0) DOUT() << "stopped serving" << endl;
+ return RC_OK;
+}
+
+
+bool serve_client(SharedResource &r, shared_ptr<DaemonClient> &cl) {
+ // read client's data (w/o blocking), process the request once its frame is
+ // complete; false: the client is disconnected, or to be dropped (a broken request,
+ // or a new one sent before the reply)
+ typedef DaemonTransport D;
+ string &in = cl->in;
+ size_t got = in.size();
+ in.resize(got + DMN_READ);
+ ssize_t n = recv(cl->fd, &in[got], DMN_READ, MSG_DONTWAIT);
+ in.resize(got + max<ssize_t>(n, 0));
+ if(n < 0) return errno == EAGAIN or errno == EWOULDBLOCK or errno == EINTR;
+ if(n == 0 or __atomic_load_n(&cl->busy, __ATOMIC_ACQUIRE)) return false;
+ ssize_t len = D::frame_size(in.data(), in.size());
+ if(len <= 0) return len == 0;
+ if(static_cast<size_t>(len) != in.size()) return false;       // requests are not pipelined
+
+ vector<string> rq;
+ D::parse_frame(in.data(), in.size(), rq);
+ string().swap(in);                                             // the frame could be big
+ #ifdef __linux__
+ if(ShmRing::attach_request(rq))                                // a producer attaches the ring
+  { if(not r.ring.grant(cl->fd)) D::write_frame(cl->fd, {"fail", "0", "0", "daemon: no ring"}); return false; }
+ #endif
+ if(not D::valid_request(rq))
+  { D::write_frame(cl->fd, {"fail", "0", "0", "daemon: invalid request"}); return false; }
+
+ __atomic_store_n(&cl->busy, true, __ATOMIC_RELAXED);
+ process_request(r, rq, [cl](const vector<string> &rp) {
+                         __atomic_store_n(&cl->busy, false, __ATOMIC_RELEASE); // before the reply
+                         D::write_frame(cl->fd, rp);
+                        });
+ return true;
+}
+
+
+void serve_ring(SharedResource &r) {
+ // process requests submitted by local producers via the ring; requests are copied
+ // out of the ring first (thus the ring is not held by slow deliveries); there's no
+ // one to reply the outcome to, failures are reported here
+ #ifdef __linux__
+ REVEAL(r, ring, DBG())
+ typedef DaemonTransport D;
+ if(not ring or ring.stalled()) return;
+ vector<vector<string>> batch;
+ ring.drain([&batch](const char *ptr, size_t len) {
+             batch.emplace_back();
+             if(not D::parse_frame(ptr, len, batch.back())) batch.back().clear();
+            });
+ if(ring.stalled())
+  cerr << "fail: submission ring holds a malformed record, ring submissions are stopped" << endl;
+ DBG(1) if(not batch.empty()) DOUT() << "ring submissions: " << batch.size() << endl;
+
+ for(auto &rq: batch) {
+  if(not D::valid_request(rq))
+   { cerr << "fail: invalid ring submission, ignoring" << endl; continue; }
+  process_request(r, rq, [dest = rq[D::rq_dest]](const vector<string> &rp) {
+                          if(rp[D::rp_status] != "fail") return;
+                          cerr << "fail: ring submission to '" << dest << "': " << rp[D::rp_error];
+                          if(rp[D::rp_response] != "0") cerr << " (reply " << rp[D::rp_response] << ")";
+                          cerr << endl;
+                         });
+ }
+ #endif
+}
+
+
+void process_request(SharedResource &r, vector<string> &rq,
+                     function<void(const vector<string> &)> reply) {
+ // hand a valid request over to the relay's worker, which delivers it and replies;
+ // a request due later is queued (and replied right away)
+ REVEAL(r, pending, DBG())
+ typedef DaemonTransport D;
+ vector<string> rp{"fail", "0", "0", ""};
+ try {
+  SharedResource::Relay &rl = relay(r, rq[D::rq_dest], rq[D::rq_user], rq[D::rq_password]);
+  Message msg = Message::raw(rq[D::rq_from], vector<string>(rq.begin() + D::rq_rcpt, rq.end() - 1),
+                             move(rq.back()));
+  unsigned retries = strtoul(rq[D::rq_retries].c_str(), nullptr, 10);
+  time_t due = strtoll(rq[D::rq_due].c_str(), nullptr, 10);
+  DBG(0) DOUT() << "request to '" << rl.tr->name() << "', " << msg.size() << " bytes" << endl;
+
+  if(msg.empty()) rp[D::rp_error] = "daemon: failed setting recipients";
+  else if(due > time(nullptr)) {
+   pending.insert(due, [&r, &rl, msg, retries] {
+                        rl.worker.submit([&r, &rl, msg, retries]{ deliver(r, *rl.tr, msg, retries); });
+                       });
+   rp[D::rp_status] = "queued";
+  }
+  else {
+   rl.worker.submit([&r, &rl, msg = move(msg), retries, reply, rp]() mutable {
+                     Transport &tr = *rl.tr;
+                     try {
+                      bool ok = deliver(r, tr, msg, retries);
+                      rp = {ok? "ok": "fail", tr.transient()? "1": "0", to_string(tr.response()), tr.error()};
+                     }
+                     catch(CurlSmtp::stdException & e)
+                      { rp[D::rp_error] = string("CurlSmtp exception: ") + e.what(); }
+                     reply(rp);
+                    });
+   return;
+  }
+ }
+ catch(CurlSmtp::stdException & e)
+  { rp[D::rp_error] = string("CurlSmtp exception: ") + e.what(); }
+ reply(rp);
+}
+
+
+int listen_smtp(SharedResource &r) {
+ // run as a local smtp relay (-L): accept emails from local smtp clients, queue them
+ // in memory and relay upstream (argument `smtp') one after another over a single
+ // warm connection; exit on SIGINT, SIGTERM (once queued emails are relayed)
+ REVEAL(r, opt, DBG())
+ #ifdef __linux__
+ if(opt[ARG_TO].hits() > 0 and opt[ARG_SRV].hits() == 0)       // the sole argument is smtp
+  { opt[ARG_SRV] = opt[ARG_TO].str(); opt[ARG_TO].reset(); }
+ if(opt[ARG_SRV].hits() == 0)
+  { cerr << "error: smtp server is required but not provided" << endl; return RC_MISSMTP; }
+ if(opt[CHR(OPT_USR)].hits() > 0 and opt[CHR(OPT_PWD)].hits() == 0)
+  { cerr << "error: password is required but not provided" << endl; return RC_MISSPWD; }
+
+ SmtpListener srv;
+ DBG().increment(+1, srv, -1);
+ if(not srv.listen(opt[CHR(OPT_LSN)].str())) {
+  cerr << "error: could not listen on '" << opt[CHR(OPT_LSN)].str() << "': " << strerror(errno) << endl;
+  return RC_INVLSN;
+ }
+ SharedResource::Relay *rl;                                     // its worker relays in order
+ try { rl = &relay(r, opt[ARG_SRV].str(), opt[CHR(OPT_USR)].str(), trim_spaces(opt[CHR(OPT_PWD)].str())); }
+ catch(CurlSmtp::stdException & e)
+  { cerr << opt.prog_name() << " CurlSmtp exception: " << e.what() << endl; return e.code() + OFF_CSMTP; }
+
+ catch_signals();
+ size_t queued = 0;
+ DBG(0) DOUT() << "relaying to '" << rl->tr->name() << "'" << endl;
+
+ while(serving)
+  srv.poll(1000, [&r, rl, &queued](SmtpListener::Mail && m) {
+   if(__atomic_load_n(&queued, __ATOMIC_RELAXED) >= LSN_QUEUE) return false; // client retries later
+   Message msg = Message::raw(m.from, m.rcpt, move(m.text));
+   if(msg.empty()) return false;
+   __atomic_add_fetch(&queued, 1, __ATOMIC_RELAXED);
+   rl->worker.submit([&r, rl, msg, &queued] {
+                      if(not deliver(r, *rl->tr, msg, r.retries))
+                       cerr << "fail: relaying email from " << msg.from() << ": " << rl->tr->error() << endl;
+                      __atomic_sub_fetch(&queued, 1, __ATOMIC_RELAXED);
+                     });
+   return true;
+  });
+
+ DBG(0) DOUT() << "stopped listening, received: " << srv.received() << ", to relay: "
+               << __atomic_load_n(&queued, __ATOMIC_RELAXED) << endl;
+ rl->worker.resize(0);                                          // waits till all are relayed
+ return RC_OK;
+ #else
+ cerr << "error: option -" STR(OPT_LSN) " is supported on linux only" << endl;
+ return RC_INVLSN;
+ #endif
+}
+
+
+void catch_signals(void) {
+ // SIGINT, SIGTERM stop serving
+ struct sigaction sig{};
+ sig.sa_handler = [](int) { serving = 0; };                     // w/o SA_RESTART: poll() returns
+ sigaction(SIGINT, &sig, nullptr);
+ sigaction(SIGTERM, &sig, nullptr);
+ signal(SIGPIPE, SIG_IGN);
+}
+
+
+SharedResource::Relay &
+     relay(SharedResource &r, const string &dst, const string &user, const string &pwd) {
+ // return daemon's transport (and its worker) for the destination and credentials,
+ // make one if it's the first request there
+ REVEAL(r, relays, DBG())
+ auto &rl = relays[dst + '\n' + user + '\n' + pwd];
+ if(rl.tr == nullptr) {
+  rl.sm.reset(new CurlSmtp);
+  if(not user.empty()) rl.sm->ssl(user, pwd);
+  rl.tr.reset(select_transport(dst, *rl.sm));
+  rl.sm->DBG().severity(DBG().severity() + 2);                  // as increment(+1, .., -1), w/o
+  rl.tr->DBG().severity(DBG().severity() + 2);                  // altering mine: workers read it
+  DBG(0) DOUT() << "new transport '" << rl.tr->name() << "'" << endl;
+ }
+ return rl;
+}
+
+
+void release_pending(SharedResource &r) {
+ // wait for scheduled sends and release them once due; sends due at the same time
+ // go out back to back, reusing the connection
+ REVEAL(r, pending, DBG())
+
+ while(not pending.empty()) {
+  auto wait = pending.next_due() - time(nullptr);
+  if(wait > 0) {
+   DBG(1) DOUT() << "pending sends: " << pending.size() << ", sleeping " << wait << "s" << endl;
+   this_thread::sleep_for(chrono::seconds(wait));
+  }
+  auto released = pending.advance(time(nullptr), [](function<void(void)> &&send){ send(); });
+  DBG(0) if(released > 0) DOUT() << "released sends: " << released << endl;
+ }
+}
+
+
+void send_manifest(SharedResource &r) {
+ // go over manifest lines: send right away those not scheduled (-t), schedule others;
+ // each scheduled send keeps only the line's offset: the line is re-read when due
+ REVEAL(r, opt, ol, manifest, pending, DBG())
+
+ manifest.open(opt[CHR(OPT_MNF)].str());
+ if(not manifest)
+  { cerr << "error: could not open manifest '" << opt[CHR(OPT_MNF)].str() << "'" << endl; exit(RC_INVMNF); }
+ ol.format(opt);
+ time_t due = scheduled_time(r);
+
+ string line;
+ size_t ln = 0;                                                 // line number
+ for(streamoff pos = manifest.tellg(); getline(manifest, line); pos = manifest.tellg()) {
+  if(not parse_manifest_line(r, line, ++ln)) continue;
+
+  time_t at = due;
+  if(ol.hits(CHR(OPT_TIM)) > 0)
+   try { at = DateTime(ol.str(CHR(OPT_TIM))).stamp(); }
+   catch(DateTime::stdException & e) {
+    cerr << "fail: manifest line " << ln << ": invalid time '" << ol.str(CHR(OPT_TIM))
+         << "': " << e.what() << ", ignoring" << endl;
+    continue;
+   }
+
+  if(at < 0) { send_manifest_line(r, ln); continue; }
+  DBG(1) DOUT() << "line " << ln << " is scheduled at: " << DateTime(at).str() << endl;
+  pending.insert(at, [&r, pos, ln] {
+                      string line;
+                      r.manifest.clear();
+                      r.manifest.seekg(pos);
+                      if(getline(r.manifest, line) and parse_manifest_line(r, line, ln))
+                       send_manifest_line(r, ln);
+                     });
+ }
+
+ release_pending(r);
+}
+
+
+bool parse_manifest_line(SharedResource &r, const string &line, size_t ln) {
+ // parse the line into r.ol; false: a blank line or the line is invalid
+ REVEAL(r, ol)
+
+ try { ol.parse(line); }
+ catch(OptLine::stdException & e) {
+  cerr << "fail: manifest line " << ln << ": " << e.what();
+  if(ol.exception() != 0) cerr << " '-" << ol.exception() << "'";
+  cerr << ", ignoring" << endl;
+  return false;
+ }
+ if(ol.tokens() == 0) return false;                             // blank or comment line
+
+ char inapt = 0;                                                // inapplicable option
+ ol.for_each_option([&inapt](char o) {
+                     if(not (o AMONG(static_cast<char>(CHR(OPT_ATT)), CHR(OPT_APH), CHR(OPT_SBJ), CHR(OPT_TIM))))
+                      inapt = o;
+                    });
+ if(inapt != 0 or ol.arguments() > 1) {
+  cerr << "fail: manifest line " << ln << ": ";
+  if(inapt != 0) cerr << "option -" << inapt << " is not applicable";
+  else cerr << "too many arguments";
+  cerr << ", ignoring" << endl;
+  return false;
+ }
+ return true;
+}
+
+
+void send_manifest_line(SharedResource &r, size_t ln) {
+ // build and send email per command line options and the manifest line (in r.ol)
+ REVEAL(r, opt, sm, ol, DBG())
+ DBG(0) DOUT() << "sending manifest line " << ln << endl;
+
+ sm.reset();
+ setup_headers(r);
+ if(ol.arguments() > 0)
+  append_email_header(CurlSmtp::To, ol.arg(0), r);
+ if(ol.hits(CHR(OPT_SBJ)) > 0)
+  sm.subject(ol.str(CHR(OPT_SBJ)));
+ ol.for_each(CHR(OPT_APH), [&r](const char *hdr) { apply_header(hdr, r); });
+ for(auto &file: opt[CHR(OPT_ATT)])
+  sm.attach_file(file);
+ ol.for_each(CHR(OPT_ATT), [&sm](const char *file) { sm.attach_file(file); });
+
+ try { deliver(r, sm.render(r.input)); }
+ catch (CurlSmtp::stdException & e) {
+  cerr << "fail: manifest line " << ln << ": CurlSmtp exception: " << e.what() << endl;
+  sm.reset();
+  ++r.failed;
+  return;
+ }
+ if(r.transport->failed())
+  { cerr << "fail: manifest line " << ln << ": sending error: " << r.transport->error() << endl; ++r.failed; }
+}
+
+
+void append_email_header(CurlSmtp::Headers hdr, const char *hdr_str, SharedResource &r) {
  // add to the header (hdr) one by one emails listed (over comma) in hdr_str
  REVEAL(r, sm, DBG())
 
  // append header string to additive header (to, cc, bcc)
- for(const auto & email: split_by(',', hdr_str))
-  if(email.find("@") != string::npos) {
+ for(const char *next = hdr_str; next != nullptr;) {
+  const char *begin = next, *end = strchr(begin, ',');
+  next = end == nullptr? nullptr: end + 1;
+  if(end == nullptr) end = begin + strlen(begin);
+  trim_spaces(begin, end);
+  if(begin == end) continue;                                    // empty lexemes are not recorded
+
+  string email(begin, end);
+  if(memchr(begin, '@', end - begin) != nullptr) {
    DBG(1) DOUT() << ENUMS(CurlSmtp::Headers, hdr) << ": " << email << endl;
    sm.add_header(hdr, email);
   }
   else
    cerr << "fail: email '" << email << "' does not seem to be valid, ignoring" << endl;
+ }
 }
 
 
 void parse_headers(SharedResource &r) {
  // process all -H options
- REVEAL(r, opt, sm, DBG())
-
- for(const auto &opt_hdr: opt[CHR(OPT_APH)]) {                  // go over all -H options
-  auto header = match_header(opt_hdr.substr(0, opt_hdr.find(':')));
+ REVEAL(r, opt, sm)
 
-  if(header AMONG(CurlSmtp::Date, CurlSmtp::end_of_headers))    // -H "Date: ..." is unsupported
-   { cerr << "fail: unrecognized header in '" << opt_hdr << "', ignoring" << endl; continue; }
-
-  if(header AMONG(CurlSmtp::From, CurlSmtp::Subject)) {         // -H "From:..." & -H "Subject:..."
-   sm.add_header(header, trim_spaces(opt_hdr.substr(opt_hdr.find(':') + 1)));   // are overridable
-   DBG(1) DOUT() << "appended '" << ENUMS(CurlSmtp::Headers, header) << "': "
-                 << trim_spaces(opt_hdr.substr(opt_hdr.find(':') + 1)) << endl;
-  }
-  else                                                          // must be either to/cc/bcc
-   append_email_header(header, opt_hdr.substr(opt_hdr.find(':') + 1), r);   // those are append-able
- }
+ for(const auto &opt_hdr: opt[CHR(OPT_APH)])                    // go over all -H options
+  apply_header(opt_hdr.c_str(), r);
 
  if(sm.from().empty())                                          // -H 'From: ...' is not given
   try_recovering_from(r);                                       // then recover from -u
 }
 
 
-CurlSmtp::Headers match_header(string hdr_str) {
- // map header in string (hdr_str) to value CurlSmtp::Headers
-
- transform(hdr_str.begin(), hdr_str.end(), hdr_str.begin(), ::tolower);
- hdr_str.front() = toupper(hdr_str.front());                    // capitalize first char
-
- for(int h = 0; static_cast<CurlSmtp::Headers>(h) < CurlSmtp::end_of_headers; ++h)
-  if(hdr_str == ENUMS(CurlSmtp::Headers, h))
-   return static_cast<CurlSmtp::Headers>(h);
-
- return CurlSmtp::end_of_headers;
+void apply_header(const char *opt_hdr, SharedResource &r) {
+ // process a single -H option: standard headers are matched case-insensitively, others
+ // are added as custom headers
+ REVEAL(r, sm, DBG())
+ const char *colon = strchr(opt_hdr, ':');
+ if(colon == nullptr)
+  { cerr << "fail: unrecognized header in '" << opt_hdr << "', ignoring" << endl; return; }
+ const char *name = opt_hdr, *name_end = colon;
+ const char *value = colon + 1, *value_end = value + strlen(value);
+ trim_spaces(name, name_end);
+ trim_spaces(value, value_end);
+
+ auto header = CurlSmtp::match_header(name, name_end - name);
+ if(header == CurlSmtp::Date or                                 // -H "Date: ..." is unsupported
+    (header == CurlSmtp::end_of_headers and not CurlSmtp::valid_header_name(name, name_end - name)))
+  { cerr << "fail: unrecognized header in '" << opt_hdr << "', ignoring" << endl; return; }
+
+ if(header AMONG(CurlSmtp::To, CurlSmtp::Cc, CurlSmtp::Bcc))    // those are append-able
+  { append_email_header(header, value, r); return; }
+
+ string str(value, value_end);                                  // -H "From:..." & -H "Subject:..."
+ sm.add_header(name, name_end - name, str);                     // and custom ones are overridable
+ DBG(1) DOUT() << "appended '" << string(name, name_end) << "': " << str << endl;
 }
 
 
@@ -302,6 +1093,13 @@ string trim_spaces(std::string str) {
 }
 
 
+void trim_spaces(const char *&begin, const char *&end) {
+ // trim all surrounding spaces in range [begin, end)
+ while(begin < end and strchr(SPACES, *begin) != nullptr) ++begin;
+ while(end > begin and strchr(SPACES, end[-1]) != nullptr) --end;
+}
+
+
 
 
 
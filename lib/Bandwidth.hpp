@@ -0,0 +1,141 @@
+/*
+ * a process wide outbound bandwidth budget shared by concurrent transfers: a lock-
+ * free token bucket (tokens are bytes) refilled at the configured rate
+ *
+ * a transfer asks for bytes with take() and gets back the number of bytes it may
+ * send right away (blocks if the budget is exhausted); each grant is capped to
+ * transfer's fair share of the bucket (the bucket divided by the number of active
+ * transfers), thus the budget is redistributed dynamically as transfers start and
+ * finish: a sole transfer may use the whole rate, N transfers get 1/N each, while
+ * the aggregate egress stays at the cap; a transfer waits rather than takes a tiny
+ * grant (less than a quarter of its share), thus transfers do not spin on a nearly
+ * empty bucket
+ *
+ * transfers are accounted with Bandwidth::Transfer (RAII) object
+ *
+ * both take() and refilling are lock-free (CAS based), thus many transfers (from
+ * many threads) could draw from the same bucket w/o contending on a mutex
+ *
+ *
+ * SYNOPSIS:
+ *  Bandwidth::global().rate(2 * 1024 * 1024);          // 2MB/s for all transfers
+ *
+ *  // in transfer's thread:
+ *  Bandwidth::Transfer t(Bandwidth::global());
+ *  while(left > 0) {
+ *   size_t n = Bandwidth::global().take(std::min(left, buf_size));
+ *   send(ptr, n); ptr += n; left -= n;
+ *  }
+ *
+ */
+
+#pragma once
+
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <stdint.h>
+
+
+
+#define BW_BURST_MS 50                                          // bucket size in ms of rate
+#define BW_MIN_GRANT 1024                                       // smallest share (bytes)
+#define BW_LEAST_DIV 4                                          // least grant: 1/4 of share
+
+class Bandwidth {
+ public:
+    class Transfer {                                            // account an active transfer
+     public:
+                            Transfer(Bandwidth &bw): bw_(bw) { ++bw_.active_; }
+                            Transfer(const Transfer &) = delete;
+                           ~Transfer(void) { --bw_.active_; }
+        Transfer &          operator=(const Transfer &) = delete;
+     private:
+        Bandwidth &         bw_;
+    };
+
+                        Bandwidth(uint64_t rate = 0) { this->rate(rate); }
+
+    static Bandwidth &  global(void) { static Bandwidth bw; return bw; }
+
+    Bandwidth &         rate(uint64_t bps) {                    // bytes/sec, 0: unlimited
+                         rate_ = bps;
+                         tokens_ = burst_();
+                         stamp_ = now_();
+                         return *this;
+                        }
+    uint64_t            rate(void) const { return rate_; }
+    bool                limited(void) const { return rate_ > 0; }
+    int                 active(void) const { return active_; }
+
+    size_t              take(size_t want);                      // bytes granted (> 0)
+
+ private:
+    static int64_t      now_(void) {                            // monotonic nanoseconds
+                         return std::chrono::duration_cast<std::chrono::nanoseconds>
+                                 (std::chrono::steady_clock::now().time_since_epoch()).count();
+                        }
+    int64_t             burst_(void) const
+                         { return std::max<int64_t>(rate_ * BW_BURST_MS / 1000, BW_MIN_GRANT); }
+    void                refill_(void);
+
+    std::atomic<uint64_t>
+                        rate_{0};
+    std::atomic<int64_t>
+                        tokens_{0};                             // bytes available
+    std::atomic<int64_t>
+                        stamp_{0};                              // time tokens are refilled to
+    std::atomic<int>    active_{0};                             // transfers in progress
+};
+
+
+
+size_t Bandwidth::take(size_t want) {
+ // grant up to 'want' bytes (but no more than a fair share of the bucket); if the
+ // bucket is empty, wait till it's refilled
+ uint64_t rate = rate_;
+ if(rate == 0 or want == 0) return want;
+
+ int64_t share = std::max<int64_t>(burst_() / std::max(active_.load(), 1), BW_MIN_GRANT);
+ int64_t ask = std::min<int64_t>(want, share);
+ int64_t least = std::min<int64_t>(ask, share / BW_LEAST_DIV);  // do not trickle tiny grants
+ while(true) {
+  refill_();
+  int64_t avail = tokens_.load();
+  if(avail < least) {                                           // wait till enough is refilled
+   std::this_thread::sleep_for(std::chrono::nanoseconds((least - avail) * 1000000000 / rate));
+   continue;
+  }
+  int64_t grant = std::min(ask, avail);
+  if(tokens_.compare_exchange_weak(avail, avail - grant))
+   return grant;
+ }
+}
+
+
+void Bandwidth::refill_(void) {
+ // add tokens accrued since the last refill; only whole bytes are added: the stamp
+ // advances by the time those bytes took, thus no fraction is lost
+ uint64_t rate = rate_;
+ int64_t now = now_(), stamp = stamp_.load(), burst = burst_();
+ int64_t elapsed = now - stamp, bytes, next;
+ if(elapsed >= 1000000000)                                      // idle for long: bucket is full
+  { bytes = burst; next = now; }
+ else {
+  bytes = elapsed * static_cast<int64_t>(rate) / 1000000000;
+  if(bytes <= 0) return;
+  next = stamp + bytes * 1000000000 / static_cast<int64_t>(rate);
+ }
+ if(not stamp_.compare_exchange_strong(stamp, next))
+  return;                                                       // other thread has refilled
+
+ int64_t t = tokens_.fetch_add(bytes) + bytes;
+ while(t > burst and not tokens_.compare_exchange_weak(t, burst))
+  ;                                                             // cap at bucket size
+}
+
+
+#undef BW_BURST_MS
+#undef BW_MIN_GRANT
+#undef BW_LEAST_DIV
@@ -21,12 +21,24 @@
 #include <sstream>
 #include <iomanip>
 #include <vector>
-#include <map>
+#include <memory>               // std::shared_ptr
+#include <map>                  // interned attachments
+#include <mutex>
+#include <sys/stat.h>           // attachment's identity
+#include <future>               // std::shared_future (segments being encoded)
+#include <random>               // mime boundary
+#include <strings.h>            // strncasecmp
 #include <algorithm>            // std::any_of, ...
 #include <curl/curl.h>
 #include "extensions.hpp"
 #include "dbg.hpp"
 #include "IBtime.hpp"           // required to generate date stamp for CurlSmtp
+#include "Bandwidth.hpp"        // outbound bandwidth budget for CurlSmtp
+#include "ThreadPool.hpp"       // parallel encoding of big mime parts
+#include "FileReader.hpp"       // reading attachments ahead
+#ifdef CMAIL_DKIM
+#include "Dkim.hpp"             // requires linking with -lcrypto
+#endif
 
 
 
@@ -212,42 +224,137 @@ size_t Curl::trivial_write_(char *ptr, size_t size, size_t n, Curl *me) {
  *     .add_to("user1@some.net")
  *     .send("Message ...\nBest regards,\n/Yours ...");
  *
- * After send()'ing all headers have to be re-set again.
+ * After send()'ing all headers have to be re-set again. A prepared (but not yet sent)
+ * mail could be dropped with reset(), the connection settings are retained.
+ *
+ * Uploads of all CurlSmtp objects (in all threads) draw from Bandwidth::global() budget
+ * (unlimited by default), see "Bandwidth.hpp"
+ *
+ * Attached files are read ahead (in the background) from attach_file() on, see
+ * "FileReader.hpp"; big mime parts (attachments) are base64 encoded in chunks on
+ * ThreadPool::global() in the background, send() uploads chunks as soon as those are
+ * encoded
+ *
+ * warm_up() connects to the server (DNS, TCP, TLS, EHLO and AUTH) in the background, the
+ * connection is then reused by send(); thus the handshakes overlap with preparing the
+ * mail (reading input, encoding attachments); send() waits for the warm up to finish
+ *
+ * If compiled with -DCMAIL_DKIM (requires linking with -lcrypto), rendered mails are
+ * DKIM signed once a signer is set with dkim(), see "Dkim.hpp"
+ *
+ * SYNOPSIS: render mail once, send many times (e.g. retry, or send via other relay)
+ *   Message m = sm.from("user@gmail.com")
+ *                 .add_to("user1@some.net")
+ *                 .attach_file("report.pdf")
+ *                 .render("Message ...");               // headers, mime, base64 - all done here
+ *   sm.reset();
+ *   if(sm.send(m).rc() != CURLE_OK)
+ *    backup_sm.send(m);                                 // no re-encoding takes place
  */
 
 #define CS_EOL "\r\n"
 #define MIME_ENCODER "base64"
+#define MIME_LINE 76                                            // max base64 line length
+#define MIME_CHUNK (57 * 4096)                                  // encoded in parallel, whole lines
+#define CS_UPLOAD_BUF (64 * 1024)                               // as curl's upload buffer
+
+
+
+class Message {
+ // an immutable rendered mail: envelope (sender, recipients) and the mail text itself
+ // (headers, mime boundaries and encoded parts), held in a list of segments; copies
+ // share the rendered data (ref-counted), thus are cheap and thread-safe to send;
+ // a segment might be still being encoded (in the background), reading it waits
+ // till it's ready
+    friend class CurlSmtp;
+
+ public:
+    typedef std::shared_future<std::string> Segment;
+
+    bool                empty(void) const { return r_ == nullptr; }
+    const std::string & from(void) const { return r_->from; }
+    const curl_slist *  recipients(void) const { return r_->rcpt; }
+    const std::vector<Segment> &
+                        segments(void) const { return r_->seg; }
+    size_t              size(void) const { return r_ == nullptr? 0: r_->size; }
+    std::string         str(void) const {                       // whole mail text
+                         std::string s;
+                         s.reserve(size());
+                         if(r_ != nullptr) for(auto &seg: r_->seg) s += seg.get();
+                         return s;
+                        }
+    static Message      raw(const std::string & from, const std::vector<std::string> & rcpt,
+                            std::string && text);               // a mail rendered elsewhere
+
+ private:
+    struct Rendered_ {
+                            Rendered_(void) = default;
+                            Rendered_(const Rendered_ &) = delete;
+                           ~Rendered_(void) { curl_slist_free_all(rcpt); }
+        Rendered_ &         operator=(const Rendered_ &) = delete;
+
+        Rendered_ &         add(std::string && str) {
+                             size += str.size();
+                             seg.push_back(segment_(std::move(str)));
+                             return *this;
+                            }
+        Rendered_ &         add(const std::vector<Segment> &s, size_t len) { // len: total size
+                             size += len;
+                             seg.insert(seg.end(), s.begin(), s.end());
+                             return *this;
+                            }
+
+        std::string         from;                               // envelope sender
+        curl_slist *        rcpt{nullptr};                      // envelope recipients
+        std::vector<Segment>
+                            seg;
+        size_t              size{0};
+    };
+
+    static Segment      segment_(std::string && str) {          // segment ready right away
+                         std::promise<std::string> ready;
+                         ready.set_value(std::move(str));
+                         return ready.get_future().share();
+                        }
+
+    std::shared_ptr<const Rendered_>
+                        r_;
+};
+
+
 
 class CurlSmtp {
     friend void         swap(CurlSmtp &l, CurlSmtp &r) {
                          using std::swap;                       // enable ADL
+                         l.settle_();                           // warm up refers to the object
+                         r.settle_();
                          swap(l.curl_, r.curl_);
                          swap(l.recipients_, r.recipients_);
                          swap(l.ssl_, r.ssl_);
                          swap(l.username_, r.username_);
                          swap(l.password_, r.password_);
                          swap(l.headers_, r.headers_);
-                         swap(l.hi_, r.hi_);
+                         swap(l.custom_, r.custom_);
+                         swap(l.customs_, r.customs_);
                          swap(l.scheme_, r.scheme_);
                          swap(l.host_, r.host_);
-                         swap(l.separator_sent_, r.separator_sent_);
-                         swap(l.mbi_, r.mbi_);
-                         swap(l.mei_, r.mei_);
+                         swap(l.files_, r.files_);
+                         swap(l.reader_, r.reader_);
+ #ifdef CMAIL_DKIM
+                         swap(l.dkim_, r.dkim_);
+ #endif
+                         swap(l.feed_, r.feed_);
                         }
 
-    #define MIMESETUP \
-                plain_text, \
-                mime_parts
-    ENUM(MimeSetup, MIMESETUP)
-
  public:
     #define THROWREASON \
                 curlsmpt_failed_adding_header, \
                 curlsmtp_host_unset, \
                 curlsmtp_recipients_unset, \
                 curlsmtp_setopt_falure, \
-                mime_initialization_failure, \
-                mime_setup_failure, \
+                attachment_read_failure, \
+                message_not_rendered, \
+                message_signing_failure, \
                 end_of_throw
     ENUMSTR(ThrowReason, THROWREASON)
 
@@ -261,7 +368,10 @@ class CurlSmtp {
                 end_of_headers
     ENUMSTR(Headers, HEADERS)
 
-    typedef std::map<Headers, std::string> headersMap;
+    struct CustomHeader {                                       // non-standard headers
+        std::string         name;
+        std::string         value;
+    };
 
 
                         CurlSmtp(void)                          // DC
@@ -279,37 +389,62 @@ class CurlSmtp {
     // class interface
     CURLcode            rc(void) const { return curl_.rc(); }
     const char *        error(void) { return curl_.error(); }
+    long                response(void);                         // last smtp reply code
+    bool                transient(void);                        // last send failed temporarily
 
     // send mail specific interface (preparing a mail)
     CurlSmtp &          host(const std::string & server) { host_ = server; return *this; }
     const std::string & host(void) const { return host_; }
 
     CurlSmtp &          add_header(Headers header, const std::string & value);
-    const headersMap &  headers(void) const { return headers_; };
+    CurlSmtp &          add_header(const char *name, size_t len, const std::string & value);
+    const std::string & header(Headers h) const { return headers_[h]; }
+    size_t              custom_headers(void) const { return customs_; }
+    const CustomHeader &
+                        custom_header(size_t i) const { return custom_[i]; }
+
+    static Headers      match_header(const char *name, size_t len); // case-insensitive
+    static bool         valid_header_name(const char *name, size_t len); // per RFC5322
 
     CurlSmtp &          from(const std::string & str) { return add_header(From, str); }
-    const std::string & from(void) const { return headers_.at(From); }
+    const std::string & from(void) const { return headers_[From]; }
 
     CurlSmtp &          subject(const std::string & str) { return add_header(Subject, str); }
-    const std::string & subject(void) const { return headers_.at(Subject); }
+    const std::string & subject(void) const { return headers_[Subject]; }
 
     CurlSmtp &          add_to(const std::string & str) { return add_header(To, str); };
-    const std::string & to(void) const { return headers_.at(To); }
+    const std::string & to(void) const { return headers_[To]; }
 
     CurlSmtp &          add_cc(const std::string & str) { return add_header(Cc, str); }
-    const std::string & cc(void) const { return headers_.at(Cc); }
+    const std::string & cc(void) const { return headers_[Cc]; }
 
     CurlSmtp &          add_bcc(const std::string & str) { return *this; }
-    const std::string & bcc(void) const { return headers_.at(Bcc); }
-
-    CurlSmtp &          attach_file(std::string str)
-                         { files_.emplace_back(str); return *this; }
+    const std::string & bcc(void) const { return headers_[Bcc]; }
+
+    CurlSmtp &          attach_file(std::string path);
+    CurlSmtp &          reset(void) {                           // drop headers, recipients, files
+                         curl_slist_free_all(recipients_);
+                         init_headers_();
+                         files_.clear();
+                         reader_->clear();
+                         return *this;
+                        }
 
     CurlSmtp &          ssl(const std::string &, const std::string &); // ssl (username/pass)
     CurlSmtp &          ssl_reset(void) { ssl_ = false; scheme_ = "smtp://"; return *this; }
+ #ifdef CMAIL_DKIM
+    CurlSmtp &          dkim(std::shared_ptr<const Dkim> signer)  // sign rendered mails
+                         { dkim_ = std::move(signer); return *this; }
+    const std::shared_ptr<const Dkim> &
+                        dkim(void) const { return dkim_; }
+ #endif
 
     // send email
-    CurlSmtp &          send(const std::string & msg);
+    CurlSmtp &          warm_up(void);                          // connect ahead of send()
+    Message             render(const std::string & msg);        // render prepared mail
+    CurlSmtp &          send(const Message & m);                // send rendered mail
+    CurlSmtp &          send(const std::string & msg);          // render, send and reset
+    CurlSmtp &          dump(const Message & m, std::ostream & out); // write mail as uploaded
 
     DEBUGGABLE()
     EXCEPTIONS(ThrowReason)                                     // see "enums.hpp"
@@ -323,24 +458,90 @@ class CurlSmtp {
     std::string         password_;
 
  private:
-    CurlSmtp &          send_mime_(const std::string & msg);
-    void                setup_mime_parts_(const std::string & msg);
-    void                setup_send_options_(MimeSetup opt=plain_text);
+    void                render_headers_(std::string &hdr) const;
+    void                render_mime_(Message::Rendered_ &r, std::string &hdr,
+                                     const std::string & msg) const;
+    void                setup_send_options_(const Message & m);
+    void                setup_connect_options_(std::vector<CURLcode> &r);
+    void                settle_(void) { if(warm_.valid()) warm_.get(); } // wait for warm up
     std::string         date_str_(void);
+    static void         render_text_(const std::string & msg, std::string &dst);
+    static const char * content_type_(const std::string & name); // by extension, as libcurl
+    static void         base64_(const char *src, size_t len, std::string &dst);
+    static size_t       base64_size_(size_t len) {              // encoded size with line breaks
+                         size_t enc = (len + 2) / 3 * 4;
+                         return enc + (enc + MIME_LINE - 1) / MIME_LINE * 2;
+                        }
+    struct Encoded_ {                                           // base64 encoded mime part data
+        std::vector<Message::Segment>
+                            seg;
+        size_t              size{0};
+    };
+    struct FileId_ {                                            // identity of file's content
+        dev_t               dev;
+        ino_t               ino;
+        int64_t             mtime;                              // nanoseconds
+        off_t               size;
+        bool                operator==(const FileId_ &r) const
+                             { return dev == r.dev and ino == r.ino and
+                                      mtime == r.mtime and size == r.size; }
+    };
+    struct Attachment_ {
+        std::string         path;
+        FileId_             id;
+        bool                known;                              // id is valid (file was stat'ed)
+        size_t              h;                                  // reader_'s handle
+        std::shared_ptr<const Encoded_>
+                            enc;                                // interned encoding (if any)
+    };
+
+    static std::shared_ptr<const Encoded_>
+                        encode_(std::shared_ptr<const char> data, size_t len);
+    static std::shared_ptr<const Encoded_>
+                        interned_(const std::string &path, const FileId_ &id,
+                                  std::shared_ptr<const Encoded_> enc = nullptr);
     void                init_headers_(void);
     static size_t       feed_payload_(char *ptr, size_t size, size_t n, CurlSmtp *myself);
+    static constexpr unsigned
+                        hash_header_(const char *name, size_t len) // perfect for HEADERS
+                         { return (len * 7 + (name[0] | 0x20) + (name[len - 1] | 0x20)) & 7; }
+    static constexpr bool
+                        perfect_hash_(int h = 0) {              // asserted in match_header()
+                         return h >= end_of_headers or
+                                (hdr_slot_[hash_header_(Headers_str[h], cstrlen_(Headers_str[h]))] == h
+                                 and perfect_hash_(h + 1));
+                        }
+    static constexpr size_t
+                        cstrlen_(const char *s) { return *s == '\0'? 0: 1 + cstrlen_(s + 1); }
 
-    headersMap          headers_;
-    int                 hi_;                                    // headers iterator
+    static constexpr Headers
+                        hdr_slot_[8]                            // hash_header_ -> Headers
+                         { Subject, To, Bcc, end_of_headers, Cc, Date, end_of_headers, From };
+
+    std::string         headers_[end_of_headers];               // standard headers
+    std::vector<CustomHeader>
+                        custom_;                                // slots are reused across mails
+    size_t              customs_{0};                            // slots in use
     std::string         scheme_{"smtp://"};
     std::string         host_;                                  // smtp host (mail server)
-    bool                separator_sent_{false};                 // headers from body (RFC5322)
-    std::string::const_iterator
-                        mbi_;
-    std::string::const_iterator
-                        mei_;
-    std::vector<std::string>
+    std::vector<Attachment_>
                         files_;
+    std::unique_ptr<FileReader>
+                        reader_{new FileReader};                // reads files_
+ #ifdef CMAIL_DKIM
+    std::shared_ptr<const Dkim>
+                        dkim_;                                  // shared signer (key)
+    void                dkim_sign_(Message::Rendered_ &r) const;
+ #endif
+    struct {                                                    // feed_payload_ state:
+        const Message::Rendered_ *
+                            msg{nullptr};                       // mail being sent
+        size_t              seg{0};                             // current segment
+        size_t              off{0};                             // offset in segment
+        size_t              sent{0};                            // total bytes fed
+        bool                metered{false};                     // draws from bandwidth budget
+    }                   feed_;
+    std::future<void>   warm_;                                  // connecting in the background
 
 };
 
@@ -350,6 +551,24 @@ STRINGIFY(CurlSmtp::ThrowReason, THROWREASON)
 STRINGIFY(CurlSmtp::Headers, HEADERS)
 #undef HEADERS
 
+constexpr CurlSmtp::Headers CurlSmtp::hdr_slot_[];
+
+
+
+Message Message::raw(const std::string & from, const std::vector<std::string> & rcpt,
+                     std::string && text) {
+ // wrap a mail text rendered elsewhere (e.g. received from another process) along
+ // with its envelope; an empty Message is returned if recipients could not be set
+ auto r = std::make_shared<Rendered_>();
+ r->from = from;
+ for(auto &rc: rcpt)
+  if((r->rcpt = curl_slist_append(r->rcpt, rc.c_str())) == nullptr) return Message();
+ r->add(std::move(text));
+ Message m;
+ m.r_ = std::move(r);
+ return m;
+}
+
 
 
 CurlSmtp & CurlSmtp::ssl(const std::string &u, const std::string &p) {
@@ -364,23 +583,57 @@ CurlSmtp & CurlSmtp::ssl(const std::string &u, const std::string &p) {
 
 
 CurlSmtp & CurlSmtp::send(const std::string & msg) {
- // if file attachment is given, or message (msg) is outside of ascii char set,
- // divert to mime type of sending, otherwise default to plain text send and:
- // add Date header, setup send options and send mail
-
+ // render the prepared mail (adding Date header), send it and drop the prepared mail
  if(host_.empty()) throw EXP(curlsmtp_host_unset);
  if(recipients_ == nullptr) throw EXP(curlsmtp_recipients_unset);
- add_header(Date, date_str_());                                 // generate date
 
- if(not files_.empty() or std::any_of(msg.begin(), msg.end(), [](char c){ return c<0; }))
-  return send_mime_(msg);
+ Message m = render(msg);
+ try { send(m); }
+ catch(...) { reset(); throw; }
+ return reset();                                                // clean up after sending
+}
+
+
+CurlSmtp & CurlSmtp::warm_up(void) {
+ // start connecting to the server (resolve, connect, TLS, EHLO and AUTH - if ssl)
+ // in the background: the connection is established by a transfer issuing a sole
+ // NOOP command (w/o it libcurl would issue HELP, which many servers reject with
+ // 502 and curl then drops the connection), it's cached by the curl handle and
+ // reused by the next send(); a failure is not reported here - then send()
+ // connects again (and reports it)
+ if(host_.empty() or warm_.valid()) return *this;
+ warm_ = std::async(std::launch::async, [this] {
+          std::vector<CURLcode> r;
+          setup_connect_options_(r);
+          r.push_back(curl_.setopt(CURLOPT_UPLOAD, 0L).rc());
+          r.push_back(curl_.setopt(CURLOPT_MAIL_RCPT, nullptr).rc()); // otherwise it's VRFY
+          r.push_back(curl_.setopt(CURLOPT_CUSTOMREQUEST, "NOOP").rc()); // otherwise it's HELP
+          if(std::all_of(r.begin(), r.end(), [](CURLcode cc) { return cc == CURLE_OK; }))
+           curl_.perform();
+          DBG(0) DOUT() << "warmed up connection to " << scheme_ << host_ << ": " << error() << std::endl;
+          curl_.setopt(CURLOPT_CUSTOMREQUEST, nullptr);
+         });
+ return *this;
+}
+
 
- setup_send_options_();                                         // this is a plan text mail
- DBG(0) DOUT() << "sending to: " << scheme_ << host_ << std::endl;
- hi_ = 0;
- mbi_ = msg.cbegin();
- mei_ = msg.cend();
- curl_.perform();                                               // send mail here
+CurlSmtp & CurlSmtp::send(const Message & m) {
+ // send rendered mail; the mail is not modified, hence could be sent again
+ if(host_.empty()) throw EXP(curlsmtp_host_unset);
+ if(m.empty()) throw EXP(message_not_rendered);
+ if(m.recipients() == nullptr) throw EXP(curlsmtp_recipients_unset);
+
+ settle_();
+ setup_send_options_(m);
+ DBG(0) DOUT() << "sending to: " << scheme_ << host_ << ", " << m.size() << " bytes" << std::endl;
+ feed_.msg = m.r_.get();
+ feed_.seg = feed_.off = feed_.sent = 0;
+ feed_.metered = true;
+ {
+  Bandwidth::Transfer transfer(Bandwidth::global());            // share global budget
+  curl_.perform();                                              // send mail here
+ }
+ feed_.msg = nullptr;
 
  DBG(0) {
   if(rc() != CURLE_OK)
@@ -388,82 +641,315 @@ CurlSmtp & CurlSmtp::send(const std::string & msg) {
   else
    DOUT() << "sending done" << std::endl;
  }
+ return *this;
+}
 
- curl_slist_free_all(recipients_);                              // clean up after sending
- init_headers_();
- separator_sent_ = false;
+
+CurlSmtp & CurlSmtp::dump(const Message & m, std::ostream & out) {
+ // write rendered mail into out exactly as it would be uploaded (i.e. fed to curl by
+ // feed_payload_), w/o connecting anywhere; the mail is not modified
+ if(m.empty()) throw EXP(message_not_rendered);
+
+ char buf[CS_UPLOAD_BUF];
+ feed_.msg = m.r_.get();
+ feed_.seg = feed_.off = feed_.sent = 0;
+ feed_.metered = false;                                         // local output: not throttled
+ for(size_t n; (n = feed_payload_(buf, 1, sizeof(buf), this)) > 0;)
+  out.write(buf, n);
+ feed_.msg = nullptr;
+
+ DBG(0) DOUT() << "dumped " << m.size() << " bytes" << std::endl;
  return *this;
 }
 
 
-CurlSmtp & CurlSmtp::send_mime_(const std::string & msg) {
- // send msg and attached files using mime
- setup_send_options_(mime_parts);
+long CurlSmtp::response(void) {
+ // return the last smtp reply code received from the server (0 if none)
+ long code = 0;
+ curl_easy_getinfo(curl_.curl(), CURLINFO_RESPONSE_CODE, &code);
+ return code;
+}
+
+
+bool CurlSmtp::transient(void) {
+ // tell if the last failed send is worth retrying: server replied with 4xx (e.g.
+ // 421 - service unavailable, 451 - throttled), or the connection failed/dropped
+ if(rc() == CURLE_OK) return false;
+ long code = response();
+ if(code >= 400) return code < 500;                             // 5xx are permanent
 
- // build header list and set it up
- struct curl_slist *headers = nullptr;
- for(int h = static_cast<int>(From); h < static_cast<int>(end_of_headers); ++h) {
-  if(h == static_cast<int>(Bcc)) continue;
-  if(headers_[static_cast<Headers>(h)].empty()) continue;
-  headers = curl_slist_append(headers, (std::string{ENUMS(Headers, h)} + ": " +
-                                       headers_[static_cast<Headers>(h)]).c_str());
-  DBG(0) DOUT() << "posted header " << ENUMS(Headers, h) << ": "
-                << headers_[static_cast<Headers>(h)] << std::endl;
+ return rc() AMONG(CURLE_COULDNT_CONNECT, CURLE_OPERATION_TIMEDOUT, CURLE_SEND_ERROR,
+                   CURLE_RECV_ERROR, CURLE_GOT_NOTHING, CURLE_SSL_CONNECT_ERROR);
+}
+
+
+Message CurlSmtp::render(const std::string & msg) {
+ // render prepared mail (headers, recipients, attachments) and msg into a Message:
+ // if file attachment is given, or message (msg) is outside of ascii char set,
+ // render it as mime (base64 encoded parts), otherwise as a plain text mail
+ if(recipients_ == nullptr) throw EXP(curlsmtp_recipients_unset);
+ add_header(Date, date_str_());                                 // generate date
+
+ auto r = std::make_shared<Message::Rendered_>();
+ r->from = headers_[From];
+ for(auto rcpt = recipients_; rcpt != nullptr; rcpt = rcpt->next)
+  if((r->rcpt = curl_slist_append(r->rcpt, rcpt->data)) == nullptr)
+   throw EXP(curlsmpt_failed_adding_header);
+
+ std::string hdr;
+ render_headers_(hdr);
+ if(not files_.empty() or std::any_of(msg.begin(), msg.end(), [](char c){ return c<0; }))
+  render_mime_(*r, hdr, msg);
+ else {                                                         // this is a plain text mail
+  hdr += CS_EOL;                                                // separate headers from body
+  render_text_(msg, hdr);
+  r->add(std::move(hdr));
  }
- curl_.setopt(CURLOPT_HTTPHEADER, headers);
 
- setup_mime_parts_(msg);
- curl_.perform();                // send mail
- DBG(0) {
-  if(rc() != CURLE_OK)
-   DOUT() << "returned error: " << error() << std::endl;
-  else
-   DOUT() << "sending done" << std::endl;
+ #ifdef CMAIL_DKIM
+ if(dkim_ != nullptr) dkim_sign_(*r);
+ #endif
+
+ DBG(0) DOUT() << "rendered " << r->size << " bytes in " << r->seg.size() << " segment(s)" << std::endl;
+ Message m;
+ m.r_ = std::move(r);
+ return m;
+}
+
+
+void CurlSmtp::render_headers_(std::string &hdr) const {
+ // render all headers (except Bcc) one per line
+ for(int h = static_cast<int>(From); h < static_cast<int>(end_of_headers); ++h) {
+  if(h == static_cast<int>(Bcc) or headers_[h].empty()) continue;
+  hdr.append(ENUMS(Headers, h)).append(": ").append(headers_[h]).append(CS_EOL);
+  DBG(1) DOUT() << "rendered header " << ENUMS(Headers, h) << ": " << headers_[h] << std::endl;
  }
+ for(size_t i = 0; i < customs_; ++i) {
+  hdr.append(custom_[i].name).append(": ").append(custom_[i].value).append(CS_EOL);
+  DBG(1) DOUT() << "rendered header " << custom_[i].name << ": " << custom_[i].value << std::endl;
+ }
+}
 
- curl_slist_free_all(headers);
- files_.clear();
- init_headers_();
+
+CurlSmtp & CurlSmtp::attach_file(std::string path) {
+ // attach the file: if its encoding is interned (i.e. the same file was rendered
+ // before and has not changed since), it is reused, otherwise the file is being read
+ // right away (and encoded when rendered)
+ struct stat st;
+ Attachment_ a{std::move(path), FileId_{}, false, 0, nullptr};
+ if(stat(a.path.c_str(), &st) == 0 and S_ISREG(st.st_mode)) {
+  #ifdef __APPLE__
+  int64_t mtime = st.st_mtimespec.tv_sec * 1000000000LL + st.st_mtimespec.tv_nsec;
+  #else
+  int64_t mtime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+  #endif
+  a.id = FileId_{st.st_dev, st.st_ino, mtime, st.st_size};
+  a.known = true;
+  a.enc = interned_(a.path, a.id);
+ }
+ if(a.enc == nullptr)
+  a.h = reader_->read(a.path);
+ files_.push_back(std::move(a));
  return *this;
 }
 
 
-void CurlSmtp::setup_mime_parts_(const std::string & msg) {
- // setup mime parts for msg and attached files
+void CurlSmtp::render_mime_(Message::Rendered_ &r, std::string &hdr, const std::string & msg) const {
+ // render msg and attached files as multipart/mixed mime, each part is encoded
+ // in base64 and becomes a separate segment
+ static thread_local std::mt19937_64 rnd{std::random_device{}()};
+ char boundary[48];
+ snprintf(boundary, sizeof(boundary), "------------------------%016llx",
+          static_cast<unsigned long long>(rnd()));
 
- curl_mime *mime = curl_mime_init(curl_.curl());
- if(mime == nullptr) throw EXP(mime_initialization_failure);
+ hdr.append("MIME-Version: 1.0" CS_EOL "Content-Type: multipart/mixed; boundary=\"")
+    .append(boundary).append("\"" CS_EOL CS_EOL);
+ r.add(std::move(hdr));
 
- curl_mimepart *part = nullptr;
  if(not msg.empty()) {                                          // mime msg
-  part = curl_mime_addpart(mime);
-  curl_mime_data(part, msg.c_str(), msg.size());
-  curl_mime_encoder(part, MIME_ENCODER);
+  std::string part;
+  part.append("--").append(boundary).append(CS_EOL
+              "Content-Type: text/plain; charset=utf-8" CS_EOL
+              "Content-Transfer-Encoding: " MIME_ENCODER CS_EOL CS_EOL);
+  auto body = std::make_shared<const std::string>(msg);
+  auto enc = encode_(std::shared_ptr<const char>(body, body->data()), body->size());
+  r.add(std::move(part)).add(enc->seg, enc->size);
  }
 
- for(auto &file: files_) {                                      // // mime all attached files
-  part = curl_mime_addpart(mime);
-  curl_mime_filedata(part, file.c_str());
-  curl_mime_encoder(part, MIME_ENCODER);
-  DBG(0) DOUT() << "posted file: '" << file << "'" << std::endl;
+ for(auto &file: files_) {                                      // mime all attached files
+  auto enc = file.enc;
+  if(enc == nullptr) {                                          // not interned yet, encode
+   FileReader::Data data = reader_->get(file.h);                // normally, read already
+   if(data == nullptr) throw EXP(attachment_read_failure);
+   enc = encode_(std::move(data), reader_->length(file.h));
+   if(file.known) interned_(file.path, file.id, enc);
+  }
+
+  std::string part, name = file.path.substr(file.path.find_last_of('/') + 1);
+  part.append("--").append(boundary).append(CS_EOL "Content-Type: ")
+      .append(content_type_(name)).append(CS_EOL
+              "Content-Disposition: attachment; filename=\"");
+  for(char c: name)                                             // quote as per RFC2045
+   { if(c == '"' or c == '\\') part += '\\'; part += c; }
+  part.append("\"" CS_EOL "Content-Transfer-Encoding: " MIME_ENCODER CS_EOL CS_EOL);
+  r.add(std::move(part)).add(enc->seg, enc->size);
+  DBG(0) DOUT() << "rendered file: '" << file.path << "', " << file.id.size << " bytes"
+                << (file.enc == nullptr? "": " (interned)") << std::endl;
  }
 
- if(curl_.setopt(CURLOPT_MIMEPOST, mime).rc() != CURLE_OK)       // setup mime
-  throw EXP(mime_setup_failure);
+ r.add(std::string("--") + boundary + "--" CS_EOL);
+}
+
+
+const char * CurlSmtp::content_type_(const std::string & name) {
+ // content type of an attachment by its file extension (case-insensitive): the
+ // same table libcurl applies to curl_mime_filedata() parts, thus attachments are
+ // typed as they used to be
+ static const struct { const char *ext, *type; } types[] = {
+  {".gif", "image/gif"}, {".jpg", "image/jpeg"}, {".jpeg", "image/jpeg"},
+  {".png", "image/png"}, {".svg", "image/svg+xml"}, {".txt", "text/plain"},
+  {".htm", "text/html"}, {".html", "text/html"}, {".pdf", "application/pdf"},
+  {".xml", "application/xml"}
+ };
+ for(auto &t: types) {
+  size_t len = strlen(t.ext);
+  if(name.size() >= len and strcasecmp(name.c_str() + name.size() - len, t.ext) == 0)
+   return t.type;
+ }
+ return "application/octet-stream";
 }
 
 
-void CurlSmtp::setup_send_options_(MimeSetup opt) {
+#ifdef CMAIL_DKIM
+void CurlSmtp::dkim_sign_(Message::Rendered_ &r) const {
+ // DKIM sign the rendered mail: the body is hashed in a single pass over rendered
+ // segments, each segment is hashed as soon as it's ready (i.e. while following
+ // ones are being encoded in the background), then DKIM-Signature header becomes the
+ // first segment
+ const std::string &first = r.seg.front().get();                // headers (and plain body)
+ size_t eoh = first.find(CS_EOL CS_EOL) + 2;                    // end of headers
+ Dkim::BodyHash bh;
+ bh.update(first.data() + eoh + 2, first.size() - eoh - 2);
+ for(size_t i = 1; i < r.seg.size(); ++i)
+  bh.update(r.seg[i].get());
+
+ const std::string &from = headers_[From];                      // d= defaults to From's domain
+ size_t at = from.rfind('@'), end = from.find_first_of("> \t", at);
+ std::string sig;
+ try { sig = dkim_->sign(first.substr(0, eoh), bh,
+                         at == std::string::npos? "": from.substr(at + 1, end - at - 1)); }
+ catch(Dkim::stdException & e) {
+  DBG(0) DOUT() << "dkim signing failed: " << e.what() << std::endl;
+  throw EXP(message_signing_failure);
+ }
+ DBG(1) DOUT() << "signed: " << sig;
+ r.size += sig.size();
+ r.seg.insert(r.seg.begin(), Message::segment_(std::move(sig)));
+}
+#endif
+
+
+void CurlSmtp::render_text_(const std::string & msg, std::string &dst) {
+ // append msg to dst, converting bare LF into CRLF (RFC5322)
+ dst.reserve(dst.size() + msg.size() + msg.size() / 32 + 2);
+ size_t last = 0;
+ for(size_t lf = msg.find('\n'); lf != std::string::npos; lf = msg.find('\n', last)) {
+  dst.append(msg, last, lf - last);
+  if(lf == 0 or msg[lf - 1] != '\r') dst += '\r';
+  dst += '\n';
+  last = lf + 1;
+ }
+ dst.append(msg, last, std::string::npos);
+}
+
+
+std::shared_ptr<const CurlSmtp::Encoded_>
+CurlSmtp::encode_(std::shared_ptr<const char> data, size_t len) {
+ // base64 encode mime part's data: small data is encoded in place, a big one is
+ // split into chunks (of whole base64 lines, so that encoded chunks concatenate
+ // seamlessly) encoded on the thread pool, each chunk becomes a segment; thus the
+ // rendering returns right away and the sending waits only for chunks which are not
+ // encoded yet (i.e. encoding overlaps with the upload)
+ auto enc = std::make_shared<Encoded_>();
+ enc->size = base64_size_(len);
+ if(len <= MIME_CHUNK or ThreadPool::global().size() == 0) {
+  std::string str;
+  base64_(data.get(), len, str);
+  enc->seg.push_back(Message::segment_(std::move(str)));
+  return enc;
+ }
+
+ for(size_t off = 0; off < len; off += MIME_CHUNK) {            // pool runs chunks in order
+  size_t chunk = std::min<size_t>(MIME_CHUNK, len - off);
+  enc->seg.push_back(ThreadPool::global().submit([data, off, chunk] {
+                                                  std::string str;
+                                                  base64_(data.get() + off, chunk, str);
+                                                  return str;
+                                                 }).share());
+ }
+ return enc;
+}
+
+
+std::shared_ptr<const CurlSmtp::Encoded_>
+CurlSmtp::interned_(const std::string &path, const FileId_ &id,
+                    std::shared_ptr<const Encoded_> enc) {
+ // look up the interned encoding of the file (nullptr: none, or the file has changed
+ // since); if enc is given, intern it (replacing the outdated one); interned encodings
+ // are shared by all CurlSmtp objects (threads) and are kept for process lifetime
+ static std::mutex mtx;
+ static std::map<std::string, std::pair<FileId_, std::shared_ptr<const Encoded_>>> interned;
+ std::lock_guard<std::mutex> lck(mtx);
+
+ if(enc != nullptr)
+  { interned[path] = std::make_pair(id, enc); return enc; }
+ auto it = interned.find(path);
+ return it != interned.end() and it->second.first == id? it->second.second: nullptr;
+}
+
+
+void CurlSmtp::base64_(const char *src, size_t len, std::string &dst) {
+ // append base64 encoded src to dst, broken into lines of MIME_LINE chars
+ static const char b64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+ size_t at = dst.size();
+ dst.resize(at + base64_size_(len));
+
+ char *out = &dst[at];
+ const unsigned char *in = reinterpret_cast<const unsigned char *>(src);
+ for(size_t i = 0, col = 0; i < len; i += 3) {
+  uint32_t v = in[i] << 16;
+  if(i + 1 < len) v |= in[i + 1] << 8;
+  if(i + 2 < len) v |= in[i + 2];
+  *out++ = b64[v >> 18];
+  *out++ = b64[(v >> 12) & 63];
+  *out++ = i + 1 < len? b64[(v >> 6) & 63]: '=';
+  *out++ = i + 2 < len? b64[v & 63]: '=';
+  if((col += 4) == MIME_LINE or i + 3 >= len)                   // end of line, or of data
+   { *out++ = '\r'; *out++ = '\n'; col = 0; }
+ }
+}
+
+
+void CurlSmtp::setup_send_options_(const Message & m) {
  // setup all required options (as well as feed handler), prepare for sending mail
- std::string url = scheme_ + host_;
  std::vector<CURLcode> r;
  r.reserve(10);
 
- if(opt == plain_text) {
-  r.push_back(curl_.setopt(CURLOPT_READFUNCTION, feed_payload_).rc());
-  r.push_back(curl_.setopt(CURLOPT_READDATA, this).rc());
-  r.push_back(curl_.setopt(CURLOPT_UPLOAD, 1L).rc());
- }
+ setup_connect_options_(r);
+ r.push_back(curl_.setopt(CURLOPT_READFUNCTION, feed_payload_).rc());
+ r.push_back(curl_.setopt(CURLOPT_READDATA, this).rc());
+ r.push_back(curl_.setopt(CURLOPT_UPLOAD, 1L).rc());
+ r.push_back(curl_.setopt(CURLOPT_MAIL_FROM, m.from().c_str()).rc());
+ r.push_back(curl_.setopt(CURLOPT_MAIL_RCPT, m.recipients()).rc());
+
+ if(std::any_of(r.begin(), r.end(), [](CURLcode cc) { return cc != CURLE_OK; }))
+  throw EXP(curlsmtp_setopt_falure);
+}
+
+
+void CurlSmtp::setup_connect_options_(std::vector<CURLcode> &r) {
+ // setup options the connection depends on (server and credentials)
+ std::string url = scheme_ + host_;
  r.push_back(curl_.setopt(CURLOPT_URL, url.c_str()).rc());
 
  if(ssl_) {
@@ -472,13 +958,51 @@ void CurlSmtp::setup_send_options_(MimeSetup opt) {
   r.push_back(curl_.setopt(CURLOPT_SSL_VERIFYPEER, 0L).rc());
   r.push_back(curl_.setopt(CURLOPT_SSL_VERIFYHOST, 0L).rc());
  }
+}
 
- if(not headers_[From].empty())
-  r.push_back(curl_.setopt(CURLOPT_MAIL_FROM, headers_[From].c_str()).rc());
- r.push_back(curl_.setopt(CURLOPT_MAIL_RCPT, recipients_).rc());
 
- if(std::any_of(r.begin(), r.end(), [](CURLcode cc) { return cc != CURLE_OK; }))
-  throw EXP(curlsmtp_setopt_falure);
+CurlSmtp::Headers CurlSmtp::match_header(const char *name, size_t len) {
+ // map header name to Headers (case-insensitively), return end_of_headers if
+ // name is not a standard header; hashing is perfect: only one comparison is done
+ static_assert(perfect_hash_(), "CurlSmtp: header hash is not perfect, fix hdr_slot_[]");
+ if(len == 0) return end_of_headers;
+
+ Headers h = hdr_slot_[hash_header_(name, len)];
+ if(h == end_of_headers or cstrlen_(ENUMS(Headers, h)) != len or
+    strncasecmp(name, ENUMS(Headers, h), len) != 0)
+  return end_of_headers;
+ return h;
+}
+
+
+bool CurlSmtp::valid_header_name(const char *name, size_t len) {
+ // field name must be non-empty and consist of printable ASCII chars except colon
+ if(len == 0) return false;
+ for(size_t i = 0; i < len; ++i)
+  if(name[i] < 33 or name[i] > 126 or name[i] == ':') return false;
+ return true;
+}
+
+
+CurlSmtp & CurlSmtp::add_header(const char *name, size_t len, const std::string & str) {
+ // add header by its name: a standard header is dispatched to add_header(Headers...),
+ // otherwise a custom header is added (same named custom header is overridden)
+ Headers h = match_header(name, len);
+ if(h != end_of_headers) return add_header(h, str);
+ if(not valid_header_name(name, len)) throw EXP(curlsmpt_failed_adding_header);
+
+ size_t i = 0;
+ while(i < customs_ and (custom_[i].name.size() != len or
+                         strncasecmp(custom_[i].name.c_str(), name, len) != 0))
+  ++i;
+ if(i == customs_) {                                            // a new one, take next slot
+  if(customs_ == custom_.size()) custom_.emplace_back();
+  custom_[customs_++].name.assign(name, len);
+ }
+ custom_[i].value = str;
+
+ DBG(0) DOUT() << "'" << custom_[i].name << "': '" << custom_[i].value << '\'' << std::endl;
+ return *this;
 }
 
 
@@ -493,82 +1017,59 @@ CurlSmtp & CurlSmtp::add_header(Headers h, const std::string & str) {
    throw EXP(curlsmpt_failed_adding_header);
  }
 
+ std::string &hdr = headers_[h];
  if(not (h AMONG(To, Cc, Bcc)))
-  headers_[h].clear();                                          // non-recipients are not additive
- if(not headers_[h].empty())
-  headers_[h] += ", ";
- if(not (h AMONG(Subject, Date))) headers_[h] += '<';           // if it's email header, enclose
- headers_[h] += str;
- if(not (h AMONG(Subject, Date))) headers_[h] += '>';           // if it's email header, enclose
-
- DBG(0) DOUT() << "'" << ENUMS(Headers, h) << "': '" << headers_[h] << '\'' << std::endl;
+  hdr.clear();                                                  // non-recipients are not additive
+ hdr.reserve(hdr.size() + str.size() + 4);                      // grow once at most
+ if(not hdr.empty())
+  hdr += ", ";
+ if(not (h AMONG(Subject, Date))) hdr += '<';                   // if it's email header, enclose
+ hdr += str;
+ if(not (h AMONG(Subject, Date))) hdr += '>';                   // if it's email header, enclose
+
+ DBG(0) DOUT() << "'" << ENUMS(Headers, h) << "': '" << hdr << '\'' << std::endl;
  return *this;
 }
 
 
 std::string CurlSmtp::date_str_(void) {
  // generate 'Date: ' header, e.g.: Date: Wed, 4 Jul 2018 14:21:58 +0200
- DateTime t;
- std::string date(t.weekday_c_str());                           // e.g: Wed
-
- date += ", " + std::to_string(t.day()) + " " + t.month_c_string(); // e.g: Wed, 4 Jul
- date += " " + std::to_string(t.year()) + " " + t.time_str();   // e.g.: Wed, 4 Jul 2018 14:21:58
+ char date[RFC5322_DATE_LEN];
+ WallClock::rfc5322(date);                                      // formatted once per second
 
- auto hd = t.utc_offset()/3600;                                 // hours delta (from UTC)
- auto md = (t.utc_offset()%3600)/60;                            // minutes delta
- std::stringstream tzo;                                         // time zone offset
- tzo << ' ' << (hd >= 0? '+': '-')
-            << std::setfill('0') << std::setw(2) << hd << std::setw(2) << md;
-
- DBG(0) DOUT() << "Generated date: '" << date << tzo.str() << "'" << std::endl;
- return date + tzo.str();
+ DBG(0) DOUT() << "Generated date: '" << date << "'" << std::endl;
+ return date;
 }
 
 
 size_t CurlSmtp::feed_payload_(char *ptr, size_t size, size_t n, CurlSmtp *my) {
- if((n*size) < 1) return 0;
-
+ // feed rendered mail segments (as much as fits into curl's buffer and the bandwidth
+ // budget allows - when uploading, a dump is not metered)
  CurlSmtp &me = *my;
- std::string s;                                                 // s will collect all fed data
- size_t max = n * size;
-
- while(me.hi_ < end_of_headers and                              // skip empty and Bcc header
-       (me.hi_ == Bcc or me.headers_[static_cast<Headers>(me.hi_)].empty()))
-  ++me.hi_;
-
- if(me.hi_ < end_of_headers) {                                  // upload headers first (one by one)
-  s = ENUMS(Headers, me.hi_);
-  s += ": " + me.headers_[static_cast<Headers>(me.hi_)];
-  ++me.hi_;
-  if(s.size() > max) {
-    DBG(me, 1) DOUT(me) << "header size > max allowed (" << max << "): '" << s << "'" << std::endl;
-    s.resize(max);                                              // truncate if it's too long
-  }
- }
- else {                                                         // headers done, upload message now
-  if(me.separator_sent_) {                                      // sending body then
-   size_t left = me.mei_ - me.mbi_;
-   DBG(me, 1) DOUT(me) << "#bytes left to send: " << left << ", max: " << max << std:: endl;
-   if(left == 0) return 0;
-
-   for(auto end_it = left < max? me.mei_: me.mbi_+max; me.mbi_ != end_it; ++me.mbi_)
-    s += *me.mbi_;                                              // copy message to sending string s
-  }
-  else                                                          // separator not sent: send now
-   me.separator_sent_ = true;
+ const Message::Rendered_ *msg = me.feed_.msg;
+ size_t max = std::min(n * size, msg->size - me.feed_.sent), fed = 0;
+ if(max > 0 and me.feed_.metered and Bandwidth::global().limited())
+  max = Bandwidth::global().take(max);                          // could block
+
+ while(fed < max and me.feed_.seg < msg->seg.size()) {
+  const std::string &seg = msg->seg[me.feed_.seg].get();        // could wait for encoding
+  size_t chunk = std::min(max - fed, seg.size() - me.feed_.off);
+  memcpy(ptr + fed, seg.data() + me.feed_.off, chunk);
+  fed += chunk;
+  if((me.feed_.off += chunk) == seg.size())
+   { ++me.feed_.seg; me.feed_.off = 0; }
  }
 
- DBG(me, 1) DOUT(me) << "uploading: '" << s << "'" << std:: endl;
-
- s += CS_EOL;
- memcpy(ptr, s.c_str(), s.size());
- return s.size();
+ DBG(me, 1) DOUT(me) << "uploading " << fed << " bytes (max: " << max << ")" << std::endl;
+ me.feed_.sent += fed;
+ return fed;
 }
 
 
 void CurlSmtp::init_headers_(void) {
  for(int h=0; h<end_of_headers; ++h)
-  headers_[static_cast<CurlSmtp::Headers>(h)].clear();
+  headers_[h].clear();
+ customs_ = 0;                                                  // keep slots for reuse
  recipients_ = nullptr;
 }
 
@@ -578,6 +1079,9 @@ void CurlSmtp::init_headers_(void) {
 
 #undef CS_EOL
 #undef MIME_ENCODER
+#undef MIME_LINE
+#undef MIME_CHUNK
+#undef CS_UPLOAD_BUF
 
 
 
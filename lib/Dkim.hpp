@@ -0,0 +1,276 @@
+/*
+ * DKIM signer (RFC6376): signs mails with rsa-sha256, or ed25519-sha256 (RFC8463),
+ * using relaxed/relaxed canonicalization; requires OpenSSL (libcrypto)
+ *
+ * the private key (PEM) is parsed once - when the signer is constructed, the signer
+ * is immutable afterwards, thus a single signer could be shared by all threads
+ *
+ * the body is hashed in a streaming fashion: it's fed to BodyHash piece by piece (as
+ * pieces become available), the canonicalization is applied on the fly, thus no
+ * canonicalized copy of the body is ever made
+ *
+ * signed headers (those present) are listed in DK_HEADERS
+ *
+ *
+ * SYNOPSIS:
+ *  Dkim dkim("/etc/dkim/mail.pem", "mail", "example.com");    // selector, domain
+ *
+ *  Dkim::BodyHash bh;
+ *  bh.update(body_piece1).update(body_piece2);
+ *  std::string sig = dkim.sign(headers, bh);                   // "DKIM-Signature: ...\r\n"
+ *  std::string mail = sig + headers + "\r\n" + body_piece1 + body_piece2;
+ *
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <strings.h>            // strncasecmp
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/rsa.h>
+#include "extensions.hpp"
+
+
+
+#define DK_EOL "\r\n"
+#define DK_HEADERS "from:to:cc:subject:date:message-id:reply-to:mime-version:content-type"
+
+class Dkim {
+ public:
+    #define THROWREASON \
+                dkim_key_read_failure, \
+                dkim_unsupported_key, \
+                dkim_domain_unknown, \
+                dkim_signing_failure, \
+                end_of_throw
+    ENUMSTR(ThrowReason, THROWREASON)
+
+    class BodyHash {                                            // relaxed canonicalization
+     public:
+                            BodyHash(void): ctx_(EVP_MD_CTX_new())
+                             { EVP_DigestInit_ex(ctx_, EVP_sha256(), nullptr); }
+                            BodyHash(const BodyHash &) = delete;
+                           ~BodyHash(void) { EVP_MD_CTX_free(ctx_); }
+        BodyHash &          operator=(const BodyHash &) = delete;
+
+        BodyHash &          update(const char *ptr, size_t len);
+        BodyHash &          update(const std::string &str) { return update(str.data(), str.size()); }
+        std::string         final(void);                        // base64 encoded hash
+
+     private:
+        void                put_(char c)
+                             { buf_[len_++] = c; if(len_ == sizeof(buf_)) flush_(); }
+        void                flush_(void) { EVP_DigestUpdate(ctx_, buf_, len_); len_ = 0; }
+        void                emit_(const char *ptr, size_t len); // not empty, w/o WSP and CR
+
+        EVP_MD_CTX *        ctx_;
+        char                buf_[4096];
+        size_t              len_{0};
+        size_t              crlf_{0};                           // line breaks held back
+        bool                wsp_{false};                        // whitespace held back
+        bool                cr_{false};                         // CR held back
+        bool                any_{false};                        // body is not empty
+    };
+
+                        Dkim(const std::string &keyfile, const std::string &selector,
+                             const std::string &domain = "");
+                        Dkim(const Dkim &) = delete;
+                       ~Dkim(void) { EVP_PKEY_free(key_); }
+    Dkim &              operator=(const Dkim &) = delete;
+
+    const std::string & selector(void) const { return selector_; }
+    const std::string & domain(void) const { return domain_; }
+    const char *        algorithm(void) const { return ed25519_? "ed25519-sha256": "rsa-sha256"; }
+
+    std::string         sign(const std::string &headers, BodyHash &bh,
+                             const std::string &domain = "", time_t t = time(nullptr)) const;
+
+    EXCEPTIONS(ThrowReason)                                     // see "extensions.hpp"
+
+ private:
+    static void         canon_header_(const char *b, const char *e, std::string &dst);
+    static std::string  base64_(const unsigned char *src, size_t len);
+
+    EVP_PKEY *          key_{nullptr};
+    bool                ed25519_{false};
+    std::string         selector_;
+    std::string         domain_;                                // d= (if empty - given to sign)
+};
+
+STRINGIFY(Dkim::ThrowReason, THROWREASON)
+#undef THROWREASON
+
+
+
+Dkim::BodyHash & Dkim::BodyHash::update(const char *ptr, size_t len) {
+ // canonicalize (relaxed) and hash next piece of the body: whitespace runs are
+ // reduced to a single space, trailing whitespace of lines is dropped, empty lines
+ // are held back (those are dropped at the end of the body)
+ for(const char *end = ptr + len; ptr < end;) {
+  if(cr_) {
+   cr_ = false;
+   if(*ptr == '\n') { wsp_ = false; ++crlf_; ++ptr; continue; } // end of line
+   emit_("\r", 1);                                              // bare CR
+  }
+  const char *run = ptr;                                        // run of regular chars
+  while(run < end and *run != '\r' and *run != ' ' and *run != '\t') ++run;
+  if(run > ptr) { emit_(ptr, run - ptr); ptr = run; continue; }
+  if(*ptr++ == '\r') cr_ = true;
+  else wsp_ = true;
+ }
+ return *this;
+}
+
+
+void Dkim::BodyHash::emit_(const char *ptr, size_t len) {
+ // hash a run of regular chars preceded by held back line breaks and whitespace
+ for(; crlf_ > 0; --crlf_)
+  { put_('\r'); put_('\n'); }
+ if(wsp_)
+  { put_(' '); wsp_ = false; }
+ if(len_ + len > sizeof(buf_)) flush_();
+ if(len >= sizeof(buf_)) EVP_DigestUpdate(ctx_, ptr, len);
+ else { memcpy(buf_ + len_, ptr, len); len_ += len; }
+ any_ = true;
+}
+
+
+std::string Dkim::BodyHash::final(void) {
+ // complete the body (a non-empty body ends with a single line break), return the
+ // base64 encoded hash
+ if(cr_) { cr_ = false; emit_("\r", 1); }
+ if(any_) { put_('\r'); put_('\n'); }
+ flush_();
+
+ unsigned char md[EVP_MAX_MD_SIZE];
+ unsigned int len = 0;
+ EVP_DigestFinal_ex(ctx_, md, &len);
+ return base64_(md, len);
+}
+
+
+
+Dkim::Dkim(const std::string &keyfile, const std::string &selector, const std::string &domain):
+ selector_(selector), domain_(domain) {
+ // read and parse the private key (rsa or ed25519)
+ FILE *f = fopen(keyfile.c_str(), "r");
+ if(f == nullptr) throw EXP(dkim_key_read_failure);
+ key_ = PEM_read_PrivateKey(f, nullptr, nullptr, nullptr);
+ fclose(f);
+ if(key_ == nullptr) throw EXP(dkim_key_read_failure);
+
+ if(EVP_PKEY_base_id(key_) == EVP_PKEY_ED25519) ed25519_ = true;
+ else if(EVP_PKEY_base_id(key_) != EVP_PKEY_RSA)
+  { EVP_PKEY_free(key_); key_ = nullptr; throw EXP(dkim_unsupported_key); }
+}
+
+
+std::string Dkim::sign(const std::string &headers, BodyHash &bh,
+                       const std::string &domain, time_t t) const {
+ // sign the mail: headers is a block of header lines (each ending with CRLF), bh -
+ // the hashed body; domain (d=) is used if the signer's domain is not set; return
+ // DKIM-Signature header (to be prepended to the headers)
+ const std::string &d = domain_.empty()? domain: domain_;
+ if(d.empty()) throw EXP(dkim_domain_unknown);
+
+ std::vector<std::pair<const char *, const char *>> fld;        // header fields (w. folding)
+ for(const char *p = headers.data(), *end = p + headers.size(); p < end;) {
+  const char *eol = p;
+  while(eol < end and *eol != '\n') ++eol;
+  eol = eol < end? eol + 1: end;
+  if((*p == ' ' or *p == '\t') and not fld.empty()) fld.back().second = eol;
+  else fld.emplace_back(p, eol);
+  p = eol;
+ }
+
+ std::string h, canon;                                          // signed headers, canonicalized
+ for(const char *n = DK_HEADERS; *n != '\0';) {
+  const char *ne = n;
+  while(*ne != '\0' and *ne != ':') ++ne;
+  for(auto it = fld.rbegin(); it != fld.rend(); ++it) {          // the last instance is signed
+   const char *s = it->first, *colon = s;
+   while(colon < it->second and *colon != ':') ++colon;
+   const char *se = colon;
+   while(se > s and (se[-1] == ' ' or se[-1] == '\t')) --se;
+   if(static_cast<size_t>(se - s) != static_cast<size_t>(ne - n) or
+      strncasecmp(s, n, ne - n) != 0) continue;
+   h.append(h.empty()? "": ":").append(n, ne - n);
+   canon_header_(it->first, it->second, canon);
+   break;
+  }
+  n = *ne == ':'? ne + 1: ne;
+ }
+
+ std::string sig("DKIM-Signature: v=1; a=");
+ sig.append(algorithm()).append("; c=relaxed/relaxed; d=").append(d)
+    .append("; s=").append(selector_).append(";" DK_EOL "\tt=").append(std::to_string(t))
+    .append("; h=").append(h).append(";" DK_EOL "\tbh=").append(bh.final())
+    .append(";" DK_EOL "\tb=");
+ canon_header_(sig.data(), sig.data() + sig.size(), canon);     // signed w/o trailing CRLF
+
+ unsigned char md[EVP_MAX_MD_SIZE];                             // rfc8463: ed25519 signs hash
+ unsigned int mdlen = 0;
+ EVP_Digest(canon.data(), canon.size(), md, &mdlen, EVP_sha256(), nullptr);
+
+ std::vector<unsigned char> out(EVP_PKEY_size(key_));
+ size_t len = out.size();
+ bool ok;
+ if(ed25519_) {
+  EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+  ok = ctx != nullptr and EVP_DigestSignInit(ctx, nullptr, nullptr, nullptr, key_) == 1 and
+       EVP_DigestSign(ctx, out.data(), &len, md, mdlen) == 1;
+  EVP_MD_CTX_free(ctx);
+ }
+ else {                                                         // rsassa-pkcs1-v1_5 w. sha256
+  EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new(key_, nullptr);
+  ok = ctx != nullptr and EVP_PKEY_sign_init(ctx) == 1 and
+       EVP_PKEY_CTX_set_rsa_padding(ctx, RSA_PKCS1_PADDING) == 1 and
+       EVP_PKEY_CTX_set_signature_md(ctx, EVP_sha256()) == 1 and
+       EVP_PKEY_sign(ctx, out.data(), &len, md, mdlen) == 1;
+  EVP_PKEY_CTX_free(ctx);
+ }
+ if(not ok) throw EXP(dkim_signing_failure);
+
+ return sig.append(base64_(out.data(), len)).append(DK_EOL);
+}
+
+
+void Dkim::canon_header_(const char *b, const char *e, std::string &dst) {
+ // append relaxed canonicalized header field [b, e) to dst: name in lower case, no
+ // spaces around colon, value unfolded, whitespace runs reduced to a single space,
+ // trailing whitespace dropped; CRLF is appended only if the field has one
+ const char *colon = b;
+ while(colon < e and *colon != ':') ++colon;
+ const char *ne = colon;
+ while(ne > b and (ne[-1] == ' ' or ne[-1] == '\t')) --ne;
+ for(; b < ne; ++b) dst += (*b >= 'A' and *b <= 'Z')? *b | 0x20: *b;
+ dst += ':';
+
+ bool wsp = false, any = false, eol = false;
+ for(const char *p = colon + 1; p < e; ++p) {
+  if(*p == '\r' or *p == '\n') { eol = eol or *p == '\n'; continue; }   // unfold
+  if(*p == ' ' or *p == '\t') { wsp = true; continue; }
+  if(wsp and any) dst += ' ';
+  dst += *p;
+  wsp = false;
+  any = true;
+  eol = false;
+ }
+ if(eol) dst += DK_EOL;
+}
+
+
+std::string Dkim::base64_(const unsigned char *src, size_t len) {
+ std::string dst(4 * ((len + 2) / 3) + 1, '\0');
+ dst.resize(EVP_EncodeBlock(reinterpret_cast<unsigned char *>(&dst[0]), src, len));
+ return dst;
+}
+
+
+#undef DK_EOL
+#undef DK_HEADERS
@@ -0,0 +1,328 @@
+/*
+ * an asynchronous reader of whole files: read() opens the file and starts reading it
+ * in the background right away, get() waits till the file is read and returns its
+ * content; thus reads of many files are in flight in parallel and overlap with
+ * whatever the caller does in between
+ *
+ * on linux the reads go through io_uring (all the reads are submitted at once and
+ * the kernel performs them concurrently), if io_uring is unavailable (older kernel,
+ * or prohibited by seccomp) the reader falls back to posix_fadvise(WILLNEED) (which
+ * starts the kernel's readahead) and pread() in get(); elsewhere only pread() is used
+ *
+ * buffers are not zero-initialized before reading, thus on the io_uring path even
+ * faulting in the buffer's pages occurs in the background (in the kernel)
+ *
+ * the reader is not thread-safe (intended to be owned by a single user)
+ *
+ *
+ * SYNOPSIS:
+ *  FileReader fr;
+ *  auto a = fr.read("report.pdf"), b = fr.read("data.csv");   // both are being read
+ *  ...                                                         // do something else
+ *  FileReader::Data d = fr.get(a);                             // nullptr: read failed
+ *  if(d) std::cout << "read " << fr.length(a) << " bytes" << std::endl;
+ *
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+
+
+#define FR_RING_ENTRIES 64                                      // reads in flight (io_uring)
+#define FR_MAX_READ (1 << 30)                                   // max bytes per read request
+
+class FileReader {
+ public:
+    typedef std::shared_ptr<const char> Data;                   // file's content
+
+                        FileReader(void) = default;
+                        FileReader(const FileReader &) = delete;
+                       ~FileReader(void) { clear(); close_ring_(); }
+    FileReader &        operator=(const FileReader &) = delete;
+
+    size_t              read(const std::string &path);          // start reading, return handle
+    Data                get(size_t h);                          // wait till read
+    size_t              length(size_t h) const { return h < files_.size()? files_[h].size: 0; }
+    FileReader &        clear(void);                            // drop all files (waits reads)
+
+    size_t              size(void) const { return files_.size(); }
+    bool                uring(void) const { return ring_ >= 0; }
+
+ private:
+    struct File_ {
+        std::shared_ptr<char>
+                            data;
+        size_t              size{0};
+        int                 fd{-1};
+        size_t              done{0};                            // bytes read so far
+        bool                inflight{false};                    // read request is submitted
+        bool                failed{false};
+    };
+
+    bool                finished_(const File_ &f) const
+                         { return f.fd < 0 or f.failed or f.done == f.size; }
+    void                finish_(File_ &f, bool failed = false) {
+                         if(f.fd >= 0) ::close(f.fd);
+                         f.fd = -1;
+                         f.failed = f.failed or failed;
+                        }
+    void                pread_(File_ &f);                       // read the rest synchronously
+
+    std::vector<File_>  files_;
+
+    // io_uring part
+    bool                open_ring_(void);
+    void                close_ring_(void);
+    bool                submit_(size_t h);                      // queue read of the next part
+    void                reap_(void);                            // wait for completions
+    void                break_ring_(void);                      // fall back to pread()
+
+    int                 ring_{-1};                              // -1: no ring (yet), -2: failed
+    int                 broken_{-1};                            // ring which failed, kept open
+    size_t              inflight_{0};
+    std::vector<std::shared_ptr<char>>
+                        orphans_;                               // buffers of reads lost in ring
+ #ifdef __linux__
+    void *              sq_ptr_{nullptr};
+    void *              cq_ptr_{nullptr};
+    size_t              sq_len_{0}, cq_len_{0};
+    io_uring_sqe *      sqes_{nullptr};
+    size_t              sqes_len_{0};
+    unsigned *          sq_tail_, * sq_mask_, * sq_array_;
+    unsigned *          cq_head_, * cq_tail_, * cq_mask_;
+    io_uring_cqe *      cqes_;
+    unsigned            entries_{0};
+ #endif
+};
+
+
+
+size_t FileReader::read(const std::string &path) {
+ // open the file and start reading it; a failure to open (or stat) is not reported
+ // here, but by get()
+ files_.emplace_back();
+ File_ &f = files_.back();
+ size_t h = files_.size() - 1;
+ struct stat st;
+ f.fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+ if(f.fd < 0 or fstat(f.fd, &st) != 0 or not S_ISREG(st.st_mode))
+  { finish_(f, true); return h; }
+ f.size = st.st_size;
+ f.data.reset(new char[f.size], std::default_delete<char[]>());
+ if(f.size == 0) { finish_(f); return h; }
+
+ if(open_ring_() and submit_(h)) return h;
+ #ifdef POSIX_FADV_WILLNEED
+ posix_fadvise(f.fd, 0, 0, POSIX_FADV_WILLNEED);               // kernel starts readahead
+ #endif
+ return h;
+}
+
+
+FileReader::Data FileReader::get(size_t h) {
+ // wait till the file is read, return its content (nullptr if reading failed)
+ if(h >= files_.size()) return nullptr;
+ File_ &f = files_[h];
+ while(not finished_(f)) {
+  if(f.inflight) { reap_(); continue; }
+  if(ring_ >= 0 and submit_(h)) continue;
+  pread_(f);
+ }
+ finish_(f);
+ return f.failed? nullptr: f.data;
+}
+
+
+FileReader & FileReader::clear(void) {
+ // drop all the files; reads in flight have to complete first (the kernel writes
+ // into the buffers)
+ while(inflight_ > 0) reap_();
+ for(auto &f: files_) finish_(f);
+ files_.clear();
+ return *this;
+}
+
+
+void FileReader::pread_(File_ &f) {
+ while(f.done < f.size) {
+  ssize_t n = ::pread(f.fd, f.data.get() + f.done, f.size - f.done, f.done);
+  if(n < 0 and errno == EINTR) continue;
+  if(n <= 0) { finish_(f, true); return; }                      // error or file got truncated
+  f.done += n;
+ }
+ finish_(f);
+}
+
+
+
+#ifdef __linux__
+
+bool FileReader::open_ring_(void) {
+ // set up io_uring once (at the first read), false: io_uring is unavailable
+ if(ring_ != -1) return ring_ >= 0;
+ ring_ = -2;
+ io_uring_params p{};
+ int fd = syscall(__NR_io_uring_setup, FR_RING_ENTRIES, &p);
+ if(fd < 0) return false;
+
+ sq_len_ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+ cq_len_ = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+ if(p.features & IORING_FEAT_SINGLE_MMAP)
+  sq_len_ = cq_len_ = std::max(sq_len_, cq_len_);
+ sqes_len_ = p.sq_entries * sizeof(io_uring_sqe);
+
+ sq_ptr_ = mmap(nullptr, sq_len_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                fd, IORING_OFF_SQ_RING);
+ cq_ptr_ = p.features & IORING_FEAT_SINGLE_MMAP? sq_ptr_:
+           mmap(nullptr, cq_len_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                fd, IORING_OFF_CQ_RING);
+ void *sqes = mmap(nullptr, sqes_len_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   fd, IORING_OFF_SQES);
+ ring_ = fd;
+ if(sq_ptr_ == MAP_FAILED or cq_ptr_ == MAP_FAILED or sqes == MAP_FAILED) {
+  if(sq_ptr_ == MAP_FAILED) sq_ptr_ = nullptr;
+  if(cq_ptr_ == MAP_FAILED) cq_ptr_ = nullptr;
+  if(sqes != MAP_FAILED) munmap(sqes, sqes_len_);
+  close_ring_();
+  ring_ = -2;
+  return false;
+ }
+
+ char *sq = static_cast<char *>(sq_ptr_), *cq = static_cast<char *>(cq_ptr_);
+ sq_tail_ = reinterpret_cast<unsigned *>(sq + p.sq_off.tail);
+ sq_mask_ = reinterpret_cast<unsigned *>(sq + p.sq_off.ring_mask);
+ sq_array_ = reinterpret_cast<unsigned *>(sq + p.sq_off.array);
+ cq_head_ = reinterpret_cast<unsigned *>(cq + p.cq_off.head);
+ cq_tail_ = reinterpret_cast<unsigned *>(cq + p.cq_off.tail);
+ cq_mask_ = reinterpret_cast<unsigned *>(cq + p.cq_off.ring_mask);
+ cqes_ = reinterpret_cast<io_uring_cqe *>(cq + p.cq_off.cqes);
+ sqes_ = static_cast<io_uring_sqe *>(sqes);
+ entries_ = p.sq_entries;
+ return true;
+}
+
+
+void FileReader::close_ring_(void) {
+ // release the ring (a working or a broken one); buffers of the reads lost in the
+ // broken ring are freed only once the ring is closed
+ int fd = ring_ >= 0? ring_: broken_;
+ if(fd < 0) return;
+ if(sqes_ != nullptr) munmap(sqes_, sqes_len_);
+ if(cq_ptr_ != nullptr and cq_ptr_ != sq_ptr_) munmap(cq_ptr_, cq_len_);
+ if(sq_ptr_ != nullptr) munmap(sq_ptr_, sq_len_);
+ sqes_ = nullptr;
+ sq_ptr_ = cq_ptr_ = nullptr;
+ ::close(fd);
+ if(ring_ >= 0) ring_ = -1;
+ broken_ = -1;
+ orphans_.clear();
+}
+
+
+void FileReader::break_ring_(void) {
+ // the ring failed: further reads go with pread(); the kernel may still be writing
+ // into buffers of the reads in flight, those are kept (along with the ring) till
+ // the reader is destroyed, while their files get new buffers (holding what has
+ // been read already)
+ broken_ = ring_;
+ ring_ = -2;
+ for(auto &f: files_) {
+  if(not f.inflight) continue;
+  std::shared_ptr<char> data(new char[f.size], std::default_delete<char[]>());
+  memcpy(data.get(), f.data.get(), f.done);
+  orphans_.push_back(std::move(f.data));
+  f.data = std::move(data);
+  f.inflight = false;
+ }
+ inflight_ = 0;
+}
+
+
+bool FileReader::submit_(size_t h) {
+ // submit read of the file's remainder (up to FR_MAX_READ bytes); if the ring is full
+ // wait for a completion first; false: the read could not be submitted
+ File_ &f = files_[h];
+ while(inflight_ >= entries_) reap_();
+ if(ring_ < 0) return false;                                    // the ring broke meanwhile
+
+ unsigned tail = *sq_tail_, idx = tail & *sq_mask_;
+ io_uring_sqe &sqe = sqes_[idx];
+ sqe = io_uring_sqe{};
+ sqe.opcode = IORING_OP_READ;
+ sqe.flags = IOSQE_ASYNC;                                       // do not copy cached data inline
+ sqe.fd = f.fd;
+ sqe.off = f.done;
+ sqe.addr = reinterpret_cast<uintptr_t>(f.data.get() + f.done);
+ sqe.len = std::min<size_t>(f.size - f.done, FR_MAX_READ);
+ sqe.user_data = h;
+ sq_array_[idx] = idx;
+ __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+
+ int rc;
+ do rc = syscall(__NR_io_uring_enter, ring_, 1, 0, 0, nullptr, 0);
+ while(rc < 0 and errno == EINTR);
+ if(rc != 1) {                                                  // not consumed: take it back
+  __atomic_store_n(sq_tail_, tail, __ATOMIC_RELEASE);
+  return false;
+ }
+ f.inflight = true;
+ ++inflight_;
+ return true;
+}
+
+
+void FileReader::reap_(void) {
+ // wait for at least one completion, process all available: a short read is re-
+ // submitted right away, if the kernel does not support IORING_OP_READ, the file
+ // is read with pread()
+ if(inflight_ == 0) return;
+ unsigned head = *cq_head_;
+ if(head == __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) {
+  int rc = syscall(__NR_io_uring_enter, ring_, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+  if(rc < 0 and errno != EINTR) { break_ring_(); return; }      // ring broke: give up on it
+ }
+
+ for(unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE); head != tail; ++head) {
+  io_uring_cqe &cqe = cqes_[head & *cq_mask_];
+  File_ &f = files_[cqe.user_data];
+  int res = cqe.res;
+  f.inflight = false;
+  --inflight_;
+  if(res == -EINVAL or res == -EOPNOTSUPP)                      // pre 5.6 kernel: no OP_READ
+   { pread_(f); continue; }
+  if(res <= 0 and res != -EINTR and res != -EAGAIN)             // error, or file got truncated
+   { finish_(f, true); continue; }
+  if(res > 0) f.done += res;
+  if(not finished_(f)) submit_(cqe.user_data);                  // keep reading ahead
+ }
+ __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+}
+
+#else
+
+bool FileReader::open_ring_(void) { return false; }
+void FileReader::close_ring_(void) {}
+bool FileReader::submit_(size_t) { return false; }
+void FileReader::reap_(void) {}
+void FileReader::break_ring_(void) {}
+
+#endif
+
+
+#undef FR_RING_ENTRIES
+#undef FR_MAX_READ
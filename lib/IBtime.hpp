@@ -2,6 +2,15 @@
  * Classes Time, Date and DateTime convert time date from/to string format.
  * class strictly require string in format YYYYMMDD HH:MM:SS (no time zone!)
  * timezone notion can be programmatically provided either LT (whatever local TZ) or UTC
+ *
+ * conversions between civil date/time and epoch stamps are done arithmetically
+ * (days from/to civil), local time offsets are looked up via localtime_r() once per
+ * day and cached (per thread), hence no mktime() and no global TZ lock is involved
+ * when parsing/setting dates (a change of TZ environment variable during the
+ * program run is not picked up for already cached days)
+ *
+ * class WallClock is a cached wall-clock service (local time): second-granular
+ * strings are formatted at most once per second and shared by all the callers
  */
 #pragma once
 
@@ -9,6 +18,10 @@
 #include <iomanip>
 #include <string>
 #include <sstream>
+#include <atomic>
+#include <stdint.h>
+#include <ctype.h>
+#include <string.h>
 #include <time.h>
 #include <sys/time.h>
 #include "extensions.hpp"
@@ -54,9 +67,18 @@ class DateTime {
                         DateTime(const std::string &str, Locality l=LT) { set_DateTime(str, l); }
                         DateTime(std::string &&str, Locality l=LT): DateTime(str, l) {}
 
+    // civil date <-> days since epoch (proleptic Gregorian calendar, no TZ notion)
+    static constexpr long
+                        days_from_civil(long y, unsigned m, unsigned d);
+    static void         civil_from_days(long days, long &y, unsigned &m, unsigned &d);
+    static constexpr unsigned
+                        last_day_of_month(long y, unsigned m);
+
     // set date and time
     // set custom date/time
-    DateTime &          set_DateTime(const std::string &str, Locality l=LT );
+    DateTime &          set_DateTime(const std::string &str, Locality l=LT )
+                         { return set_DateTime(str.c_str(), l); }
+    DateTime &          set_DateTime(const char *str, Locality l=LT);  // no allocations
     DateTime &          set_time(const std::string &str, Locality l=LT);     // e.g., str: '11:22:33'
     DateTime &          set_time(int hour, int munites, int seconds, Locality l=LT);
     DateTime &          set_time(int ts, Locality l=LT)
@@ -108,12 +130,13 @@ class DateTime {
     int                 yearday(Locality l=LT) const;           // day of year (0 - 365)
     int                 datestamp(Locality l=LT) const;         // e.g: 20150131 (year+month+day)
     int                 timestamp(Locality l=LT) const;         // e.g: 93059 (hours+minutes+seconds)
-    int                 utc_offset(void);                       // offset to UTC in seconds
+    int                 utc_offset(void) const;                 // offset to UTC in seconds
 
     // return string representation of date/time
     std::string         time_str(Locality l=LT) const;
     std::string         date_str(Locality l=LT) const;
     std::string         str(Locality l=LT) const;               // full date time format
+    size_t              rfc5322(char *buf, size_t size, Locality l=LT) const;   // RFC5322 date
     const char*         c_str(Locality l=LT) { return str(l).c_str(); }     // full format in c-str
                         operator std::string(void) { return str(); }
     bool                operator >(const DateTime & rhs)const { return stamp_ > rhs.stamp(); }
@@ -134,9 +157,37 @@ class DateTime {
  private:
     time_t              stamp_;                                 // [seconds], UTC
 
-    void                parseDate_(const std::string &, tm &);
-    void                parseTime_(const std::string &, tm &);
-    time_t              timegm_portable(struct tm *);
+    tm                  break_down_(Locality l) const {         // reentrant localtime/gmtime
+                         tm tms;
+                         if(l == UTC) gmtime_r(&stamp_, &tms);
+                         else localtime_r(&stamp_, &tms);
+                         return tms;
+                        }
+    void                parseDate_(const char *, long &y, int &m, int &d) const;
+    void                parseTime_(const char *, int &h, int &m, int &s) const;
+
+    // 8 characters loaded into a (little endian) word: digits check and conversion
+    #define COLONS_MASK_ 0x0000FF0000FF0000ULL                  // "HH:MM:SS" separators
+    #define COLONS_ 0x00003A00003A0000ULL
+    #define ZEROS_AT_COLONS_ 0x0000300000300000ULL
+    static bool         digits8_(uint64_t w) {                  // all 8 bytes are '0'-'9'?
+                         return ((w & 0xF0F0F0F0F0F0F0F0ULL) |
+                                 (((w + 0x0606060606060606ULL) & 0xF0F0F0F0F0F0F0F0ULL) >> 4))
+                                == 0x3333333333333333ULL;
+                        }
+    static uint64_t     pairs8_(uint64_t w) {                   // byte i: 2-digit value of i,i+1
+                         w -= 0x3030303030303030ULL;
+                         return w * 10 + (w >> 8);
+                        }
+
+    static time_t       to_local_(time_t stamp, Locality l)     // epoch stamp shifted to l
+                         { return l == UTC? stamp: stamp + tz_offset_(stamp); }
+    static time_t       from_local_(time_t local, Locality l);  // reverse of to_local_()
+    static long         day_of_(time_t t)                       // floor division by a day
+                         { return t >= 0? t / 86400: (t - 86399) / 86400; }
+    static int          tz_offset_(time_t stamp);               // cached local offset to UTC
+
+    #define TZ_CACHE_SIZE 1024                                  // [days], must be a power of 2
 
     static std::string  ds;                                    // output date separator
     static std::string  ts;                                    // output time separator
@@ -157,79 +208,118 @@ STRINGIFY( DateTime::Weekday, WD )
 STRINGIFY( DateTime::FullWeekday, FULLWD )
 #undef FULLWD
 
+#define RFC5322_DATE_LEN 40                                     // buffer size for rfc5322()
+
+
+constexpr long DateTime::days_from_civil(long y, unsigned m, unsigned d) {
+ // number of days since 1970-01-01 for the civil date y-m-d (m: 1-12, d: 1-31);
+ // algorithm by H.Hinnant, year is shifted to start on March 1st, so that Feb 29
+ // is the last day of the (shifted) year
+ y -= m <= 2;
+ long era = (y >= 0? y: y - 399) / 400;
+ unsigned yoe = static_cast<unsigned>(y - era * 400);           // [0, 399]
+ unsigned doy = (153 * (m > 2? m - 3: m + 9) + 2) / 5 + d - 1;  // [0, 365]
+ unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;          // [0, 146096]
+ return era * 146097 + static_cast<long>(doe) - 719468;
+}
+
+
+void DateTime::civil_from_days(long days, long &y, unsigned &m, unsigned &d) {
+ // reverse of days_from_civil()
+ days += 719468;
+ long era = (days >= 0? days: days - 146096) / 146097;
+ unsigned doe = static_cast<unsigned>(days - era * 146097);     // [0, 146096]
+ unsigned yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;  // [0, 399]
+ unsigned doy = doe - (365 * yoe + yoe / 4 - yoe / 100);        // [0, 365]
+ unsigned mp = (5 * doy + 2) / 153;                             // [0, 11]
+ d = doy - (153 * mp + 2) / 5 + 1;
+ m = mp < 10? mp + 3: mp - 9;
+ y = static_cast<long>(yoe) + era * 400 + (m <= 2);
+}
+
+
+constexpr unsigned DateTime::last_day_of_month(long y, unsigned m) {
+ return m != 2? 30 + ((m + (m > 7)) & 1):
+        (y % 4 == 0 and (y % 100 != 0 or y % 400 == 0))? 29: 28;
+}
+
 std::string DateTime::ds;
 std::string DateTime::ts{":"};
 // typically, programs use the same uniform date-time format through
 // out entire program, hence defining separators as class static
 
 
-DateTime & DateTime::set_DateTime(const std::string &str, Locality l) {
+DateTime & DateTime::set_DateTime(const char *str, Locality l) {
  // str in format: "YYYYMMDD HH:MM:SS"; locality is either LT or UTC
- tm dateTime{0};
- parseDate_(str, dateTime);
- int date = (dateTime.tm_year + 1900) * 10000 + (dateTime.tm_mon + 1) * 100 + dateTime.tm_mday;
-
- if(str[8] != ' ') throw EXP(space_only_separator_allowed);
- parseTime_(&str[9], dateTime);
-
- if(l == UTC) stamp_ = timegm_portable(& dateTime);
- else stamp_ = mktime(& dateTime);
- if(stamp_ == -1) throw EXP(invalid_date_or_time_format);
- if(datestamp() != date) throw EXP(bogus_date_stamp);
+ // canonical strings take a fast path (all fields validated in one go), anything
+ // else goes through the checking parsers, which throw the exact reason
+ #if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  uint64_t dw, tw;                                              // date and time words
+  if(strnlen(str, 18) == 17 and str[8] == ' ') {
+   memcpy(&dw, str, 8);
+   memcpy(&tw, str + 9, 8);
+   bool colons = (tw & COLONS_MASK_) == COLONS_;
+   tw = (tw & ~COLONS_MASK_) | ZEROS_AT_COLONS_;                // "HH0MM0SS"
+   if(colons and digits8_(dw) and digits8_(tw)) {
+    dw = pairs8_(dw);                                           // bytes 0,2,4,6: YY,YY,MM,DD
+    tw = pairs8_(tw);                                           // bytes 0,3,6: HH,MM,SS
+    long y = (dw & 0xFF) * 100 + (dw >> 16 & 0xFF);
+    unsigned m = dw >> 32 & 0xFF, d = dw >> 48 & 0xFF;
+    unsigned hh = tw & 0xFF, mm = tw >> 24 & 0xFF, ss = tw >> 48 & 0xFF;
+    if(y >= 1970 and m - 1 < 12 and d - 1 < last_day_of_month(y, m) and
+       hh < 24 and mm < 60 and ss < 60) {
+     stamp_ = from_local_(days_from_civil(y, m, d) * 86400 + hh * 3600 + mm * 60 + ss, l);
+     return *this;
+    }
+   }
+  }
+ #endif
+
+ long y;
+ int m, d, hh, mm, ss;
+ parseDate_(str, y, m, d);
+
+ if(strnlen(str, 9) < 9 or str[8] != ' ') throw EXP(space_only_separator_allowed);
+ parseTime_(str + 9, hh, mm, ss);
+ if(m < 1 or d > static_cast<int>(last_day_of_month(y, m))) throw EXP(bogus_date_stamp);
+
+ stamp_ = from_local_(days_from_civil(y, m, d) * 86400 + hh * 3600 + mm * 60 + ss, l);
  return *this;
 }
 
 
 DateTime & DateTime::set_time(const std::string &str, Locality l) {
  // str in format: "HH:MM:SS"; locality is either LT or UTC
- tm * tmp;
- if(l == UTC) tmp = gmtime(& stamp_);
- else tmp = localtime(& stamp_);
- parseTime_(str, *tmp);
- if(l == UTC) stamp_ = timegm_portable(tmp);
- else stamp_ = mktime(tmp);
- if(stamp_ == -1) throw EXP(invalid_time_format);
- return *this;
+ int h, m, s;
+ parseTime_(str.c_str(), h, m, s);
+ return set_time(h, m, s, l);
 }
 
 
 DateTime & DateTime::set_time(int hours, int minutes, int seconds, Locality l) {
- tm * tmp;
- if(l == UTC) tmp = gmtime(& stamp_);
- else tmp = localtime(& stamp_);
- tmp->tm_hour = hours;
- tmp->tm_min = minutes;
- tmp->tm_sec = seconds;
- if(l == UTC) stamp_ = timegm_portable(tmp);
- else stamp_ = mktime(tmp);
- if(stamp_ == -1) throw EXP(invalid_time_format);
+ // out of range values are normalized (e.g.: 25 hours is 1 hour of the next day)
+ long day = day_of_(to_local_(stamp_, l));
+ stamp_ = from_local_(day * 86400 + hours * 3600L + minutes * 60L + seconds, l);
  return *this;
 }
 
 
 DateTime & DateTime::set_date(const std::string &str, Locality l) {
  // str in format: "YYYYMMDD"; locality is either LT or UTC
- tm * tmp;
- if(l == UTC) tmp = gmtime(& stamp_);
- else tmp = localtime(& stamp_);
- parseDate_(str, *tmp);
- if(l == UTC) stamp_ = timegm_portable(tmp);
- else stamp_ = mktime(tmp);
- if(stamp_ == -1) throw EXP(invalid_date_format);
- return *this;
+ long y;
+ int m, d;
+ parseDate_(str.c_str(), y, m, d);
+ return set_date(d, m, y, l);
 }
 
 
 DateTime & DateTime::set_date(int day, int month, int year, Locality l) {
- tm * tmp;
- if(l == UTC) tmp = gmtime(& stamp_);
- else tmp = localtime(& stamp_);
- tmp->tm_mday = day;
- tmp->tm_mon = month-1;
- tmp->tm_year = year-1900;
- if(l == UTC) stamp_ = timegm_portable(tmp);
- else stamp_ = mktime(tmp);
- if(stamp_ == -1) throw EXP(invalid_date_format);
+ // out of range values are normalized (e.g.: Feb 30 is Mar 1 or 2)
+ long y = year + (month - 1 >= 0? (month - 1) / 12: (month - 12) / 12);
+ unsigned m = month - 1 - (y - year) * 12 + 1;
+ time_t local = to_local_(stamp_, l);
+ time_t sod = local - day_of_(local) * 86400;                   // seconds of the day
+ stamp_ = from_local_((days_from_civil(y, m, 1) + day - 1) * 86400 + sod, l);
  return *this;
 }
 
@@ -244,98 +334,76 @@ DateTime & DateTime::now(void) {
 
 
 DateTime & DateTime::add_months(long n) {
- tm * tmp;
- tmp = gmtime(& stamp_);
- int originalDay = tmp->tm_mday;
-
- int newMonth = (tmp->tm_mon + n) % 12;
- int newYearDelta = (tmp->tm_mon + n) / 12;
- if(newMonth < 0) {
-  newMonth += 12;
-  newYearDelta--;
- }
- tmp->tm_mon = newMonth;
- tmp->tm_year += newYearDelta;
-
- stamp_ = timegm_portable(tmp);
-
- // check for month adjustments. each month is different in length thus need to adjust
- tmp = gmtime(& stamp_);
- if( tmp->tm_mday != originalDay)
-  add_days(-tmp->tm_mday);
-
+ // the day of month is clamped to the resulting month's length (e.g.: Jan 31 + 1
+ // month is Feb 28 or 29), the time of the day is preserved
+ long days = day_of_(stamp_);
+ time_t sod = stamp_ - days * 86400;                            // seconds of the day
+ long y;
+ unsigned m, d;
+ civil_from_days(days, y, m, d);
+
+ long mon = y * 12 + m - 1 + n;                                 // months since year 0
+ y = mon >= 0? mon / 12: (mon - 11) / 12;
+ m = mon - y * 12 + 1;
+ if(d > last_day_of_month(y, m)) d = last_day_of_month(y, m);
+
+ stamp_ = days_from_civil(y, m, d) * 86400 + sod;
  return *this;
 }
 
 
 int DateTime::seconds(Locality l) const {
  // returns seconds part in the stamp
- tm * tmp;
- if(l == UTC) tmp = gmtime(& stamp_);
- else tmp = localtime(& stamp_);
- return tmp->tm_sec;
+ tm tms = break_down_(l);
+ return tms.tm_sec;
 }
 
 
 int DateTime::minutes(Locality l) const {
  // returns minutes part in the stamp
- tm * tmp;
- if(l == UTC) tmp = gmtime(& stamp_);
- else tmp = localtime(& stamp_);
- return tmp->tm_min;
+ tm tms = break_down_(l);
+ return tms.tm_min;
 }
 
 
 int DateTime::hours(Locality l) const {
  // returns hours part in the stamp
- tm * tmp;
- if(l == UTC) tmp = gmtime(& stamp_);
- else tmp = localtime(& stamp_);
- return tmp->tm_hour;
+ tm tms = break_down_(l);
+ return tms.tm_hour;
 }
 
 
 int DateTime::day(Locality l) const {
  // returns day part in the stamp
- tm * tmp;
- if(l == UTC) tmp = gmtime(& stamp_);
- else tmp = localtime(& stamp_);
- return tmp->tm_mday;
+ tm tms = break_down_(l);
+ return tms.tm_mday;
 }
 
 
 int DateTime::month(Locality l) const {
  // returns month part in the stamp
- tm * tmp;
- if(l == UTC) tmp = gmtime(& stamp_);
- else tmp = localtime(& stamp_);
- return tmp->tm_mon+1;
+ tm tms = break_down_(l);
+ return tms.tm_mon+1;
 }
 
 
 int DateTime::year(Locality l) const {
  // returns year part in the stamp
- tm * tmp;
- if(l == UTC) tmp = gmtime(& stamp_);
- else tmp = localtime(& stamp_);
- return tmp->tm_year+1900;
+ tm tms = break_down_(l);
+ return tms.tm_year+1900;
 }
 
 
 int DateTime::weekday(Locality l) const {
  // returns weekday of the stamp
- tm * tmp;
- if(l == UTC) tmp = gmtime(& stamp_);
- else tmp = localtime(& stamp_);
- return tmp->tm_wday;
+ tm tms = break_down_(l);
+ return tms.tm_wday;
 }
 
 int DateTime::yearday(Locality l) const {
  // returns day of a year in the stamp
- tm * tmp;
- if(l == UTC) tmp = gmtime(& stamp_);
- else tmp = localtime(& stamp_);
- return tmp->tm_yday;
+ tm tms = break_down_(l);
+ return tms.tm_yday;
 }
 
 int DateTime::datestamp(Locality l) const {                     // e.g: 20150131 (year+month+day)
@@ -348,127 +416,287 @@ int DateTime::timestamp(Locality l) const {                     // e.g: 93059 (h
 return hours(l) * 10000 + minutes(l) * 100 + seconds(l);
 }
 
-int DateTime::utc_offset(void) {
+int DateTime::utc_offset(void) const {
  // returns seconds local time offset from UTC in seconds
- tm * tmp;
- tmp = localtime(& stamp_);
- return tmp->tm_gmtoff;
+ return tz_offset_(stamp_);
 }
 
-void DateTime::parseDate_(const std::string &str, tm & dateTime) {
- // fills dateTime structure tm from string "YYYYMMDD"
- long y=-1, m=-1, d=-1;                                         // year, month, day
+void DateTime::parseDate_(const char *str, long &y, int &m, int &d) const {
+ // parse string "YYYYMMDD" into year, month (1-12), day
+ while(*str == ' ') ++str;
+ if(*str < '0' or *str > '9') throw EXP(stamp_missing);
 
- std::stringstream sin(str);
- sin.seekg(0) >> d;
- if(d == -1) throw EXP(stamp_missing);
+ long ds = 0;
+ for(; *str >= '0' and *str <= '9'; ++str)
+  ds = ds * 10 + *str - '0';
 
- y = d/10000-1900; d %= 10000;
- if(y < 70) throw EXP(year_below_1970);
+ y = ds / 10000;
+ if(y < 1970) throw EXP(year_below_1970);
 
- m = d/100-1; d %= 100;
- if(m > 11) throw EXP(month_out_of_range_01_12);
+ m = ds / 100 % 100;
+ if(m > 12) throw EXP(month_out_of_range_01_12);
+ d = ds % 100;
  if(d < 1 or d > 31) throw EXP(day_out_of_range_01_31);
-
- dateTime.tm_year = y;
- dateTime.tm_mon = m;
- dateTime.tm_mday = d;
 }
 
 
-void DateTime::parseTime_(const std::string & str, tm & dateTime) {
- // fills dateTime structure tm from string "HH:MM:SS"
- long h=-1, m=-1, s=-1;                                         // hours, mins, secs
- std::string timeStr{str + ':'};
- std::stringstream sin(timeStr);
- sin.seekg(0);
- int so = 0;                                                    // space offset
+void DateTime::parseTime_(const char *str, int &h, int &m, int &s) const {
+ // parse string "HH:MM:SS" into hours, minutes and seconds
+ auto two_digits = [](const char *p) {
+                    return p[0] >= '0' and p[0] <= '9' and p[1] >= '0' and p[1] <= '9'?
+                           (p[0] - '0') * 10 + p[1] - '0': -1;
+                   };
+ while(*str == ' ') ++str;
+
+ h = two_digits(str);
+ if(h < 0 or h > 23 or str[2] != ':') throw EXP(hours_out_of_range_00_23);
+ m = two_digits(str + 3);
+ if(m < 0 or m > 59 or str[5] != ':') throw EXP(minutes_out_of_range_00_59);
+ s = two_digits(str + 6);
+ if(s < 0 or s > 59) throw EXP(seconds_out_of_range_00_59);
+
+ for(str += 8; *str != '\0'; ++str)
+  if(not isspace(static_cast<unsigned char>(*str))) throw EXP(trailing_symbols_disallowed);
+}
 
- while(sin.peek() == ' ') { sin.get(); ++so; }
- sin >> h;
- if(h > 23 or sin.tellg() != (2+so)) throw EXP(hours_out_of_range_00_23);
 
- sin.ignore(1,':') >> m;
- if(m > 59 or sin.tellg() != (5+so)) throw EXP(minutes_out_of_range_00_59);
+time_t DateTime::from_local_(time_t local, Locality l) {
+ // convert stamp expressed in locality l into epoch stamp (UTC): the offset is
+ // first guessed at the local value, then refined at the resulting stamp (the
+ // guess might be off across DST transitions); local times skipped or repeated by
+ // a transition resolve to either of the adjacent offsets
+ if(l == UTC) return local;
+ time_t stamp = local - tz_offset_(local);
+ return local - tz_offset_(stamp);
+}
 
- sin.ignore(1,':') >> s;
- if(s > 59 or sin.tellg() != (8+so)) throw EXP(seconds_out_of_range_00_59);
 
- char c;
- sin >> c >> c;
- if(c != ':' or not sin.eof()) throw EXP(trailing_symbols_disallowed);
+int DateTime::tz_offset_(time_t stamp) {
+ // local time offset from UTC for the given stamp; offsets are cached per (UTC) day,
+ // days with a TZ transition (offsets at the day's start and end differ) are not
+ // cached - those are always looked up
+ struct Slot {
+    long                day;                                    // day + 1, 0: empty slot
+    int                 offset;
+ };
+ static thread_local Slot cache[TZ_CACHE_SIZE];
+
+ long day = day_of_(stamp);
+ Slot &slot = cache[day & (TZ_CACHE_SIZE - 1)];
+ if(slot.day == day + 1) return slot.offset;
+
+ tm tms;
+ time_t edge = day * 86400;
+ localtime_r(&edge, &tms);
+ int offset = tms.tm_gmtoff;
+ edge += 86399;
+ localtime_r(&edge, &tms);
+ if(tms.tm_gmtoff == offset) {
+  slot.day = day + 1;
+  slot.offset = offset;
+  return offset;
+ }
 
- dateTime.tm_hour = h;
- dateTime.tm_min = m;
- dateTime.tm_sec = s;
+ localtime_r(&stamp, &tms);                                     // transition day
+ return tms.tm_gmtoff;
 }
 
 
 std::string DateTime::time_str(Locality l) const {
  // return string representing time (HH:MM:SS) from the stamp
- tm * tmp;
- if(l == UTC) tmp = gmtime(& stamp_);
- else tmp = localtime(& stamp_);
+ tm tms = break_down_(l);
 
  std::stringstream so;
- so << std::setfill('0') << std::setw(2) << tmp->tm_hour << ts
-    << std::setfill('0') << std::setw(2) << tmp->tm_min << ts
-    << std::setfill('0') << std::setw(2) << tmp->tm_sec;
+ so << std::setfill('0') << std::setw(2) << tms.tm_hour << ts
+    << std::setfill('0') << std::setw(2) << tms.tm_min << ts
+    << std::setfill('0') << std::setw(2) << tms.tm_sec;
  return so.str();
 }
 
 
 std::string DateTime::date_str(Locality l) const {
  // return string representing date (YYYYMMDD) from the stamp
- tm * tmp;
- if(l == UTC) tmp = gmtime(& stamp_);
- else tmp = localtime(& stamp_);
+ tm tms = break_down_(l);
 
  std::stringstream so;
- so << tmp->tm_year+1900 << ds;
+ so << tms.tm_year+1900 << ds;
  if( ds.empty() )
-  so << std::setfill('0') << std::setw(2) << tmp->tm_mon+1 << ds;
+  so << std::setfill('0') << std::setw(2) << tms.tm_mon+1 << ds;
  else
-  so << ENUMS(Mon, tmp->tm_mon) << ds;
- so << std::setfill('0') << std::setw(2) << tmp->tm_mday;
+  so << ENUMS(Mon, tms.tm_mon) << ds;
+ so << std::setfill('0') << std::setw(2) << tms.tm_mday;
  return so.str();
 }
 
 
 std::string DateTime::str(Locality l) const {
  // return string representing date-time (YYYYMMDD HH:MM:SS) from the stamp
- tm * tmp;
- if(l == UTC) tmp = gmtime(& stamp_);
- else tmp = localtime(& stamp_);
+ tm tms = break_down_(l);
 
  std::stringstream so;
- so << tmp->tm_year+1900 << ds;
+ so << tms.tm_year+1900 << ds;
  if( ds.empty() )
-  so << std::setfill('0') << std::setw(2) << tmp->tm_mon+1 << ds;
+  so << std::setfill('0') << std::setw(2) << tms.tm_mon+1 << ds;
  else
-  so << ENUMS(Mon, tmp->tm_mon) << ds;
- so << std::setfill('0') << std::setw(2) << tmp->tm_mday << ' '
-    << std::setfill('0') << std::setw(2) << tmp->tm_hour << ts
-    << std::setfill('0') << std::setw(2) << tmp->tm_min << ts
-    << std::setfill('0') << std::setw(2) << tmp->tm_sec;
+  so << ENUMS(Mon, tms.tm_mon) << ds;
+ so << std::setfill('0') << std::setw(2) << tms.tm_mday << ' '
+    << std::setfill('0') << std::setw(2) << tms.tm_hour << ts
+    << std::setfill('0') << std::setw(2) << tms.tm_min << ts
+    << std::setfill('0') << std::setw(2) << tms.tm_sec;
  return so.str();
 }
 
 
 
-// implementation as per 'man timegm'
-time_t DateTime::timegm_portable(struct tm * dateTime) {
- time_t ret;
- char *tz;
+size_t DateTime::rfc5322(char *buf, size_t size, Locality l) const {
+ // write into buf the date in RFC5322 format, e.g.: Wed, 4 Jul 2018 14:21:58 +0200
+ // the date is broken down only once and no heap is used (thus it's safe for
+ // multi-threaded use); returns the length of the written string, or 0 if the
+ // buffer is too small (RFC5322_DATE_LEN is always enough)
+ static const char d2[] =                                       // 2-digit lookup table
+  "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+  "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+  "8081828384858687888990919293949596979899";
+ if(size < RFC5322_DATE_LEN) return 0;
+
+ tm tms = break_down_(l);
+ char *p = buf;
+ auto put2 = [&p](int v) { memcpy(p, d2 + v*2, 2); p += 2; };
+
+ memcpy(p, ENUMS(Weekday, tms.tm_wday), 3); p += 3;             // e.g.: Wed
+ *p++ = ','; *p++ = ' ';
+ if(tms.tm_mday < 10) *p++ = '0' + tms.tm_mday;                 // e.g.: Wed, 4
+ else put2(tms.tm_mday);
+ *p++ = ' ';
+ memcpy(p, ENUMS(Mon, tms.tm_mon), 3); p += 3;                  // e.g.: Wed, 4 Jul
+ *p++ = ' ';
+
+ int year = tms.tm_year + 1900;                                 // e.g.: Wed, 4 Jul 2018
+ if(year >= 1000 and year <= 9999)
+  { put2(year / 100); put2(year % 100); }
+ else
+  p += snprintf(p, 12, "%d", year);
+ *p++ = ' ';
+
+ put2(tms.tm_hour); *p++ = ':';                                 // e.g.: Wed, 4 Jul 2018 14:21:58
+ put2(tms.tm_min); *p++ = ':';
+ put2(tms.tm_sec); *p++ = ' ';
+
+ long off = l == UTC? 0: tms.tm_gmtoff;                         // e.g.: ... +0200
+ *p++ = off < 0? '-': '+';
+ if(off < 0) off = -off;
+ put2(off / 3600 % 100);
+ put2(off % 3600 / 60);
+
+ *p = '\0';
+ return p - buf;
+}
+
+
+
+
+
+
+
+
+/*
+ * WallClock provides pre-formatted strings of the current (local) time, e.g. for
+ * log time-stamps and Date headers, which otherwise would be re-formatted
+ * (including localtime conversions) with every call.
+ *
+ * Second-granular strings are formatted only once per second (by whichever caller
+ * first notices the second has changed) and published via a seqlock: readers only
+ * copy a snapshot (retrying if it's being updated), no locks are taken and no heap
+ * is used. Sub-second fractions are left up to the caller, e.g.:
+ *
+ *  char stamp[WALLCLOCK_STAMP_LEN];
+ *  long usec = WallClock::stamp(stamp);    // stamp: "2018-Jul-04 14:21:58"
+ *
+ *  char date[RFC5322_DATE_LEN];
+ *  WallClock::rfc5322(date);               // date: "Wed, 4 Jul 2018 14:21:58 +0200"
+ */
+
+#define WALLCLOCK_STAMP_LEN 24                                  // buffer size for stamp()
+
+class WallClock {
+ public:
+    static long         stamp(char *buf);                       // returns current usec
+    static void         rfc5322(char *buf);
+
+ private:
+    struct Snap_ {                                              // snapshot of formatted strings
+        time_t              sec;
+        char                stamp[WALLCLOCK_STAMP_LEN];
+        char                rfc[RFC5322_DATE_LEN];
+    };
+    static constexpr size_t
+                        WORDS_{(sizeof(Snap_) + 7) / 8};        // snapshot in atomic words
+
+    static std::atomic<unsigned>
+                        seq_;                                   // seqlock's sequence (odd: busy)
+    static std::atomic<uint64_t>
+                        snap_[WORDS_];                          // published snapshot
+    static std::atomic<bool>
+                        busy_;                                  // guards publishers
+
+    static void         snapshot_(Snap_ &snap, timeval &tv);
+};
+
+std::atomic<unsigned>   WallClock::seq_{0};
+std::atomic<uint64_t>   WallClock::snap_[WallClock::WORDS_];
+std::atomic<bool>       WallClock::busy_{false};
+
+
+long WallClock::stamp(char *buf) {
+ // write into buf current time-stamp in the format: YYYY-MMM-DD hh:mm:ss
+ Snap_ snap;
+ timeval tv;
+ snapshot_(snap, tv);
+ memcpy(buf, snap.stamp, WALLCLOCK_STAMP_LEN);
+ return tv.tv_usec;
+}
+
+
+void WallClock::rfc5322(char *buf) {
+ // write into buf current date in RFC5322 format
+ Snap_ snap;
+ timeval tv;
+ snapshot_(snap, tv);
+ memcpy(buf, snap.rfc, RFC5322_DATE_LEN);
+}
+
+
+void WallClock::snapshot_(Snap_ &snap, timeval &tv) {
+ // read the published snapshot; if it's stale - format a fresh one and publish it
+ uint64_t w[WORDS_];
+ gettimeofday(&tv, nullptr);
 
- tz = getenv("TZ");
- setenv("TZ", "", 1);
- tzset();
-  ret = mktime(dateTime);
- if (tz) setenv("TZ", tz, 1);
- else unsetenv("TZ");
- tzset();
- return ret;
+ unsigned seq;
+ do {
+  seq = seq_.load(std::memory_order_acquire);
+  for(size_t i = 0; i < WORDS_; ++i)
+   w[i] = snap_[i].load(std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_acquire);
+ } while((seq & 1) or seq_.load(std::memory_order_relaxed) != seq);
+ memcpy(&snap, w, sizeof(snap));
+ if(snap.sec == tv.tv_sec) return;                              // snapshot is current
+
+ tm tms;
+ localtime_r(&tv.tv_sec, &tms);
+ snap.sec = tv.tv_sec;
+ snprintf(snap.stamp, sizeof(snap.stamp), "%d-%s-%02d %02d:%02d:%02d",
+          (tms.tm_year + 1900) % 10000, ENUMS(DateTime::Mon, tms.tm_mon),
+          tms.tm_mday % 100, tms.tm_hour % 100, tms.tm_min % 100, tms.tm_sec % 100);
+ DateTime(tv.tv_sec).rfc5322(snap.rfc, sizeof(snap.rfc));
+
+ if(busy_.exchange(true, std::memory_order_acquire)) return;    // another thread publishes
+ memcpy(w, &snap, sizeof(snap));
+ seq_.fetch_add(1, std::memory_order_relaxed);                  // odd: update in progress
+ std::atomic_thread_fence(std::memory_order_release);
+ for(size_t i = 0; i < WORDS_; ++i)
+  snap_[i].store(w[i], std::memory_order_relaxed);
+ seq_.fetch_add(1, std::memory_order_release);                  // even: published
+ busy_.store(false, std::memory_order_release);
 }
 
 
@@ -0,0 +1,360 @@
+/*
+ * a shared-memory, lock-free multi-producer/single-consumer ring for handing mails
+ * over to the cmail daemon (cmail -S) from local processes (linux only)
+ *
+ * the ring is created by the daemon (consumer) in a memfd, along with an eventfd;
+ * a producer attaches by asking the daemon (over its unix socket) for both file
+ * descriptors, which are passed with SCM_RIGHTS; afterwards the producer posts
+ * mails straight into the shared memory - no syscalls, no copying through the
+ * kernel; the eventfd is written only if the consumer is sleeping
+ *
+ * records are variable-sized: a producer reserves room by advancing the head with
+ * CAS, writes the record in place and commits it by storing the record's sequence
+ * (its absolute position + 1), thus many producers fill the ring concurrently; the
+ * consumer reads committed records in order, right in the shared memory, and
+ * releases the room by advancing the tail; a record that does not fit till the
+ * end of the buffer is preceded by a padding record (i.e. records never wrap)
+ *
+ * a record holds a mail in the daemon's request format (a frame of fields, see
+ * DaemonTransport in "Transport.hpp"): u32 number of fields, then each field as u64
+ * length and bytes; fields: "cmail-1", destination, user, password, retries, due
+ * (epoch seconds, -1: now), envelope sender, recipients..., and the mail text
+ * (rendered: headers, CRLF line breaks); posting is fire-and-forget: failures are
+ * reported by the daemon in its log
+ *
+ * post() does not block: it returns false if the ring is full (or the mail is
+ * bigger than half of the ring); note: a producer dying between reserving and
+ * committing a record stalls the ring
+ *
+ * the consumer does not trust the shared memory: it keeps its own copies of the
+ * capacity and the tail, and checks each record's length; a malformed record stops
+ * the consumption for good (stalled())
+ *
+ *
+ * SYNOPSIS:
+ *  ShmRing ring = ShmRing::attach("/run/cmail.sock");            // daemon's socket (-S)
+ *  ShmRing::Mail m;
+ *  m.dest = "smtp.host.net:587";
+ *  m.from = "<alerts@host.net>";
+ *  m.rcpt = {"oncall@host.net"};
+ *  m.text = "From: <alerts@host.net>\r\nSubject: disk full\r\n\r\n/var is 99% full\r\n";
+ *  if(not ring or not ring.post(m))
+ *   ...                                                        // fall back to something else
+ *
+ */
+
+#pragma once
+
+#ifdef __linux__
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+
+
+
+#define SR_MAGIC 0x676e69726c69616dULL                          // "mailring"
+#define SR_REQUEST "cmail-1"                                    // same as daemon's requests
+#define SR_ATTACH "cmail-ring-1"                                // asks the daemon for the ring
+#define SR_PAGE 4096                                            // ring's header size
+#define SR_ALIGN 16                                             // record alignment
+#define SR_PAD (~0ULL)                                          // padding record's length
+#define SR_CAPACITY (16 << 20)                                  // default ring size
+
+class ShmRing {
+    friend void         swap(ShmRing &l, ShmRing &r) {
+                         using std::swap;                       // enable ADL
+                         swap(l.mfd_, r.mfd_);
+                         swap(l.efd_, r.efd_);
+                         swap(l.map_, r.map_);
+                         swap(l.len_, r.len_);
+                         swap(l.tail_, r.tail_);
+                         swap(l.stalled_, r.stalled_);
+                        }
+ public:
+    struct Mail {
+        std::string         dest;                               // e.g.: "smtp.host.net:587"
+        std::string         user, password;
+        unsigned            retries{3};
+        time_t              due{-1};                            // -1: deliver now
+        std::string         from;                               // envelope sender
+        std::vector<std::string>
+                            rcpt;                               // envelope recipients
+        std::string         text;                               // rendered mail
+    };
+
+                        ShmRing(void) = default;
+                        ShmRing(const ShmRing &) = delete;
+                        ShmRing(ShmRing && other) { swap(*this, other); }
+                       ~ShmRing(void) { close_(); }
+    ShmRing &           operator=(const ShmRing &) = delete;
+    ShmRing &           operator=(ShmRing && other) { swap(*this, other); return *this; }
+
+                        operator bool(void) const { return map_ != nullptr; }
+
+    // producer
+    static ShmRing      attach(const std::string & socket);     // invalid ring if failed
+    bool                post(const Mail & m);                   // false: ring is full
+
+    // consumer
+    static ShmRing      create(size_t capacity = SR_CAPACITY);  // capacity: power of 2
+    static bool         attach_request(const std::vector<std::string> & frame)
+                         { return frame.size() == 1 and frame[0] == SR_ATTACH; }
+    bool                grant(int sock) const;                  // pass fds to attaching producer
+    int                 eventfd(void) const { return efd_; }
+    bool                idle(void);                             // true: ok to sleep on eventfd()
+    template<class F>
+    size_t              drain(F consume);                       // consume(const char *, size_t)
+    bool                stalled(void) const { return stalled_; } // met a malformed record
+
+ private:
+    struct Header_ {                                            // at the start of the memfd
+        uint64_t            magic;
+        uint64_t            capacity;                           // data bytes (power of 2)
+        alignas(64) uint64_t head;                              // reserved up to (producers)
+        alignas(64) uint64_t tail;                              // consumed up to (consumer)
+        alignas(64) uint32_t sleeping;                          // consumer waits on eventfd
+    };
+    struct Record_ {
+        uint64_t            seq;                                // position + 1: committed
+        uint64_t            len;                                // payload bytes, or SR_PAD
+    };
+
+    Header_ *           hdr_(void) const { return static_cast<Header_ *>(map_); }
+    Record_ *           rec_(uint64_t pos) const {
+                         return reinterpret_cast<Record_ *>(static_cast<char *>(map_) +
+                                 SR_PAGE + (pos & (cap_() - 1)));
+                        }
+    uint64_t            cap_(void) const { return len_ - SR_PAGE; } // validated when mapped
+    static uint64_t     size_(uint64_t len)                     // record's size
+                         { return (sizeof(Record_) + len + SR_ALIGN - 1) & ~uint64_t(SR_ALIGN - 1); }
+    bool                map_fd_(void);
+    void                close_(void);
+
+    int                 mfd_{-1};                               // memfd
+    int                 efd_{-1};                               // eventfd
+    void *              map_{nullptr};
+    size_t              len_{0};
+    uint64_t            tail_{0};                               // consumer's own tail
+    bool                stalled_{false};
+};
+
+
+
+ShmRing ShmRing::attach(const std::string & socket) {
+ // connect to the daemon, ask for the ring and map it
+ ShmRing ring;
+ sockaddr_un sa{};
+ sa.sun_family = AF_UNIX;
+ if(socket.size() >= sizeof(sa.sun_path)) return ring;
+ memcpy(sa.sun_path, socket.c_str(), socket.size() + 1);
+ int sock = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+ if(sock < 0) return ring;
+ if(::connect(sock, reinterpret_cast<sockaddr *>(&sa), sizeof(sa)) != 0)
+  { ::close(sock); return ring; }
+
+ std::string rq;                                                // a frame of one field
+ uint32_t n = 1;
+ uint64_t len = strlen(SR_ATTACH);
+ rq.append(reinterpret_cast<const char *>(&n), sizeof(n))
+   .append(reinterpret_cast<const char *>(&len), sizeof(len)).append(SR_ATTACH);
+
+ char byte, ctl[CMSG_SPACE(2 * sizeof(int))];
+ iovec iov{&byte, 1};
+ msghdr mh{};
+ mh.msg_iov = &iov;
+ mh.msg_iovlen = 1;
+ mh.msg_control = ctl;
+ mh.msg_controllen = sizeof(ctl);
+ bool ok = ::send(sock, rq.data(), rq.size(), MSG_NOSIGNAL) == static_cast<ssize_t>(rq.size()) and
+           recvmsg(sock, &mh, MSG_CMSG_CLOEXEC) == 1;
+ ::close(sock);
+ cmsghdr *cm = ok? CMSG_FIRSTHDR(&mh): nullptr;
+ if(cm == nullptr or cm->cmsg_type != SCM_RIGHTS or cm->cmsg_len != CMSG_LEN(2 * sizeof(int)))
+  return ring;
+
+ int fds[2];
+ memcpy(fds, CMSG_DATA(cm), sizeof(fds));
+ ring.mfd_ = fds[0];
+ ring.efd_ = fds[1];
+ if(not ring.map_fd_()) ring.close_();
+ return ring;
+}
+
+
+bool ShmRing::post(const Mail & m) {
+ // serialize the mail right into the ring: reserve room, write, commit, wake up
+ // the consumer if it sleeps
+ std::vector<std::pair<const char *, size_t>> f;
+ std::string retries = std::to_string(m.retries), due = std::to_string(m.due);
+ for(auto s: {SR_REQUEST, m.dest.c_str(), m.user.c_str(), m.password.c_str(),
+              retries.c_str(), due.c_str(), m.from.c_str()})
+  f.emplace_back(s, strlen(s));
+ for(auto &r: m.rcpt) f.emplace_back(r.data(), r.size());
+ f.emplace_back(m.text.data(), m.text.size());
+ uint64_t len = sizeof(uint32_t);
+ for(auto &fld: f) len += sizeof(uint64_t) + fld.second;
+
+ if(map_ == nullptr) return false;
+ Header_ *h = hdr_();
+ uint64_t need = size_(len), cap = cap_();
+ if(need > cap / 2) return false;
+ uint64_t head = __atomic_load_n(&h->head, __ATOMIC_ACQUIRE), pad;
+ do {
+  pad = cap - (head & (cap - 1));
+  if(pad >= need) pad = 0;                                      // fits till the buffer's end
+  if(head + pad + need - __atomic_load_n(&h->tail, __ATOMIC_ACQUIRE) > cap)
+   return false;                                                // full
+ } while(not __atomic_compare_exchange_n(&h->head, &head, head + pad + need, true,
+                                         __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+ if(pad > 0) {
+  rec_(head)->len = SR_PAD;
+  __atomic_store_n(&rec_(head)->seq, head + 1, __ATOMIC_RELEASE);
+  head += pad;
+ }
+
+ Record_ *r = rec_(head);
+ r->len = len;
+ char *p = reinterpret_cast<char *>(r + 1);
+ uint32_t n = f.size();
+ memcpy(p, &n, sizeof(n));
+ p += sizeof(n);
+ for(auto &fld: f) {
+  uint64_t l = fld.second;
+  memcpy(p, &l, sizeof(l));
+  memcpy(p + sizeof(l), fld.first, l);
+  p += sizeof(l) + l;
+ }
+ __atomic_store_n(&r->seq, head + 1, __ATOMIC_RELEASE);         // commit
+
+ __atomic_thread_fence(__ATOMIC_SEQ_CST);                       // pairs with idle()
+ if(__atomic_load_n(&h->sleeping, __ATOMIC_RELAXED) != 0 and
+    __atomic_exchange_n(&h->sleeping, 0, __ATOMIC_ACQ_REL) != 0) {
+  uint64_t one = 1;
+  if(::write(efd_, &one, sizeof(one)) < 0) {}                   // counter is saturated: awake
+ }
+ return true;
+}
+
+
+ShmRing ShmRing::create(size_t capacity) {
+ // make the ring (memfd) and the eventfd; invalid ring if failed
+ ShmRing ring;
+ if(capacity < SR_PAGE or (capacity & (capacity - 1)) != 0) return ring;
+ ring.mfd_ = memfd_create("cmail-ring", MFD_CLOEXEC);
+ ring.efd_ = ::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+ if(ring.mfd_ < 0 or ring.efd_ < 0 or ftruncate(ring.mfd_, SR_PAGE + capacity) != 0 or
+    not ring.map_fd_())
+  { ring.close_(); return ring; }
+ Header_ *h = ring.hdr_();                                      // memfd is zero-filled
+ h->capacity = capacity;
+ __atomic_store_n(&h->magic, SR_MAGIC, __ATOMIC_RELEASE);
+ return ring;
+}
+
+
+bool ShmRing::grant(int sock) const {
+ // pass the memfd and the eventfd to the producer connected on sock
+ char byte = 0, ctl[CMSG_SPACE(2 * sizeof(int))] = {};
+ iovec iov{&byte, 1};
+ msghdr mh{};
+ mh.msg_iov = &iov;
+ mh.msg_iovlen = 1;
+ mh.msg_control = ctl;
+ mh.msg_controllen = sizeof(ctl);
+ cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+ cm->cmsg_level = SOL_SOCKET;
+ cm->cmsg_type = SCM_RIGHTS;
+ cm->cmsg_len = CMSG_LEN(2 * sizeof(int));
+ int fds[2]{mfd_, efd_};
+ memcpy(CMSG_DATA(cm), fds, sizeof(fds));
+ return map_ != nullptr and sendmsg(sock, &mh, MSG_NOSIGNAL) == 1;
+}
+
+
+bool ShmRing::idle(void) {
+ // announce the consumer is about to sleep on eventfd(); false: a record is
+ // already there (drain it rather than sleep)
+ Header_ *h = hdr_();
+ uint64_t counter;
+ while(::read(efd_, &counter, sizeof(counter)) > 0);            // reset the eventfd
+ __atomic_store_n(&h->sleeping, 1, __ATOMIC_RELAXED);
+ __atomic_thread_fence(__ATOMIC_SEQ_CST);                       // pairs with post()
+ if(stalled_ or
+    __atomic_load_n(&rec_(tail_)->seq, __ATOMIC_ACQUIRE) != tail_ + 1) return true;
+ __atomic_store_n(&h->sleeping, 0, __ATOMIC_RELAXED);
+ return false;
+}
+
+
+template<class F>
+size_t ShmRing::drain(F consume) {
+ // consume all committed records in order (in place), return number of records;
+ // the room is released once consume() returns; a record whose length does not fit
+ // the buffer stalls the ring (nothing is consumed after it)
+ Header_ *h = hdr_();
+ __atomic_store_n(&h->sleeping, 0, __ATOMIC_RELAXED);
+ size_t n = 0;
+ while(not stalled_) {
+  Record_ *r = rec_(tail_);
+  if(__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) != tail_ + 1) break; // not committed yet
+  uint64_t len = __atomic_load_n(&r->len, __ATOMIC_RELAXED);    // read once: producers write there
+  uint64_t room = cap_() - (tail_ & (cap_() - 1)), size = room;  // till the buffer's end
+  if(len != SR_PAD) {
+   if(len > room - sizeof(Record_)) { stalled_ = true; break; }
+   size = size_(len);
+   consume(reinterpret_cast<const char *>(r + 1), static_cast<size_t>(len));
+   ++n;
+  }
+  memset(r, 0, size);                                           // no stale seq is left behind
+  tail_ += size;
+  __atomic_store_n(&h->tail, tail_, __ATOMIC_RELEASE);          // room is reusable now
+ }
+ return n;
+}
+
+
+bool ShmRing::map_fd_(void) {
+ struct stat st;
+ if(fstat(mfd_, &st) != 0 or st.st_size < SR_PAGE) return false;
+ void *p = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, mfd_, 0);
+ if(p == MAP_FAILED) return false;
+ map_ = p;
+ len_ = st.st_size;
+ Header_ *h = hdr_();
+ if(h->magic != 0 and                                           // attached: validate
+    (h->magic != SR_MAGIC or h->capacity + SR_PAGE != len_ or
+     (h->capacity & (h->capacity - 1)) != 0)) return false;
+ return true;
+}
+
+
+void ShmRing::close_(void) {
+ if(map_ != nullptr) munmap(map_, len_);
+ if(mfd_ >= 0) ::close(mfd_);
+ if(efd_ >= 0) ::close(efd_);
+ map_ = nullptr;
+ mfd_ = efd_ = -1;
+}
+
+
+#undef SR_MAGIC
+#undef SR_REQUEST
+#undef SR_ATTACH
+#undef SR_PAGE
+#undef SR_ALIGN
+#undef SR_PAD
+#undef SR_CAPACITY
+
+#endif
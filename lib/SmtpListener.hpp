@@ -0,0 +1,419 @@
+/*
+ * a lightweight smtp server (RFC5321) accepting mails from local clients: an epoll
+ * based, single threaded, non-blocking loop serving any number of connections;
+ * PIPELINING (RFC2920) is offered: all commands received at once are processed in
+ * one go and their replies are sent in a single write (linux only)
+ *
+ * the server does not deliver mails itself: each received mail (the envelope and
+ * the text with CRLF line breaks, dot-unstuffed, with prepended 'Received:' trace
+ * header) is handed to the handler, which takes it over (e.g. queues it for relaying)
+ * and returns true, or declines it (returns false) - then the client is replied a
+ * transient failure (451) and is supposed to retry later
+ *
+ * no authentication and no STARTTLS is offered - the listener is meant to be bound
+ * to a loopback address
+ *
+ *
+ * SYNOPSIS:
+ *  SmtpListener srv;
+ *  if(not srv.listen("127.0.0.1:2525"))
+ *   { std::cerr << "listen failed: " << strerror(errno) << std::endl; ... }
+ *  for(;;)
+ *   srv.poll(1000, [](SmtpListener::Mail && m) {
+ *                   std::cout << "mail from " << m.from << ", " << m.text.size() << " bytes";
+ *                   return true;                               // taken over
+ *                  });
+ *
+ */
+
+#pragma once
+
+#ifdef __linux__
+
+#include <string>
+#include <vector>
+#include <map>
+#include <functional>
+#include <string.h>
+#include <strings.h>            // strncasecmp
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "dbg.hpp"
+
+
+
+#define LS_EOL "\r\n"
+#define LS_BUF (64 * 1024)                                      // read chunk
+#define LS_MAX_LINE 1000                                        // command line (rfc5321)
+#define LS_MAX_RCPT 1000                                        // recipients per mail
+#define LS_MAX_SIZE (64 << 20)                                  // mail size limit (SIZE)
+#define LS_TIMEOUT 300                                          // idle client (sec)
+#define LS_EVENTS 64                                            // events per epoll_wait
+
+class SmtpListener {
+ public:
+    struct Mail {
+        std::string         from;                               // "<user@host>", or "<>"
+        std::vector<std::string>
+                            rcpt;                               // bare addresses
+        std::string         text;                               // CRLF line breaks
+    };
+    typedef std::function<bool(Mail &&)>
+                        Handler;                                // false: declined
+
+                        SmtpListener(void);
+                        SmtpListener(const SmtpListener &) = delete;
+                       ~SmtpListener(void);
+    SmtpListener &      operator=(const SmtpListener &) = delete;
+
+    bool                listen(const std::string & addr);       // "host:port", false: see errno
+    int                 poll(int timeout, const Handler & handler); // -1: failed (see errno)
+    size_t              clients(void) const { return clients_.size(); }
+    size_t              received(void) const { return received_; }
+
+    DEBUGGABLE()
+
+ private:
+    struct Client_ {
+        int                 fd;
+        std::string         peer;                               // ip address
+        std::string         helo;
+        bool                esmtp{false};                       // greeted with EHLO
+        std::string         in;                                 // received, not parsed yet
+        std::string         out;                                // replies to be sent
+        Mail                mail;
+        bool                data{false};                        // receiving mail text
+        bool                oversized{false};
+        bool                quit{false};                        // close once replied
+        time_t              active;
+    };
+
+    void                accept_(void);
+    void                read_(Client_ & c, const Handler & handler);
+    void                parse_(Client_ & c, const Handler & handler);
+    void                command_(Client_ & c, const char *b, const char *e);
+    void                text_(Client_ & c, const char *b, const char *e, const Handler & handler);
+    void                flush_(Client_ & c);
+    void                close_(int fd);
+    void                reset_(Client_ & c)
+                         { c.mail = Mail(); c.oversized = false; }
+    static std::string  address_(const char *b, const char *e); // from "<addr> [params]"
+    std::string         received_header_(const Client_ & c) const;
+
+    int                 lfd_{-1};                               // listening socket
+    int                 efd_{-1};                               // epoll
+    std::string         host_;
+    std::map<int, Client_>
+                        clients_;
+    size_t              received_{0};
+    time_t              swept_{0};                              // last idle clients' sweep
+};
+
+
+
+SmtpListener::SmtpListener(void) {
+ char host[256] = "localhost";
+ gethostname(host, sizeof(host) - 1);
+ host_ = host;
+}
+
+
+SmtpListener::~SmtpListener(void) {
+ while(not clients_.empty()) close_(clients_.begin()->first);
+ if(lfd_ >= 0) ::close(lfd_);
+ if(efd_ >= 0) ::close(efd_);
+}
+
+
+bool SmtpListener::listen(const std::string & addr) {
+ // bind to "host:port" (host could be an IPv6 address in brackets); false: failed
+ auto colon = addr.rfind(':');
+ if(colon == std::string::npos) { errno = EINVAL; return false; }
+ std::string host = addr.substr(0, colon), port = addr.substr(colon + 1);
+ if(host.size() >= 2 and host.front() == '[' and host.back() == ']')
+  host = host.substr(1, host.size() - 2);
+
+ addrinfo hints{}, *ai;
+ hints.ai_family = AF_UNSPEC;
+ hints.ai_socktype = SOCK_STREAM;
+ hints.ai_flags = AI_PASSIVE;
+ if(getaddrinfo(host.empty()? nullptr: host.c_str(), port.c_str(), &hints, &ai) != 0)
+  { errno = EINVAL; return false; }
+ lfd_ = socket(ai->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+ int on = 1;
+ bool ok = lfd_ >= 0 and setsockopt(lfd_, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == 0 and
+           ::bind(lfd_, ai->ai_addr, ai->ai_addrlen) == 0 and ::listen(lfd_, SOMAXCONN) == 0;
+ freeaddrinfo(ai);
+ if(ok) efd_ = epoll_create1(EPOLL_CLOEXEC);
+ epoll_event ev{};
+ ev.events = EPOLLIN;
+ ev.data.fd = lfd_;
+ if(not ok or efd_ < 0 or epoll_ctl(efd_, EPOLL_CTL_ADD, lfd_, &ev) != 0) {
+  int err = errno;
+  if(lfd_ >= 0) ::close(lfd_);
+  if(efd_ >= 0) ::close(efd_);
+  lfd_ = efd_ = -1;
+  errno = err;
+  return false;
+ }
+ DBG(0) DOUT() << "listening on " << addr << std::endl;
+ return true;
+}
+
+
+int SmtpListener::poll(int timeout, const Handler & handler) {
+ // wait up to timeout (ms, -1: indefinitely) for events and process them, return
+ // number of processed events; received mails are passed to handler; clients idle
+ // for longer than LS_TIMEOUT are disconnected
+ epoll_event ev[LS_EVENTS];
+ int n = epoll_wait(efd_, ev, LS_EVENTS, timeout);
+ if(n < 0) return -1;
+
+ for(int i = 0; i < n; ++i) {
+  int fd = ev[i].data.fd;
+  if(fd == lfd_) { accept_(); continue; }
+  auto it = clients_.find(fd);
+  if(it == clients_.end()) continue;
+  Client_ &c = it->second;
+  c.active = time(nullptr);
+  if(ev[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) read_(c, handler);
+  else flush_(c);                                               // EPOLLOUT: send the rest
+ }
+
+ time_t now = time(nullptr);
+ if(now != swept_) {
+  swept_ = now;
+  std::vector<int> idle;
+  for(auto &c: clients_)
+   if(now - c.second.active > LS_TIMEOUT) idle.push_back(c.first);
+  for(auto fd: idle) {
+   DBG(0) DOUT() << "client " << clients_[fd].peer << " timed out" << std::endl;
+   close_(fd);
+  }
+ }
+ return n;
+}
+
+
+void SmtpListener::accept_(void) {
+ // accept all pending connections, greet clients
+ for(;;) {
+  sockaddr_storage sa;
+  socklen_t len = sizeof(sa);
+  int fd = accept4(lfd_, reinterpret_cast<sockaddr *>(&sa), &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+  if(fd < 0) return;
+  epoll_event ev{};
+  ev.events = EPOLLIN;
+  ev.data.fd = fd;
+  if(epoll_ctl(efd_, EPOLL_CTL_ADD, fd, &ev) != 0) { ::close(fd); continue; }
+
+  Client_ &c = clients_[fd];
+  c.fd = fd;
+  c.active = time(nullptr);
+  char ip[INET6_ADDRSTRLEN] = "unknown";
+  if(sa.ss_family == AF_INET)
+   inet_ntop(AF_INET, &reinterpret_cast<sockaddr_in &>(sa).sin_addr, ip, sizeof(ip));
+  else if(sa.ss_family == AF_INET6)
+   inet_ntop(AF_INET6, &reinterpret_cast<sockaddr_in6 &>(sa).sin6_addr, ip, sizeof(ip));
+  c.peer = ip;
+  DBG(1) DOUT() << "client " << c.peer << " connected, clients: " << clients_.size() << std::endl;
+  c.out = "220 " + host_ + " ESMTP cmail" LS_EOL;
+  flush_(c);
+ }
+}
+
+
+void SmtpListener::read_(Client_ & c, const Handler & handler) {
+ // read available input chunk by chunk, process complete lines after each chunk
+ // (thus buffered input stays bounded); once the client has closed (or half-closed)
+ // the connection, what it has sent is still processed and replied
+ char buf[LS_BUF];
+ bool eof = false;
+ while(not c.quit and not eof) {
+  ssize_t n = ::read(c.fd, buf, sizeof(buf));
+  if(n < 0 and errno == EINTR) continue;
+  if(n < 0 and (errno == EAGAIN or errno == EWOULDBLOCK)) break;
+  if(n <= 0) eof = true;                                        // disconnected
+  else c.in.append(buf, n);
+  parse_(c, handler);
+ }
+ if(eof) c.quit = true;                                         // close once replied
+ flush_(c);
+}
+
+
+void SmtpListener::parse_(Client_ & c, const Handler & handler) {
+ // process all complete lines (commands, or mail text) of the buffered input
+ const char *b = c.in.data(), *end = b + c.in.size();
+ while(not c.quit) {
+  const char *e = static_cast<const char *>(memchr(b, '\n', end - b));
+  if(e == nullptr) break;
+  const char *le = e > b and e[-1] == '\r'? e - 1: e;           // bare LF is tolerated
+  if(c.data) text_(c, b, le, handler);
+  else command_(c, b, le);
+  b = e + 1;
+ }
+ c.in.erase(0, b - c.in.data());
+
+ if(not c.data) {
+  if(c.in.size() > LS_MAX_LINE)
+   { c.out += "500 5.5.2 line too long" LS_EOL; c.quit = true; }
+  return;
+ }
+ if(c.in.size() > LS_MAX_LINE and                               // a runaway line of text
+    (c.oversized or c.mail.text.size() + c.in.size() > LS_MAX_SIZE)) {
+  c.oversized = true;
+  c.mail.text.clear();
+  c.mail.text.shrink_to_fit();
+  c.in.clear();                                                 // the line's end is still to come
+ }
+}
+
+
+void SmtpListener::command_(Client_ & c, const char *b, const char *e) {
+ // process a command line, queue the reply
+ DBG(2) DOUT() << c.peer << " > " << std::string(b, e) << std::endl;
+ auto is = [b, e](const char *cmd) {
+            size_t len = strlen(cmd);
+            return static_cast<size_t>(e - b) >= len and strncasecmp(b, cmd, len) == 0 and
+                   (static_cast<size_t>(e - b) == len or cmd[len - 1] == ':' or b[len] == ' ');
+           };
+
+ if(is("EHLO") or is("HELO")) {
+  reset_(c);
+  c.helo.assign(b + std::min<size_t>(5, e - b), e);
+  c.esmtp = toupper(*b) == 'E';
+  c.out += "250";
+  if(c.esmtp)
+   c.out += "-" + host_ + LS_EOL "250-PIPELINING" LS_EOL "250-8BITMIME" LS_EOL
+            "250-SIZE " + std::to_string(LS_MAX_SIZE) + LS_EOL "250 ENHANCEDSTATUSCODES";
+  else c.out += " " + host_;
+  c.out += LS_EOL;
+ }
+ else if(is("MAIL FROM:")) {
+  if(not c.mail.from.empty())
+   { c.out += "503 5.5.1 nested MAIL command" LS_EOL; return; }
+  c.mail.from = "<" + address_(b + 10, e) + ">";
+  c.out += "250 2.1.0 ok" LS_EOL;
+ }
+ else if(is("RCPT TO:")) {
+  std::string rcpt = address_(b + 8, e);
+  if(c.mail.from.empty()) c.out += "503 5.5.1 need MAIL command" LS_EOL;
+  else if(rcpt.empty()) c.out += "501 5.1.3 bad recipient address syntax" LS_EOL;
+  else if(c.mail.rcpt.size() >= LS_MAX_RCPT) c.out += "452 4.5.3 too many recipients" LS_EOL;
+  else { c.mail.rcpt.push_back(rcpt); c.out += "250 2.1.5 ok" LS_EOL; }
+ }
+ else if(is("DATA")) {
+  if(c.mail.from.empty()) c.out += "503 5.5.1 need MAIL command" LS_EOL;
+  else if(c.mail.rcpt.empty()) c.out += "554 5.5.1 no valid recipients" LS_EOL;
+  else {
+   c.data = true;
+   c.mail.text = received_header_(c);
+   c.out += "354 end data with <CR><LF>.<CR><LF>" LS_EOL;
+  }
+ }
+ else if(is("RSET")) { reset_(c); c.out += "250 2.0.0 ok" LS_EOL; }
+ else if(is("NOOP")) c.out += "250 2.0.0 ok" LS_EOL;
+ else if(is("VRFY")) c.out += "252 2.5.0 cannot verify, but will accept" LS_EOL;
+ else if(is("QUIT")) { c.out += "221 2.0.0 bye" LS_EOL; c.quit = true; }
+ else c.out += "500 5.5.2 command unrecognized" LS_EOL;
+}
+
+
+void SmtpListener::text_(Client_ & c, const char *b, const char *e, const Handler & handler) {
+ // process a line of the mail text: undo dot-stuffing, the end of text hands the mail
+ // over to the handler
+ if(e - b == 1 and *b == '.') {                                 // end of text
+  c.data = false;
+  if(c.oversized) c.out += "552 5.3.4 message size exceeds fixed limit" LS_EOL;
+  else {
+   size_t size = c.mail.text.size();
+   if(handler(std::move(c.mail))) {
+    ++received_;
+    c.out += "250 2.0.0 ok: queued" LS_EOL;
+    DBG(1) DOUT() << "mail from " << c.peer << " taken over, " << size << " bytes" << std::endl;
+   }
+   else c.out += "451 4.3.0 mail is not accepted now, try again later" LS_EOL;
+  }
+  reset_(c);
+  return;
+ }
+ if(c.oversized) return;
+ if(b < e and *b == '.') ++b;                                   // dot-stuffed
+ if(c.mail.text.size() + (e - b) + 2 > LS_MAX_SIZE)
+  { c.oversized = true; c.mail.text.clear(); c.mail.text.shrink_to_fit(); return; }
+ c.mail.text.append(b, e).append(LS_EOL);
+}
+
+
+void SmtpListener::flush_(Client_ & c) {
+ // send queued replies; what the socket does not take now is sent once it's
+ // writable (EPOLLOUT); a quitting client is disconnected once all is sent
+ size_t sent = 0;
+ while(sent < c.out.size()) {
+  ssize_t n = ::send(c.fd, c.out.data() + sent, c.out.size() - sent, MSG_NOSIGNAL);
+  if(n < 0 and errno == EINTR) continue;
+  if(n < 0 and (errno == EAGAIN or errno == EWOULDBLOCK)) break;
+  if(n <= 0) { close_(c.fd); return; }
+  sent += n;
+ }
+ c.out.erase(0, sent);
+ if(c.out.empty() and c.quit) { close_(c.fd); return; }
+ epoll_event ev{};
+ ev.events = c.out.empty()? EPOLLIN: EPOLLOUT;                  // no more reading till replied
+ ev.data.fd = c.fd;
+ epoll_ctl(efd_, EPOLL_CTL_MOD, c.fd, &ev);
+}
+
+
+void SmtpListener::close_(int fd) {
+ epoll_ctl(efd_, EPOLL_CTL_DEL, fd, nullptr);
+ ::close(fd);
+ clients_.erase(fd);
+ DBG(1) DOUT() << "client disconnected, clients: " << clients_.size() << std::endl;
+}
+
+
+std::string SmtpListener::address_(const char *b, const char *e) {
+ // extract address from "<addr> [params]", or "addr [params]"
+ while(b < e and *b == ' ') ++b;
+ const char *ae = b;
+ if(b < e and *b == '<') {
+  ++b;
+  ae = static_cast<const char *>(memchr(b, '>', e - b));
+  if(ae == nullptr) ae = e;
+ }
+ else
+  while(ae < e and *ae != ' ') ++ae;
+ return std::string(b, ae);
+}
+
+
+std::string SmtpListener::received_header_(const Client_ & c) const {
+ // trace header prepended to every received mail (rfc5321, 4.4)
+ char date[64];
+ time_t now = time(nullptr);
+ tm lt;
+ strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S %z", localtime_r(&now, &lt));
+ return "Received: from " + (c.helo.empty()? std::string("unknown"): c.helo) +
+        " ([" + c.peer + "])" LS_EOL "\tby " + host_ + " (cmail) with " +
+        (c.esmtp? "ESMTP": "SMTP") + "; " + date + LS_EOL;
+}
+
+
+#undef LS_EOL
+#undef LS_BUF
+#undef LS_MAX_LINE
+#undef LS_MAX_RCPT
+#undef LS_MAX_SIZE
+#undef LS_TIMEOUT
+#undef LS_EVENTS
+
+#endif
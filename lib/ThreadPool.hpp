@@ -0,0 +1,114 @@
+/*
+ * a trivial fixed-size thread pool: tasks (callables returning a value) are queued
+ * and picked up by worker threads in FIFO order; submit() returns a future of the
+ * task's result
+ *
+ * a pool of size 0 has no workers: submitted tasks are run in place (by the caller)
+ *
+ * the pool is resizable (resize() waits for the queued tasks to complete first);
+ * global() is a process wide pool sized by the number of cores (created at the
+ * first use)
+ *
+ *
+ * SYNOPSIS:
+ *  auto f = ThreadPool::global().submit([]{ return heavy_computation(); });
+ *  ...
+ *  std::cout << f.get() << std::endl;
+ *
+ */
+
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <functional>
+#include <memory>
+#include <type_traits>
+
+
+
+class ThreadPool {
+ public:
+                        ThreadPool(size_t n = 0) { resize(n); }
+                        ThreadPool(const ThreadPool &) = delete;
+                       ~ThreadPool(void) { resize(0); }
+    ThreadPool &        operator=(const ThreadPool &) = delete;
+
+    static ThreadPool & global(void)
+                         { static ThreadPool tp(std::thread::hardware_concurrency()); return tp; }
+
+    ThreadPool &        resize(size_t n);
+    size_t              size(void) const { return workers_.size(); }
+
+    template<class F>
+    std::future<typename std::result_of<F()>::type>
+                        submit(F && task);
+
+ private:
+    void                work_(void);
+
+    std::vector<std::thread>
+                        workers_;
+    std::deque<std::function<void(void)>>
+                        queue_;
+    std::mutex          mtx_;
+    std::condition_variable
+                        cv_;
+    bool                stop_{false};
+};
+
+
+
+ThreadPool & ThreadPool::resize(size_t n) {
+ // stop workers (once the queue is drained) and start n new ones
+ {
+  std::lock_guard<std::mutex> lck(mtx_);
+  stop_ = true;
+ }
+ cv_.notify_all();
+ for(auto &w: workers_) w.join();
+ workers_.clear();
+
+ stop_ = false;
+ for(size_t i = 0; i < n; ++i)
+  workers_.emplace_back(&ThreadPool::work_, this);
+ return *this;
+}
+
+
+template<class F>
+std::future<typename std::result_of<F()>::type> ThreadPool::submit(F && task) {
+ // queue the task, return its future; run it in place if the pool has no workers
+ typedef typename std::result_of<F()>::type R;
+ auto pt = std::make_shared<std::packaged_task<R(void)>>(std::forward<F>(task));
+ auto f = pt->get_future();
+ if(workers_.empty())
+  { (*pt)(); return f; }
+
+ {
+  std::lock_guard<std::mutex> lck(mtx_);
+  queue_.emplace_back([pt]{ (*pt)(); });
+ }
+ cv_.notify_one();
+ return f;
+}
+
+
+void ThreadPool::work_(void) {
+ // worker's loop: run queued tasks, exit when stopped and the queue is empty
+ while(true) {
+  std::function<void(void)> task;
+  {
+   std::unique_lock<std::mutex> lck(mtx_);
+   cv_.wait(lck, [this]{ return stop_ or not queue_.empty(); });
+   if(queue_.empty()) return;                                   // i.e. stopped
+   task = std::move(queue_.front());
+   queue_.pop_front();
+  }
+  task();
+ }
+}
@@ -0,0 +1,159 @@
+/*
+ * an adaptive rate limiter for a mail relay (smtp server): paces sends with a token
+ * bucket and adapts to the relay's throttling with AIMD (additive increase,
+ * multiplicative decrease)
+ *
+ * sends are not paced until the relay signals throttling for the first time (a
+ * transient failure, e.g.: 421, 451): the rate then drops to a half of the rate
+ * the relay actually sustained (sends per second since the first one); from there
+ * the rate grows additively (by 1/s per each second of successful sending) and is
+ * halved on each throttling signal; the rate at which throttling occurred is
+ * remembered as a ceiling: the rate quickly recovers to 90% of the ceiling and then
+ * grows 50 times slower, thus the throughput settles just under the relay's limit
+ * rather than repeatedly bouncing into it; paced sends are evenly spaced (no bursts)
+ *
+ * transient failures are to be retried: backoff() returns a jittered exponential
+ * delay for the given attempt (the jitter de-synchronizes retries of concurrent
+ * senders); permanent failures (5xx) are not a throttling signal and do not affect
+ * the rate
+ *
+ * all methods are thread-safe
+ *
+ *
+ * SYNOPSIS:
+ *  Throttle thr;                                       // not paced until throttled
+ *
+ *  for(unsigned attempt = 0;; ++attempt) {
+ *   std::this_thread::sleep_for(std::chrono::duration<double>(thr.acquire()));
+ *   auto outcome = send_something();                   // Throttle::success, transient, ...
+ *   thr.feedback(outcome);
+ *   if(outcome != Throttle::transient or attempt == max_retries) break;
+ *   std::this_thread::sleep_for(std::chrono::duration<double>(thr.backoff(attempt)));
+ *  }
+ *
+ */
+
+#pragma once
+
+#include <mutex>
+#include <random>
+#include <chrono>
+#include <algorithm>
+#include "extensions.hpp"
+
+
+
+#define TH_MIN_RATE 0.05                                        // i.e. one send per 20 seconds
+#define TH_MAX_RATE 1000.0
+#define TH_MD 0.5                                               // multiplicative decrease
+#define TH_PROBE 0.02                                           // increase scale near ceiling
+#define TH_HEADROOM 0.9                                         // fraction of ceiling to aim at
+#define TH_BURST 1.0                                            // bucket size: sends are spaced
+#define TH_BACKOFF_BASE 1.0                                     // seconds
+#define TH_BACKOFF_CAP 300.0                                    // seconds
+
+class Throttle {
+ public:
+    #define OUTCOME \
+                success, \
+                transient, \
+                permanent
+    ENUMSTR(Outcome, OUTCOME)
+
+                        Throttle(double rate = TH_MAX_RATE): rate_(rate) {}
+
+    double              acquire(double now = clock());          // take token, return wait time
+    void                feedback(Outcome o, double now = clock());
+    double              backoff(unsigned attempt);              // retry delay (seconds)
+
+    double              rate(void) const
+                         { std::lock_guard<std::mutex> lck(mtx_); return rate_; }
+    double              ceiling(void) const
+                         { std::lock_guard<std::mutex> lck(mtx_); return ceiling_; }
+
+    static double       clock(void) {                           // monotonic seconds
+                         return std::chrono::duration<double>
+                                 (std::chrono::steady_clock::now().time_since_epoch()).count();
+                        }
+
+ private:
+    void                refill_(double now) {
+                         if(last_ > 0)
+                          tokens_ = std::min(tokens_ + (now - last_) * rate_, TH_BURST);
+                         last_ = now;
+                        }
+
+    mutable std::mutex  mtx_;
+    double              rate_;                                  // sends per second
+    double              ceiling_{TH_MAX_RATE};                  // rate where throttling occurred
+    double              tokens_{TH_BURST};                      // could go negative (reserved)
+    double              last_{0};                               // last refill time
+    double              decreased_{0};                          // last decrease time
+    double              first_{0};                              // time of the first send
+    size_t              sent_{0};                               // sends until first throttled
+    std::mt19937_64     rnd_{std::random_device{}()};
+};
+
+STRINGIFY(Throttle::Outcome, OUTCOME)
+#undef OUTCOME
+
+
+
+double Throttle::acquire(double now) {
+ // take a token from the bucket: return 0 if one is available, otherwise the time
+ // to wait until it becomes available (the token is reserved, thus consecutive
+ // callers are spaced out by 1/rate)
+ std::lock_guard<std::mutex> lck(mtx_);
+ refill_(now);
+ tokens_ -= 1;
+ return tokens_ >= 0? 0: -tokens_ / rate_;
+}
+
+
+void Throttle::feedback(Outcome o, double now) {
+ // account the outcome of a send: adapt the rate
+ std::lock_guard<std::mutex> lck(mtx_);
+ if(decreased_ == 0) {                                          // not throttled yet
+  if(first_ == 0) first_ = now;
+  if(o != transient) { ++sent_; return; }                       // i.e. not paced
+ }
+
+ if(o == success) {                                             // additive increase
+  double scale = rate_ < ceiling_ * TH_HEADROOM? 1: TH_PROBE;
+  rate_ = std::min(rate_ + scale / rate_, TH_MAX_RATE);         // i.e. +1/s each second
+  return;
+ }
+ if(o != transient) return;                                     // permanent: not throttling
+
+ // multiplicative decrease: only once per second, sends in flight (started at the
+ // old rate) likely fail as well and should not decrease it again
+ if(now - decreased_ < 1) return;
+ if(decreased_ == 0)                                            // first throttling: start
+  rate_ = std::max(sent_ / std::max(now - first_, 1.), 1.);     // from the sustained rate
+ decreased_ = now;
+ refill_(now);
+ ceiling_ = rate_;
+ rate_ = std::max(rate_ * TH_MD, TH_MIN_RATE);
+ tokens_ = std::min(tokens_, 0.);                               // no bursts right after
+}
+
+
+double Throttle::backoff(unsigned attempt) {
+ // return exponential delay for given retry attempt with "equal jitter": half of
+ // the delay is fixed and the other half is random; delay is never shorter than
+ // the current pacing interval
+ std::lock_guard<std::mutex> lck(mtx_);
+ double delay = std::min(TH_BACKOFF_BASE * (1ULL << std::min(attempt, 30u)), TH_BACKOFF_CAP);
+ delay = delay / 2 + std::uniform_real_distribution<double>(0, delay / 2)(rnd_);
+ return std::max(delay, 1 / rate_);
+}
+
+
+#undef TH_MIN_RATE
+#undef TH_MAX_RATE
+#undef TH_MD
+#undef TH_PROBE
+#undef TH_HEADROOM
+#undef TH_BURST
+#undef TH_BACKOFF_BASE
+#undef TH_BACKOFF_CAP
@@ -0,0 +1,296 @@
+/*
+ * a hierarchical timer wheel: holds items (of type T) due at given epoch seconds
+ *
+ * the wheel has 4 levels of 256 slots each, with a resolution of 1 second:
+ * level 0 slots hold items due within current 256 seconds block, level 1 slots -
+ * items due within current 65536 seconds block, etc; when time advances past a
+ * block's boundary, the next higher level slot is cascaded down (items get re-
+ * distributed into lower levels). Thus:
+ *  - insert() and cancel() are O(1)
+ *  - advance() is O(1) per second passed (plus O(1) per fired or cascaded item)
+ *
+ * items are kept in a pool of nodes (linked by indices), nodes of fired/cancelled
+ * items are reused, so the memory is bounded by the peak number of pending items;
+ * optionally the pool could be capped (see capacity()), then insert() throws once
+ * the cap is reached
+ *
+ * insert() returns a handle, which is used to cancel a pending item; handles of
+ * fired (or cancelled) items become stale and cancelling those is a no-op
+ *
+ *
+ * SYNOPSIS:
+ *  TimerWheel<std::string> tw;
+ *
+ *  auto h = tw.insert(time(nullptr) + 10, "in 10 seconds");
+ *  tw.insert(DateTime("20180704 07:00:00").stamp(), "morning digest");
+ *  tw.cancel(h);
+ *
+ *  while(not tw.empty()) {
+ *   sleep(std::max(tw.next_due() - time(nullptr), 0L));        // wake up when needed
+ *   tw.advance(time(nullptr), [](std::string &&s) { std::cout << s << std::endl; });
+ *  }
+ *
+ */
+
+#pragma once
+
+#include <vector>
+#include <stdint.h>
+#include <time.h>
+#include "extensions.hpp"
+
+
+
+template<class T>
+class TimerWheel {
+ public:
+    #define THROWREASON \
+                timer_wheel_capacity_exhausted, \
+                end_of_throw
+    ENUMSTR(ThrowReason, THROWREASON)
+
+    typedef uint64_t    Handle;                                 // generation << 32 | node index
+
+    #define TW_LEVELS 4
+    #define TW_SLOT_BITS 8
+    #define TW_SLOTS (1 << TW_SLOT_BITS)
+    #define TW_NIL UINT32_MAX                                   // null node index
+
+                        TimerWheel(time_t now = time(nullptr)): now_(now) {
+                         for(auto &lvl: slot_) for(auto &head: lvl) head = TW_NIL;
+                         for(auto &lvl: bits_) for(auto &w: lvl) w = 0;
+                        }
+
+    Handle              insert(time_t due, const T &item) { return insert(due, T(item)); }
+    Handle              insert(time_t due, T &&item);
+    bool                cancel(Handle h);                       // false: handle is stale
+    template<class F>
+    size_t              advance(time_t now, F fire);            // fire due items, returns fired
+    time_t              next_due(void) const;                   // -1: nothing is pending
+
+    size_t              size(void) const { return size_; }
+    bool                empty(void) const { return size_ == 0; }
+    time_t              now(void) const { return now_; }        // time the wheel is advanced to
+    size_t              capacity(void) const { return cap_; }
+    TimerWheel &        capacity(size_t n) { cap_ = n; return *this; }  // 0: unbounded
+    TimerWheel &        reserve(size_t n) { pool_.reserve(n); return *this; }
+
+    EXCEPTIONS(ThrowReason)                                     // see "extensions.hpp"
+
+ private:
+    struct Node_ {
+        T                   item;
+        time_t              due;
+        uint32_t            next;
+        uint32_t            prev;
+        uint32_t            gen;                                // incremented when node is freed
+        uint16_t            slot;                               // level * TW_SLOTS + slot
+        bool                busy;
+    };
+
+    std::vector<Node_>  pool_;
+    uint32_t            free_{TW_NIL};                          // list of free nodes
+    uint32_t            slot_[TW_LEVELS][TW_SLOTS];             // heads of slots' lists
+    uint64_t            bits_[TW_LEVELS][TW_SLOTS / 64];        // non-empty slots
+    uint32_t            late_{TW_NIL};                          // items due already
+    time_t              now_;
+    size_t              size_{0};
+    size_t              cap_{0};
+
+    uint32_t            alloc_(void);
+    void                link_(uint32_t n);                      // place node into a slot
+    void                unlink_(uint32_t n);
+    void                cascade_(int lvl, int slot);
+    template<class F>
+    size_t              fire_(uint32_t head, F &fire);          // fire all nodes in the list
+    template<class F>
+    size_t              fire_late_(F &fire) {
+                         uint32_t head = late_;
+                         late_ = TW_NIL;
+                         return fire_(head, fire);
+                        }
+
+    #define TW_LATE (TW_LEVELS * TW_SLOTS)                      // slot tag for late list
+    uint32_t &          head_(uint16_t slot)
+                         { return slot == TW_LATE? late_: slot_[slot / TW_SLOTS][slot % TW_SLOTS]; }
+};
+
+template<class T>
+STRINGIFY(TimerWheel<T>::ThrowReason, THROWREASON)
+#undef THROWREASON
+
+
+
+template<class T>
+typename TimerWheel<T>::Handle TimerWheel<T>::insert(time_t due, T &&item) {
+ // schedule item at epoch seconds 'due'; items due in the past fire with the next
+ // advance()
+ uint32_t n = alloc_();
+ Node_ &node = pool_[n];
+ node.item = std::move(item);
+ node.due = due;
+ node.busy = true;
+ link_(n);
+ ++size_;
+ return static_cast<Handle>(node.gen) << 32 | n;
+}
+
+
+template<class T>
+bool TimerWheel<T>::cancel(Handle h) {
+ // remove pending item; O(1)
+ uint32_t n = h & UINT32_MAX;
+ if(n >= pool_.size() or not pool_[n].busy or pool_[n].gen != h >> 32) return false;
+
+ unlink_(n);
+ Node_ &node = pool_[n];
+ node.item = T();                                               // release item's resources
+ node.busy = false;
+ ++node.gen;
+ node.next = free_;
+ free_ = n;
+ --size_;
+ return true;
+}
+
+
+template<class T>
+template<class F>
+size_t TimerWheel<T>::advance(time_t now, F fire) {
+ // advance the wheel up to 'now' (inclusive), call fire(T &&) for every due item;
+ // fire() may insert new items
+ size_t fired = fire_late_(fire);
+
+ while(now_ < now) {
+  if(size_ == 0) { now_ = now; break; }                        // nothing to process, leap
+  ++now_;
+
+  int top = 0;                                                  // top level crossing a boundary
+  while(top < TW_LEVELS - 1 and ((now_ >> (top * TW_SLOT_BITS)) & (TW_SLOTS - 1)) == 0)
+   ++top;
+  for(int lvl = top; lvl > 0; --lvl)                            // cascade down, top level first
+   cascade_(lvl, (now_ >> (lvl * TW_SLOT_BITS)) & (TW_SLOTS - 1));
+  fired += fire_late_(fire);                                    // cascaded items due right now
+
+  int idx = now_ & (TW_SLOTS - 1);
+  uint32_t head = slot_[0][idx];
+  if(head == TW_NIL) continue;
+  slot_[0][idx] = TW_NIL;
+  bits_[0][idx / 64] &= ~(1ULL << (idx % 64));
+  fired += fire_(head, fire);
+ }
+
+ return fired;
+}
+
+
+template<class T>
+time_t TimerWheel<T>::next_due(void) const {
+ // return time when advance() should be called next: either when the earliest item
+ // in level 0 is due, or when the next cascading is due (whichever is earlier)
+ if(size_ == 0) return -1;
+ if(late_ != TW_NIL) return now_;
+
+ time_t block = now_ & ~static_cast<time_t>(TW_SLOTS - 1);
+ for(int idx = (now_ & (TW_SLOTS - 1)) + 1; idx < TW_SLOTS; ++idx) {
+  uint64_t w = bits_[0][idx / 64] >> (idx % 64);
+  if(w != 0) return block + idx + __builtin_ctzll(w);
+  idx |= 63;                                                    // skip to the next word
+ }
+ return block + TW_SLOTS;                                       // next cascading
+}
+
+
+template<class T>
+uint32_t TimerWheel<T>::alloc_(void) {
+ // get a free node from the pool (grow the pool if required)
+ if(free_ != TW_NIL) {
+  uint32_t n = free_;
+  free_ = pool_[n].next;
+  return n;
+ }
+ if((cap_ > 0 and pool_.size() >= cap_) or pool_.size() >= TW_NIL)
+  throw EXP(timer_wheel_capacity_exhausted);
+ pool_.push_back(Node_{T(), 0, TW_NIL, TW_NIL, 0, 0, false});
+ return pool_.size() - 1;
+}
+
+
+template<class T>
+void TimerWheel<T>::link_(uint32_t n) {
+ // place the node into the slot: the level is the lowest one, where the due time
+ // falls into the current block of that level; far future items (beyond the top
+ // level's block) go to the top level and keep re-cascading there
+ Node_ &node = pool_[n];
+ uint16_t slot = TW_LATE;
+ if(node.due > now_) {
+  int lvl = 0;
+  while(lvl < TW_LEVELS - 1 and
+        (node.due >> ((lvl + 1) * TW_SLOT_BITS)) != (now_ >> ((lvl + 1) * TW_SLOT_BITS)))
+   ++lvl;
+  int idx = (node.due >> (lvl * TW_SLOT_BITS)) & (TW_SLOTS - 1);
+  bits_[lvl][idx / 64] |= 1ULL << (idx % 64);
+  slot = lvl * TW_SLOTS + idx;
+ }
+
+ uint32_t &head = head_(slot);
+ node.slot = slot;
+ node.prev = TW_NIL;
+ node.next = head;
+ if(head != TW_NIL) pool_[head].prev = n;
+ head = n;
+}
+
+
+template<class T>
+void TimerWheel<T>::unlink_(uint32_t n) {
+ // remove the node from its slot
+ Node_ &node = pool_[n];
+ if(node.prev != TW_NIL) pool_[node.prev].next = node.next;
+ else {
+  head_(node.slot) = node.next;
+  if(node.next == TW_NIL and node.slot != TW_LATE) {            // slot became empty
+   int idx = node.slot % TW_SLOTS;
+   bits_[node.slot / TW_SLOTS][idx / 64] &= ~(1ULL << (idx % 64));
+  }
+ }
+ if(node.next != TW_NIL) pool_[node.next].prev = node.prev;
+}
+
+
+template<class T>
+void TimerWheel<T>::cascade_(int lvl, int idx) {
+ // redistribute items of the given slot into lower levels
+ uint32_t n = slot_[lvl][idx];
+ slot_[lvl][idx] = TW_NIL;
+ bits_[lvl][idx / 64] &= ~(1ULL << (idx % 64));
+
+ while(n != TW_NIL) {
+  uint32_t next = pool_[n].next;
+  link_(n);
+  n = next;
+ }
+}
+
+
+template<class T>
+template<class F>
+size_t TimerWheel<T>::fire_(uint32_t n, F &fire) {
+ // fire and free all the nodes in the (detached) list
+ size_t fired = 0;
+ while(n != TW_NIL) {
+  Node_ &node = pool_[n];
+  uint32_t next = node.next;
+  T item = std::move(node.item);
+  node.item = T();
+  node.busy = false;
+  ++node.gen;
+  node.next = free_;
+  free_ = n;
+  --size_;
+  ++fired;
+  fire(std::move(item));                                        // may insert (reuse the node)
+  n = next;
+ }
+ return fired;
+}
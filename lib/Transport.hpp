@@ -0,0 +1,809 @@
+/*
+ * transports deliver rendered mails (Message): the mail is rendered once (by
+ * CurlSmtp) and then handed to a transport:
+ *  - SmtpTransport: relays the mail via smtp server (CurlSmtp, i.e. libcurl)
+ *  - LmtpTransport: delivers to the local LMTP server (e.g. dovecot, postfix) over
+ *    a unix socket (a native client: no TCP, no TLS); the connection is kept open
+ *    and reused by subsequent mails; PIPELINING is used if the server offers it
+ *  - MaildirTransport: writes the mail straight into a Maildir (tmp/, then new/)
+ *  - MboxTransport: appends the mail to an mbox file (mboxrd, fcntl locked)
+ *  - DumpTransport: writes the mail into a stream exactly as it would be uploaded
+ *    to the smtp server (a dry run)
+ *  - DaemonTransport: hands the mail over to a resident cmail (the daemon) over a
+ *    unix socket, the daemon delivers it via its warm (already connected and
+ *    authenticated) transports and returns the outcome; the request is a frame of
+ *    fields (see read_frame()): the envelope, the destination, credentials and the
+ *    mail text
+ *
+ * a failed delivery is reported by send() (returns false), then error(), response()
+ * and transient() describe the failure; a transient failure (e.g. reply 4xx, lost
+ * connection, exhausted disk space) is worth retrying
+ *
+ * local transports (Maildir, mbox) store mails with unix line breaks (LF) and
+ * prepend the envelope sender as 'Return-Path:' header
+ *
+ *
+ * SYNOPSIS:
+ *  Message m = sm.from("user@host.net").add_to("user1@host.net").render("Message ...");
+ *
+ *  LmtpTransport lmtp("/var/run/dovecot/lmtp");
+ *  if(not lmtp.send(m))
+ *   std::cerr << "lmtp failed: " << lmtp.error() << std::endl;
+ *
+ *  MaildirTransport("/home/user1/Maildir").send(m);             // or, a local copy
+ *
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <ostream>
+#include <algorithm>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "extensions.hpp"
+#include "dbg.hpp"
+#include "Curl.hpp"
+
+
+
+#define TR_EOL "\r\n"
+#define TR_BUF (64 * 1024)                                      // i/o buffer size
+#define TR_TIMEOUT 300                                          // lmtp reply timeout (sec)
+#define TR_MAGIC "cmail-1"                                      // daemon protocol version
+#define TR_MAX_FIELDS (1 << 20)
+#define TR_MAX_FRAME (256 << 20)                                // daemon's request size limit
+#define TR_GROW (1 << 20)                                       // frame field's buffer growth
+
+class Transport {
+ public:
+    virtual            ~Transport(void) = default;
+
+    virtual bool        send(const Message & m) = 0;            // false: delivery failed
+    virtual bool        paced(void) const { return false; }     // is a relay (to be throttled)
+
+    const std::string & name(void) const { return name_; }
+    bool                failed(void) const { return failed_; }  // last delivery failed
+    bool                transient(void) const { return transient_; }
+    long                response(void) const { return response_; } // last reply code (0: none)
+    const std::string & error(void) const { return error_; }
+
+    DEBUGGABLE()
+
+ protected:
+                        Transport(const std::string & name): name_(name) {}
+
+    bool                succeed_(long response = 0) {
+                         failed_ = transient_ = false;
+                         response_ = response;
+                         error_.clear();
+                         return true;
+                        }
+    bool                fail_(const std::string & error, bool transient = false,
+                              long response = 0) {
+                         failed_ = true;
+                         transient_ = transient;
+                         response_ = response;
+                         error_ = error;
+                         return false;
+                        }
+    bool                fail_errno_(const std::string & what) { // local i/o failure
+                         int e = errno;
+                         return fail_(what + ": " + strerror(e),
+                                      e AMONG(ENOSPC, EDQUOT, EAGAIN, EINTR, EMFILE, ENFILE));
+                        }
+
+    class UnixText_ {                                           // writes mail text into file:
+     public:                                                    // CRLF -> LF, mboxrd quoting
+                            UnixText_(int fd, bool quote_from): fd_(fd), quote_(quote_from) {}
+
+        bool                write(const char *ptr, size_t len);
+        bool                write(const std::string & str) { return write(str.data(), str.size()); }
+        bool                raw(const std::string & str) { return put_(str.data(), str.size()); }
+        bool                finish(void);                       // end with a line break, flush
+
+     private:
+        bool                put_(const char *ptr, size_t len);
+        bool                flush_(void);
+
+        int                 fd_;
+        bool                quote_;                             // quote ">*From " lines
+        bool                bol_{true};                         // at the beginning of a line
+        bool                cr_{false};                         // CR held back
+        std::string         hold_;                              // line start held back (quoting)
+        char                buf_[TR_BUF];
+        size_t              len_{0};
+        char                last_{'\n'};                        // last char put
+    };
+
+    std::string         name_;
+    bool                failed_{false};
+    bool                transient_{false};
+    long                response_{0};
+    std::string         error_;
+};
+
+
+
+class SmtpTransport: public Transport {
+ // relay via smtp server (the one set in CurlSmtp)
+ public:
+                        SmtpTransport(CurlSmtp & sm): Transport(sm.host()), sm_(sm) {}
+
+    bool                send(const Message & m) override;
+    bool                paced(void) const override { return true; }
+
+ private:
+    CurlSmtp &          sm_;
+};
+
+
+
+class DumpTransport: public Transport {
+ // a dry run: write mails into a stream (as they would be uploaded)
+ public:
+                        DumpTransport(CurlSmtp & sm, std::ostream & out):
+                         Transport("dry run"), sm_(sm), out_(out) {}
+
+    bool                send(const Message & m) override {
+                         sm_.dump(m, out_);
+                         if(out_.flush()) return succeed_();
+                         return fail_("could not write dry run output");
+                        }
+
+ private:
+    CurlSmtp &          sm_;
+    std::ostream &      out_;
+};
+
+
+
+class LmtpTransport: public Transport {
+ // deliver to the local LMTP server over a unix socket (RFC2033)
+ public:
+                        LmtpTransport(const std::string & socket):
+                         Transport("lmtp:" + socket), path_(socket) {}
+                        LmtpTransport(const LmtpTransport &) = delete;
+                       ~LmtpTransport(void) { quit_(); }
+    LmtpTransport &     operator=(const LmtpTransport &) = delete;
+
+    bool                send(const Message & m) override;
+
+ private:
+    bool                connect_(void);
+    void                close_(void) { if(fd_ >= 0) ::close(fd_); fd_ = -1; in_.clear(); }
+    void                quit_(void);
+    bool                command_(const std::string & cmd, long expect);
+    bool                write_(const char *ptr, size_t len);
+    bool                flush_(void);
+    long                reply_(void);                           // -1: connection failed
+    bool                data_(const Message & m);               // dot-stuffed mail text
+    bool                io_failed_(void)
+                         { close_(); return fail_("lmtp: connection to '" + path_ + "' lost", true); }
+
+    std::string         path_;
+    int                 fd_{-1};
+    bool                pipelining_{false};
+    std::string         in_;                                    // received, not parsed yet
+    std::string         reply_text_;                            // last reply (all lines)
+    std::string         out_;                                   // to be sent
+};
+
+
+
+class MaildirTransport: public Transport {
+ // write mails into a Maildir: file is written into tmp/ and then moved into new/
+ public:
+                        MaildirTransport(const std::string & dir):
+                         Transport("maildir:" + dir), dir_(dir) {}
+
+    bool                send(const Message & m) override;
+
+ private:
+    bool                make_dirs_(void);
+    std::string         unique_name_(void);
+
+    std::string         dir_;
+    bool                made_{false};                           // dir, tmp, new, cur exist
+    unsigned long       count_{0};                              // deliveries by the process
+};
+
+
+
+class DaemonTransport: public Transport {
+ // hand mails over to the daemon (it retries transient failures itself), the
+ // connection is kept for subsequent mails
+ public:
+                        DaemonTransport(const std::string & socket, const std::string & dest,
+                                        const std::string & user = "",
+                                        const std::string & password = "", unsigned retries = 0):
+                         Transport("daemon:" + socket), path_(socket), dest_(dest),
+                         user_(user), password_(password), retries_(retries) {}
+                        DaemonTransport(const DaemonTransport &) = delete;
+                       ~DaemonTransport(void) { if(fd_ >= 0) ::close(fd_); }
+    DaemonTransport &   operator=(const DaemonTransport &) = delete;
+
+    bool                connect(void);                          // false: daemon is unavailable
+    bool                send(const Message & m) override { return send(m, -1); }
+    bool                send(const Message & m, time_t due);    // due >= 0: daemon queues it
+    bool                queued(void) const { return queued_; }
+
+    // frame: u32 number of fields, then each field: u64 length and bytes
+    static bool         read_frame(int fd, std::vector<std::string> & fields);
+    static bool         write_frame(int fd, const std::vector<std::string> & fields,
+                                    const Message *text = nullptr); // text: the last field
+    static bool         parse_frame(const char *ptr, size_t len,
+                                    std::vector<std::string> & fields); // frame in memory
+    static ssize_t      frame_size(const char *ptr, size_t len); // 0: incomplete, -1: broken
+    enum Request {                                              // fields: ..., rcpts, text
+        rq_magic, rq_dest, rq_user, rq_password, rq_retries, rq_due, rq_from, rq_rcpt
+    };
+    static bool         valid_request(const std::vector<std::string> & rq)
+                         { return rq.size() > rq_rcpt + 1 and rq[rq_magic] == TR_MAGIC; }
+    enum Reply { rp_status, rp_transient, rp_response, rp_error, rp_fields };
+
+ private:
+    static bool         write_all_(int fd, const char *ptr, size_t len);
+    static bool         read_all_(int fd, char *ptr, size_t len);
+
+    std::string         path_;
+    std::string         dest_;                                  // smtp server, lmtp:socket
+    std::string         user_;
+    std::string         password_;
+    unsigned            retries_;
+    int                 fd_{-1};
+    bool                queued_{false};
+};
+
+
+
+class MboxTransport: public Transport {
+ // append mails to an mbox file (mboxrd format)
+ public:
+                        MboxTransport(const std::string & file):
+                         Transport("mbox:" + file), file_(file) {}
+
+    bool                send(const Message & m) override;
+
+ private:
+    std::string         file_;
+};
+
+
+
+
+bool Transport::UnixText_::write(const char *ptr, size_t len) {
+ // write next piece of the mail text: CRLF line breaks become LF (bare CRs are kept);
+ // with quoting, lines matching ">*From " get one more '>' prepended (mboxrd), for
+ // that a line's beginning is held back till it's clear if the line matches
+ for(const char *end = ptr + len; ptr < end;) {
+  if(cr_) {
+   cr_ = false;
+   if(*ptr != '\n' and not put_("\r", 1)) return false;         // bare CR
+  }
+  if(bol_ and quote_) {
+   if(*ptr != '\r' and *ptr != '\n') {
+    hold_ += *ptr++;
+    size_t gt = hold_.find_first_not_of('>'), n = hold_.size() - gt;
+    if(gt == std::string::npos) continue;                       // only '>' so far
+    if(hold_.compare(gt, n, "From ", n) == 0) {                 // still matches
+     if(n < 5) continue;
+     if(not put_(">", 1)) return false;
+    }
+   }
+   if(not put_(hold_.data(), hold_.size())) return false;
+   hold_.clear();
+   bol_ = false;
+   continue;
+  }
+
+  const char *run = ptr;                                        // run of regular chars
+  while(run < end and *run != '\r' and *run != '\n') ++run;
+  if(run > ptr) { if(not put_(ptr, run - ptr)) return false; ptr = run; continue; }
+  if(*ptr++ == '\r') { cr_ = true; continue; }
+  if(not put_("\n", 1)) return false;
+  bol_ = true;
+ }
+ return true;
+}
+
+
+bool Transport::UnixText_::finish(void) {
+ if(cr_ and not put_("\r", 1)) return false;
+ cr_ = false;
+ if(not put_(hold_.data(), hold_.size())) return false;
+ hold_.clear();
+ if(last_ != '\n' and not put_("\n", 1)) return false;
+ return flush_();
+}
+
+
+bool Transport::UnixText_::put_(const char *ptr, size_t len) {
+ if(len == 0) return true;
+ last_ = ptr[len - 1];
+ if(len_ + len > sizeof(buf_) and not flush_()) return false;
+ if(len < sizeof(buf_)) { memcpy(buf_ + len_, ptr, len); len_ += len; return true; }
+ for(ssize_t n; len > 0; ptr += n, len -= n)                    // big run: write directly
+  if((n = ::write(fd_, ptr, len)) < 0) { if(errno == EINTR) n = 0; else return false; }
+ return true;
+}
+
+
+bool Transport::UnixText_::flush_(void) {
+ for(ssize_t n, off = 0; static_cast<size_t>(off) < len_; off += n)
+  if((n = ::write(fd_, buf_ + off, len_ - off)) < 0) { if(errno == EINTR) n = 0; else return false; }
+ len_ = 0;
+ return true;
+}
+
+
+
+bool SmtpTransport::send(const Message & m) {
+ sm_.send(m);
+ if(sm_.rc() != CURLE_OK)
+  return fail_(sm_.error(), sm_.transient(), sm_.response());
+ return succeed_(sm_.response());
+}
+
+
+
+bool LmtpTransport::send(const Message & m) {
+ // deliver the mail: the connection is (re)used, MAIL and RCPTs are pipelined (if
+ // supported); DATA is sent only if all recipients are accepted; LMTP replies once
+ // per each recipient after the mail text: a partial delivery is reported as a
+ // permanent failure (retrying would duplicate the mail for the others)
+ if(fd_ >= 0 and not command_("RSET", 250))                     // connection went stale?
+  close_();
+ if(fd_ < 0 and not connect_()) return false;
+
+ std::string from = m.from().empty() or m.from().front() != '<'? "<" + m.from() + ">": m.from();
+ std::vector<std::string> rcpt;
+ for(auto r = m.recipients(); r != nullptr; r = r->next)
+  rcpt.push_back(r->data[0] == '<'? std::string(r->data): "<" + std::string(r->data) + ">");
+ if(rcpt.empty()) return fail_("lmtp: no recipients");
+
+ std::vector<std::string> cmds{"MAIL FROM:" + from};
+ for(auto &r: rcpt) cmds.push_back("RCPT TO:" + r);
+ if(pipelining_) {                                              // one round trip for all
+  std::string all;
+  for(auto &cmd: cmds) all.append(cmd).append(TR_EOL);
+  if(not write_(all.data(), all.size()) or not flush_()) return io_failed_();
+ }
+
+ std::string err;
+ long code, rc = 0;
+ for(auto &cmd: cmds) {
+  if(not pipelining_) {
+   if(not err.empty()) break;                                   // no point to go on
+   std::string line = cmd + TR_EOL;
+   if(not write_(line.data(), line.size()) or not flush_()) return io_failed_();
+  }
+  if((code = reply_()) < 0) return io_failed_();
+  if(err.empty() and code / 100 != 2)
+   { rc = code; err = "lmtp: " + cmd + " failed: " + reply_text_; }
+ }
+ if(not err.empty()) {
+  command_("RSET", 250);
+  return fail_(err, rc / 100 == 4, rc);
+ }
+
+ if(not command_("DATA", 354)) return false;
+ if(not data_(m)) return io_failed_();
+
+ size_t delivered = 0;
+ for(auto &r: rcpt) {
+  if((code = reply_()) < 0) return io_failed_();
+  if(code / 100 == 2) ++delivered;
+  else if(err.empty())
+   { rc = code; err = "lmtp: delivery to " + r + " failed: " + reply_text_; }
+ }
+ DBG(0) DOUT() << "delivered to " << delivered << " of " << rcpt.size() << " recipient(s)" << std::endl;
+ if(delivered == rcpt.size()) return succeed_(code);
+ return fail_(err, delivered == 0 and rc / 100 == 4, rc);
+}
+
+
+bool LmtpTransport::connect_(void) {
+ // connect to the server's socket, greet it (LHLO) and learn its capabilities
+ sockaddr_un sa{};
+ sa.sun_family = AF_UNIX;
+ if(path_.size() >= sizeof(sa.sun_path))
+  return fail_("lmtp: socket path is too long: '" + path_ + "'");
+ memcpy(sa.sun_path, path_.c_str(), path_.size() + 1);
+
+ fd_ = socket(AF_UNIX, SOCK_STREAM, 0);
+ if(fd_ < 0) return fail_errno_("lmtp: socket");
+ fcntl(fd_, F_SETFD, FD_CLOEXEC);
+ #ifdef SO_NOSIGPIPE
+ int on = 1;
+ setsockopt(fd_, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+ #endif
+ timeval tv{TR_TIMEOUT, 0};
+ setsockopt(fd_, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+ setsockopt(fd_, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+ if(::connect(fd_, reinterpret_cast<sockaddr *>(&sa), sizeof(sa)) != 0) {
+  fail_errno_("lmtp: could not connect to '" + path_ + "'");
+  close_();
+  transient_ = true;                                            // server might be restarting
+  return false;
+ }
+
+ char host[256] = "localhost";
+ gethostname(host, sizeof(host) - 1);
+ long code = reply_();
+ if(code < 0) return io_failed_();
+ if(code != 220) {
+  close_();
+  return fail_("lmtp: server is not ready: " + reply_text_, code / 100 == 4, code);
+ }
+ if(not command_(std::string("LHLO ") + host, 250))
+  { close_(); return false; }
+
+ std::string caps(reply_text_);                                 // lines: "250-CAPABILITY"
+ for(auto &c: caps) c = toupper(c);
+ pipelining_ = caps.find("-PIPELINING") != std::string::npos or
+               caps.find(" PIPELINING") != std::string::npos;
+ DBG(0) DOUT() << "connected to '" << path_ << "', pipelining: " << pipelining_ << std::endl;
+ return true;
+}
+
+
+void LmtpTransport::quit_(void) {
+ if(fd_ < 0) return;
+ std::string cmd("QUIT" TR_EOL);
+ if(write_(cmd.data(), cmd.size()) and flush_()) reply_();
+ close_();
+}
+
+
+bool LmtpTransport::command_(const std::string & cmd, long expect) {
+ // send command, read the reply; false: unexpected reply (or connection failed)
+ DBG(1) DOUT() << "> " << cmd << std::endl;
+ std::string line = cmd + TR_EOL;
+ if(not write_(line.data(), line.size()) or not flush_()) return io_failed_();
+ long code = reply_();
+ if(code < 0) return io_failed_();
+ if(code == expect) return true;
+ return fail_("lmtp: " + cmd.substr(0, cmd.find(' ')) + " failed: " + reply_text_,
+              code / 100 == 4, code);
+}
+
+
+bool LmtpTransport::write_(const char *ptr, size_t len) {
+ out_.append(ptr, len);
+ return out_.size() < TR_BUF or flush_();
+}
+
+
+bool LmtpTransport::flush_(void) {
+ #ifdef MSG_NOSIGNAL
+ const int flags = MSG_NOSIGNAL;
+ #else
+ const int flags = 0;
+ #endif
+ for(ssize_t n, off = 0; static_cast<size_t>(off) < out_.size(); off += n)
+  if((n = ::send(fd_, out_.data() + off, out_.size() - off, flags)) < 0) {
+   if(errno != EINTR) { out_.clear(); return false; }
+   n = 0;
+  }
+ out_.clear();
+ return true;
+}
+
+
+long LmtpTransport::reply_(void) {
+ // read a (multiline) reply, return its code; the reply's lines are kept in
+ // reply_text_ (w/o CRs)
+ reply_text_.clear();
+ while(true) {
+  size_t eol;
+  while((eol = in_.find('\n')) == std::string::npos) {
+   char buf[4096];
+   ssize_t n = ::recv(fd_, buf, sizeof(buf), 0);
+   if(n < 0 and errno == EINTR) continue;
+   if(n <= 0) return -1;
+   in_.append(buf, n);
+  }
+  std::string line = in_.substr(0, eol > 0 and in_[eol - 1] == '\r'? eol - 1: eol);
+  in_.erase(0, eol + 1);
+  DBG(1) DOUT() << "< " << line << std::endl;
+  if(line.size() < 3 or not isdigit(line[0]) or not isdigit(line[1]) or not isdigit(line[2]))
+   return -1;                                                   // protocol is broken
+  reply_text_.append(reply_text_.empty()? "": "\n").append(line);
+  if(line.size() == 3 or line[3] != '-')
+   return strtol(line.c_str(), nullptr, 10);
+ }
+}
+
+
+bool LmtpTransport::data_(const Message & m) {
+ // send the mail text: lines starting with '.' get it doubled, the text is ended
+ // with CRLF (if it does not already) and terminated by a sole '.'
+ bool bol = true;
+ char last = '\n';
+ for(auto &s: m.segments()) {
+  const std::string &seg = s.get();                             // could wait for encoding
+  const char *p = seg.data(), *end = p + seg.size();
+  while(p < end) {
+   if(bol and *p == '.' and not write_(".", 1)) return false;
+   const char *nl = static_cast<const char *>(memchr(p, '\n', end - p));
+   const char *e = nl == nullptr? end: nl + 1;
+   if(not write_(p, e - p)) return false;
+   bol = nl != nullptr;
+   p = e;
+  }
+  if(not seg.empty()) last = seg.back();
+ }
+ const char *fin = last == '\n'? "." TR_EOL: TR_EOL "." TR_EOL;
+ return write_(fin, strlen(fin)) and flush_();
+}
+
+
+
+bool MaildirTransport::send(const Message & m) {
+ // write the mail into tmp/ (synced to disk), then move it into new/
+ if(not made_ and not make_dirs_()) return false;
+ std::string name = unique_name_(), tmp = dir_ + "/tmp/" + name;
+ int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0600);
+ if(fd < 0) return fail_errno_("maildir: could not create '" + tmp + "'");
+ fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+ UnixText_ txt(fd, false);
+ bool ok = txt.raw("Return-Path: " + (m.from().empty()? "<>": m.from()) + "\n");
+ for(auto &s: m.segments())
+  if(ok) ok = txt.write(s.get());
+ ok = ok and txt.finish() and fsync(fd) == 0;
+ if(not ok) fail_errno_("maildir: could not write '" + tmp + "'");
+ if(::close(fd) != 0 and ok) ok = fail_errno_("maildir: could not write '" + tmp + "'");
+ if(ok and rename(tmp.c_str(), (dir_ + "/new/" + name).c_str()) != 0)
+  ok = fail_errno_("maildir: could not move '" + tmp + "' into new/");
+ if(not ok) { unlink(tmp.c_str()); return false; }
+
+ DBG(0) DOUT() << "delivered into " << dir_ << "/new/" << name << std::endl;
+ return succeed_();
+}
+
+
+bool MaildirTransport::make_dirs_(void) {
+ for(auto sub: {"", "/tmp", "/new", "/cur"})
+  if(mkdir((dir_ + sub).c_str(), 0700) != 0 and errno != EEXIST)
+   return fail_errno_("maildir: could not create '" + dir_ + sub + "'");
+ return made_ = true;
+}
+
+
+std::string MaildirTransport::unique_name_(void) {
+ // a unique file name per Maildir's convention: time.MusecPpidQcount.host
+ timeval tv;
+ gettimeofday(&tv, nullptr);
+ char host[256] = "localhost";
+ gethostname(host, sizeof(host) - 1);
+ std::string h;
+ for(const char *c = host; *c != '\0'; ++c)                     // '/' and ':' are not allowed
+  h += *c == '/'? "\\057": *c == ':'? "\\072": std::string(1, *c);
+ return std::to_string(tv.tv_sec) + ".M" + std::to_string(tv.tv_usec) +
+        "P" + std::to_string(getpid()) + "Q" + std::to_string(++count_) + "." + h;
+}
+
+
+
+bool DaemonTransport::connect(void) {
+ sockaddr_un sa{};
+ sa.sun_family = AF_UNIX;
+ if(path_.size() >= sizeof(sa.sun_path))
+  return fail_("daemon: socket path is too long: '" + path_ + "'");
+ memcpy(sa.sun_path, path_.c_str(), path_.size() + 1);
+
+ fd_ = socket(AF_UNIX, SOCK_STREAM, 0);
+ if(fd_ < 0) return fail_errno_("daemon: socket");
+ fcntl(fd_, F_SETFD, FD_CLOEXEC);
+ #ifdef SO_NOSIGPIPE
+ int on = 1;
+ setsockopt(fd_, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+ #endif
+ if(::connect(fd_, reinterpret_cast<sockaddr *>(&sa), sizeof(sa)) == 0) return true;
+ fail_errno_("daemon: could not connect to '" + path_ + "'");
+ ::close(fd_);
+ fd_ = -1;
+ return false;
+}
+
+
+bool DaemonTransport::send(const Message & m, time_t due) {
+ // send the request and wait for the daemon's reply (the outcome of the delivery,
+ // or that the mail is queued); failures are not transient: the daemon has retried
+ queued_ = false;
+ if(fd_ < 0 and not connect()) return false;
+
+ if(m.size() > TR_MAX_FRAME - TR_BUF)
+  return fail_("daemon: mail is too big (" + std::to_string(m.size()) + " bytes)");
+ std::vector<std::string> rq{TR_MAGIC, dest_, user_, password_, std::to_string(retries_),
+                             std::to_string(due), m.from()};
+ for(auto r = m.recipients(); r != nullptr; r = r->next)
+  rq.emplace_back(r->data);
+ std::vector<std::string> rp;
+ if(not write_frame(fd_, rq, &m) or not read_frame(fd_, rp) or rp.size() < rp_fields) {
+  ::close(fd_);
+  fd_ = -1;
+  return fail_("daemon: connection to '" + path_ + "' lost");
+ }
+
+ queued_ = rp[rp_status] == "queued";
+ if(rp[rp_status] == "ok" or queued_)
+  return succeed_(strtol(rp[rp_response].c_str(), nullptr, 10));
+ return fail_(rp[rp_error], false, strtol(rp[rp_response].c_str(), nullptr, 10));
+}
+
+
+bool DaemonTransport::read_frame(int fd, std::vector<std::string> & fields) {
+ // read a frame (blocks till it's complete); false: connection closed, or broken;
+ // lengths come from the peer: the frame is capped by TR_MAX_FRAME and the buffers
+ // grow as the data actually arrives (no allocation upfront)
+ uint32_t n;
+ fields.clear();
+ if(not read_all_(fd, reinterpret_cast<char *>(&n), sizeof(n)) or n > TR_MAX_FIELDS)
+  return false;
+ size_t total = 0;
+ for(fields.resize(n); n > 0; --n) {
+  uint64_t len;
+  std::string &f = fields[fields.size() - n];
+  if(not read_all_(fd, reinterpret_cast<char *>(&len), sizeof(len))) return false;
+  if(len > TR_MAX_FRAME - total) return false;                  // garbage, or way too big
+  total += len;
+  for(size_t got = 0; got < len;) {
+   size_t chunk = std::min<size_t>(len - got, TR_GROW);
+   f.resize(got + chunk);
+   if(not read_all_(fd, &f[got], chunk)) return false;
+   got += chunk;
+  }
+ }
+ return true;
+}
+
+
+bool DaemonTransport::parse_frame(const char *ptr, size_t len,
+                                  std::vector<std::string> & fields) {
+ // parse a frame held in memory (e.g. in ShmRing); false: the frame is malformed
+ const char *end = ptr + len;
+ uint32_t n;
+ fields.clear();
+ if(len < sizeof(n)) return false;
+ memcpy(&n, ptr, sizeof(n));
+ ptr += sizeof(n);
+ if(n > TR_MAX_FIELDS) return false;
+ for(fields.resize(n); n > 0; --n) {
+  uint64_t flen;
+  if(static_cast<size_t>(end - ptr) < sizeof(flen)) return false;
+  memcpy(&flen, ptr, sizeof(flen));
+  ptr += sizeof(flen);
+  if(flen > static_cast<size_t>(end - ptr)) return false;
+  fields[fields.size() - n].assign(ptr, flen);
+  ptr += flen;
+ }
+ return ptr == end;
+}
+
+
+ssize_t DaemonTransport::frame_size(const char *ptr, size_t len) {
+ // return the size of the frame at the start of the buffer (the buffer is being
+ // filled, e.g. by non-blocking reads): 0 - the frame is not complete yet, -1 - the
+ // frame is broken (or too big, as in read_frame())
+ uint32_t n;
+ if(len < sizeof(n)) return 0;
+ memcpy(&n, ptr, sizeof(n));
+ if(n > TR_MAX_FIELDS) return -1;
+ size_t pos = sizeof(n), total = 0;
+ for(; n > 0; --n) {
+  uint64_t flen;
+  if(len - pos < sizeof(flen)) return 0;
+  memcpy(&flen, ptr + pos, sizeof(flen));
+  if(flen > TR_MAX_FRAME - total) return -1;
+  total += flen;
+  pos += sizeof(flen) + flen;
+  if(pos > len) return 0;
+ }
+ return pos;
+}
+
+
+bool DaemonTransport::write_frame(int fd, const std::vector<std::string> & fields,
+                                  const Message *text) {
+ // write fields and then the mail text (w/o copying it), if given
+ std::string hdr;
+ uint32_t n = fields.size() + (text != nullptr);
+ hdr.append(reinterpret_cast<const char *>(&n), sizeof(n));
+ for(auto &f: fields) {
+  uint64_t len = f.size();
+  hdr.append(reinterpret_cast<const char *>(&len), sizeof(len)).append(f);
+ }
+ if(text != nullptr) {
+  uint64_t len = text->size();
+  hdr.append(reinterpret_cast<const char *>(&len), sizeof(len));
+ }
+ if(not write_all_(fd, hdr.data(), hdr.size())) return false;
+ if(text != nullptr)
+  for(auto &s: text->segments())
+   if(not write_all_(fd, s.get().data(), s.get().size())) return false;
+ return true;
+}
+
+
+bool DaemonTransport::write_all_(int fd, const char *ptr, size_t len) {
+ #ifdef MSG_NOSIGNAL
+ const int flags = MSG_NOSIGNAL;
+ #else
+ const int flags = 0;
+ #endif
+ for(ssize_t n; len > 0; ptr += n, len -= n)
+  if((n = ::send(fd, ptr, len, flags)) < 0) { if(errno == EINTR) n = 0; else return false; }
+ return true;
+}
+
+
+bool DaemonTransport::read_all_(int fd, char *ptr, size_t len) {
+ for(ssize_t n; len > 0; ptr += n, len -= n)
+  if((n = ::recv(fd, ptr, len, 0)) <= 0) { if(n < 0 and errno == EINTR) n = 0; else return false; }
+ return true;
+}
+
+
+
+bool MboxTransport::send(const Message & m) {
+ // append the mail to the mbox (locked for the duration); on a failure the mbox is
+ // truncated back, thus no partial mail is left behind
+ int fd = ::open(file_.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0600);
+ if(fd < 0) return fail_errno_("mbox: could not open '" + file_ + "'");
+ fcntl(fd, F_SETFD, FD_CLOEXEC);
+ struct flock lk{};
+ lk.l_type = F_WRLCK;
+ lk.l_whence = SEEK_SET;
+ int rc;
+ do rc = fcntl(fd, F_SETLKW, &lk);
+ while(rc != 0 and errno == EINTR);
+ struct stat st;
+ if(rc != 0 or fstat(fd, &st) != 0) {
+  fail_errno_("mbox: could not lock '" + file_ + "'");
+  ::close(fd);
+  return false;
+ }
+
+ std::string sender = m.from().empty()? "MAILER-DAEMON": m.from();
+ if(sender.front() == '<') sender = sender.substr(1, sender.size() - 2);
+ time_t now = time(nullptr);
+ tm lt;
+ char date[32];
+ strftime(date, sizeof(date), "%a %b %e %H:%M:%S %Y", localtime_r(&now, &lt));
+
+ UnixText_ txt(fd, true);                                       // separator is not quoted
+ bool ok = txt.raw(std::string("From ") + sender + " " + date + "\nReturn-Path: <" + sender + ">\n");
+ for(auto &s: m.segments())
+  if(ok) ok = txt.write(s.get());
+ ok = ok and txt.finish() and ::write(fd, "\n", 1) == 1 and fsync(fd) == 0;
+ if(not ok) {
+  fail_errno_("mbox: could not write '" + file_ + "'");
+  if(ftruncate(fd, st.st_size) != 0) {}                         // drop the partial mail
+ }
+ ::close(fd);                                                   // releases the lock
+ if(not ok) return false;
+
+ DBG(0) DOUT() << "appended to " << file_ << std::endl;
+ return succeed_();
+}
+
+
+#undef TR_EOL
+#undef TR_BUF
+#undef TR_TIMEOUT
+#undef TR_MAGIC
+#undef TR_MAX_FIELDS
+#undef TR_MAX_FRAME
+#undef TR_GROW
@@ -11,6 +11,10 @@
  *    - user may use a block or a single expression after defining a debug point
  *  o thread-safe debugs, additionally allowing user setting up own mutex for debug
  *    operations
+ *  o optional asynchronous output: debugs are formatted into per-thread buffers
+ *    and handed off (via a lock-free ring) to a background writer thread
+ *  o optional binary debug log: formatting of debug outputs is deferred to an
+ *    offline decoder (cmail-logdecode)
  *  o piggy-backing on other debuggable class objects
  *  o user-control of debug outputs:
  *    - define prefix char/string (aka indent)
@@ -20,8 +24,12 @@
  *    - let setup filters for function-names and control filter mode:
  *      either filter-in or filter-out
  *    - allows redirecting all debug outputs to user-defined output stream
+ *    - rate-limit and sample debug outputs per debug placement, truncate long
+ *      string dumps
  *  o the class is trivially copyable/movable/assignable, no extra handling required
  *  o compile out any debugs with -DNDEBUG option
+ *  o compile out debug placements of lower severities with -DDBG_MAX_SEVERITY=n
+ *    option (only DBG(0) ... DBG(n) placements remain in the code)
  *
  *
  *  Understanding Debug class policy:
@@ -161,6 +169,65 @@
  * // are guaranteed to be thread-safe
  *
  *
+ * // asynchronous debug outputs:
+ * // by default, each debug placement point writes directly into the output stream
+ * // holding Debug's mutex, which (at high verbosity and with multiple threads)
+ * // serializes all threads on the output stream. An asynchronous mode relieves
+ * // that:
+ *
+ * DBG().async(true);       // turn on asynchronous debug outputs
+ *
+ * // in the asynchronous mode DOUT() refers to the per-thread buffer: a debug
+ * // placement point (DBG(n) { ... }) formats its output there without taking any
+ * // locks, and once the block is complete the buffer is handed off through a
+ * // lock-free ring to a background writer thread, which writes it into the output
+ * // stream. The writer thread is started upon first debug output and is joined
+ * // (with all pending outputs written) either by DBG().async(false), or upon the
+ * // program exit. Thus, if the output stream does not outlive the program (e.g. a
+ * // local std::ofstream), call DBG().async(false) before it's destroyed.
+ * // Outputs produced outside of debug placement points (e.g.: if(DBG()(2)) ...)
+ * // are held in the thread's buffer until the next debug placement point of that
+ * // thread completes, or until DBG().commit() is called
+ *
+ *
+ * // binary debug log:
+ * // even asynchronous outputs spend time formatting (numbers, time-stamps, prompts)
+ * // in the debugged code. Binary log defers formatting altogether:
+ *
+ * DBG().binlog("debugs.bin");  // turn on binary log (implies asynchronous mode)
+ * if(not DBG().binary()) ...   // failed to open the file
+ *
+ * // in the binary mode a debug placement point records only a static call-site id,
+ * // a severity, a time-stamp (ns), a thread id and raw (unformatted) arguments of
+ * // DOUT() - numbers are copied as binary values, strings are copied verbatim,
+ * // std::endl is recorded as a line break; other types are formatted into strings
+ * // (formatting manipulators like std::setw are not recorded). The text then is
+ * // rendered offline, e.g.:
+ *
+ *   cmail-logdecode -t debugs.bin
+ *
+ *
+ * // throttling debug outputs:
+ * // debug placements in loops (at high verbosity) may produce excessive outputs,
+ * // following methods let keep those in check:
+ *
+ * DBG().rate_limit(100);   // let thru at most 100 outputs per second per placement
+ * DBG().sample(10);        // let thru only every 10th output per placement
+ * DBG().truncate(256);     // truncate std::string arguments of DOUT() to 256 chars
+ *
+ * // rate-limiting and sampling apply to DBG(n) placements only (not to DBG()(n)
+ * // checks), the number of suppressed outputs is reported at most once in
+ * // DBG_REPORT_INTERVAL seconds per placement: right before its next admitted
+ * // output, or (in asynchronous mode) by the background writer; any remaining
+ * // counts are written on DBG().async(false) and once a Debug is destroyed (counts
+ * // are plain text lines, those are not recorded into a binary log), e.g.:
+ *
+ * ..feed_payload_(), [1234 debug outputs suppressed]
+ *
+ * // truncation applies only to std::string arguments (e.g. payload dumps), but
+ * // not to c-strings (literals are not truncated)
+ *
+ *
  * // propagating debug severity down debuggable classes,
  * // methods severity() and increment():
  * // both methods allow altering severity of the called Debugs:
@@ -279,17 +346,26 @@
 #pragma once
 
 #include <iostream>
+#include <fstream>
 #include <iomanip>
 #include <sstream>
 #include <string>
 #include <vector>
 #include <algorithm>
 #include <mutex>
+#include <atomic>
+#include <thread>
+#include <condition_variable>
 #include <type_traits>
 #include <exception>
+#include <functional>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
 #include <sys/time.h>
 #include "macrolib.h"
 #include "extensions.hpp"
+#include "IBtime.hpp"
 
 
 // below macros define user declaration forms of the debuggable class object:
@@ -322,23 +398,36 @@
 //    of object C, e.g.:
 //      DBG(x, 1) std::cout << ...  // x's debug severity is used
 //
-// macros 2. and 3. are entirely covered by Debug's mutex
+// macros 2. and 3. are entirely covered by Debug's mutex (or, in asynchronous mode,
+// by the per-thread buffer, which is committed once the block is complete)
 
+#define __DBG_SITE__ \
+    [](const char *fn) -> Debug::Site & \
+     { static Debug::Site site{__FILE__, __LINE__, fn}; return site; }(__func__)
+                                                                // call-site of the debug placement
 #define __DBG_0_ARG__() __dbg__                                 // DBG(): access to debug object
 #define __DBG_1_ARG__(X) \
-    if( __dbg__(X) ) \
-     for(std::unique_lock<std::mutex> mgard(__dbg__.mutex()); mgard.owns_lock(); mgard.unlock()) \
-      if( __dbg__(X, __func__) )                                // now print the prompt
+    if( __DBG_COMPILED__(X) and __dbg__(X) ) \
+     for(Debug::Block dblk(__dbg__, __DBG_SITE__); dblk.open(); dblk.close()) \
+      if( __dbg__(X, dblk.site()) )                             // now print the prompt
 #define __DBG_2_ARG__(O, X) \
-    if( O.__dbg__(X) ) \
-     for(std::unique_lock<std::mutex> mgard(O.__dbg__.mutex()); mgard.owns_lock(); mgard.unlock()) \
-      if( O.__dbg__(X, __func__) )                              // now print the prompt
+    if( __DBG_COMPILED__(X) and O.__dbg__(X) ) \
+     for(Debug::Block dblk(O.__dbg__, __DBG_SITE__); dblk.open(); dblk.close()) \
+      if( O.__dbg__(X, dblk.site()) )                           // now print the prompt
 #define __DBG_4TH_ARG__(arg1, arg2, arg3, arg4, ...) arg4
 #define __DBG_CHOOSER__(args...) \
     __DBG_4TH_ARG__(dummy, ##args, __DBG_2_ARG__, __DBG_1_ARG__, __DBG_0_ARG__)
 #define DBG(args...) __DBG_CHOOSER__(args)(args)
 
 
+// debug placements with the severity higher than DBG_MAX_SEVERITY are compiled out
+// (irrespective of the Debug object's severity and the debug level set at run-time),
+// e.g.: compiling with -DDBG_MAX_SEVERITY=1 leaves only DBG(0) and DBG(1) placements
+#ifndef DBG_MAX_SEVERITY
+ #define DBG_MAX_SEVERITY NDBG
+#endif
+#define __DBG_COMPILED__(X) ((X) <= DBG_MAX_SEVERITY)          // folded even w/o optimization
+
 #ifdef NDEBUG                                                   // compiled with -DNDEBUG option
  #undef __DBG_1_ARG__
  #undef __DBG_2_ARG__
@@ -349,8 +438,8 @@
 
 
 // DOUT() macros and init Debug's global macros
-#define __DOUT_0_ARG__() (DBG().dout())
-#define __DOUT_1_ARG__(X) (X.DBG().dout())
+#define __DOUT_0_ARG__() (DBG().out())
+#define __DOUT_1_ARG__(X) (X.DBG().out())
 #define __DOUT_3RD_ARG__(arg1, arg2, arg3, ...) arg3
 #define __DOUT_CHOOSER__(args...) \
     __DOUT_3RD_ARG__(dummy, ##args, __DOUT_1_ARG__, __DOUT_0_ARG__)
@@ -362,6 +451,8 @@
 #define NDBG 9999
 // NDBG definition is just insanely low debug severity - to be used when certain
 // debugs needed to be suppressed
+#define DBG_BINLOG_MAGIC "cmail-debug-binlog-1\n"                // header of binary debug log
+#define DBG_REPORT_INTERVAL 1                                   // report suppressed debugs [sec]
 
 // below definition let check whether '__dbg_propagate__()' method is present or not:
 template<typename T>
@@ -376,9 +467,168 @@ constexpr bool __is_dbg_propagatable__(...) { return false; }
 
 
 class Debug {
+    class Writer_;
  public:
+    // record and argument tags of the binary debug log:
+    // - site record: tag, id (uint32), line (uint32), file (str), function (str)
+    // - entry record: tag, site id (uint32), severity (int16), time-stamp in ns (int64),
+    //   thread id (uint32), followed by the entry's arguments
+    // - continuation record: tag, thread id (uint32), followed by the arguments
+    // - arguments: tag followed by the raw value, strings (str) are length (uint32)
+    //   prefixed
+    enum BinTag {
+        bin_site = 'S', bin_entry = 'E', bin_cont = 'C',
+        arg_int = 'i', arg_uint = 'u', arg_dbl = 'd', arg_chr = 'c', arg_bool = 'b',
+        arg_str = 's', arg_eol = 'n'
+    };
+
+    class Site {
+     // call-site of a debug placement: one static instance per each DBG(n) placement
+     public:
+                            Site(const char *file, unsigned line, const char *fn):
+                             file_{file}, func_{fn}, line_{line},
+                             id_{Debug::sites_.fetch_add(1, std::memory_order_relaxed)} {}
+
+        const char *        file(void) const { return file_; }
+        const char *        func(void) const { return func_; }
+        unsigned            line(void) const { return line_; }
+        unsigned            id(void) const { return id_; }
+        Site *              next(void) const { return next_; }  // next throttled placement
+        bool                logged(void)                        // true if already in binary log
+                             { return logged_.exchange(true, std::memory_order_relaxed); }
+        bool                admit(uint64_t &suppressed);        // apply rate-limit and sampling
+        uint64_t            take_suppressed(time_t now, bool all); // count to report
+        bool                match(void) {                       // cached Debug::match_(func())
+                             auto gen = Debug::fgen_.load(std::memory_order_relaxed);
+                             auto fv = fv_.load(std::memory_order_relaxed);
+                             if(fv >> 1 == gen) return fv & 1;
+                             bool m = Debug::match_(func_);
+                             fv_.store(gen << 1 | m, std::memory_order_relaxed);
+                             return m;
+                            }
+     private:
+        const char *        file_;
+        const char *        func_;
+        unsigned            line_;
+        unsigned            id_;
+        std::atomic<bool>   logged_{false};                     // definition recorded in binlog
+        std::atomic<unsigned>
+                            fv_{0};                             // filter's verdict & generation
+                            // filter's verdict is cached in the lowest bit, the rest is the
+                            // generation of the filter (Debug::fgen_) the verdict was made for
+        std::atomic<uint64_t>
+                            hits_{0};                           // for sampling
+        std::atomic<time_t> window_{0};                         // current rate-limit window
+        std::atomic<unsigned>
+                            admitted_{0};                       // admitted in current window
+        std::atomic<uint64_t>
+                            suppressed_{0};                     // not reported yet
+        std::atomic<time_t> reported_{0};                       // last reported suppressed
+        std::atomic<bool>   listed_{false};                     // in the list of throttled
+        Site *              next_{nullptr};                     // next throttled placement
+
+        void                suppress_(void);                    // count a suppressed output
+    };
+
+    class Block {
+     // guards a debug placement point (DBG(n) {...}): in synchronous mode the block
+     // is covered by Debug's mutex, in asynchronous mode the thread's buffer is
+     // committed to the background writer once the block is closed
+     public:
+                            Block(void) = delete;
+                            Block(const Block &) = delete;
+                            Block(const Debug &, Site &site):
+                             async_{Debug::async_.load(std::memory_order_relaxed)}, site_(site)
+                             { if(not async_) { mp_ = Debug::mp_; mp_->lock(); } }
+                           ~Block(void) { if(open_) close(); }     // e.g. break out of the block
+
+        bool                open(void) const { return open_; }
+        Site &              site(void) const { return site_; }
+        void                close(void) {
+                             if(async_) Debug::commit();
+                             else mp_->unlock();
+                             open_ = false;
+                            }
+     private:
+        bool                open_{true};
+        bool                async_;
+        std::mutex *        mp_{nullptr};
+        Site &              site_;
+    };
+
+    class Dout {
+     // DOUT() proxy: forwards all outputs to the debug ostream, while in the binary
+     // mode records raw arguments into the thread's buffer (deferring formatting)
+     public:
+                            Dout(std::ostream &os, bool bin): os_(os), bin_{bin} {}
+
+        Dout &              operator<<(const char *s)
+                             { if(bin_) rec_str_(s, strlen(s)); else os_ << s; return *this; }
+        Dout &              operator<<(const std::string &s) {
+                             if(Debug::trunc_ > 0 and s.size() > Debug::trunc_)
+                              return *this << s.substr(0, Debug::trunc_) << "...<+"
+                                           << s.size() - Debug::trunc_ << " chars>";
+                             if(bin_) rec_str_(s.data(), s.size()); else os_ << s;
+                             return *this;
+                            }
+        Dout &              operator<<(char c)
+                             { if(bin_) rec_(arg_chr, c); else os_ << c; return *this; }
+        Dout &              operator<<(bool b)
+                             { if(bin_) rec_(arg_bool, b); else os_ << b; return *this; }
+        template<typename T>
+        typename std::enable_if<std::is_integral<T>::value or std::is_enum<T>::value, Dout &>::type
+                            operator<<(T v) {
+                             if(not bin_) { os_ << v; return *this; }
+                             if(std::is_signed<T>::value or std::is_enum<T>::value)
+                              rec_(arg_int, static_cast<int64_t>(v));
+                             else
+                              rec_(arg_uint, static_cast<uint64_t>(v));
+                             return *this;
+                            }
+        template<typename T>
+        typename std::enable_if<std::is_floating_point<T>::value, Dout &>::type
+                            operator<<(T v)
+                             { if(bin_) rec_(arg_dbl, static_cast<double>(v)); else os_ << v;
+                               return *this; }
+        Dout &              operator<<(std::ostream & (*m)(std::ostream &)) {
+                             if(not bin_) { os_ << m; return *this; }
+                             if(m == static_cast<std::ostream & (*)(std::ostream &)>(std::endl))
+                              Debug::tout_().buf.str += static_cast<char>(arg_eol);
+                             return *this;
+                            }
+        template<typename T>
+        typename std::enable_if<not std::is_arithmetic<T>::value and
+                                not std::is_enum<T>::value, Dout &>::type
+                            operator<<(const T &v) {                // any other type
+                             if(not bin_) { os_ << v; return *this; }
+                             std::stringstream ss;
+                             ss << v;
+                             if(ss.tellp() > 0) *this << ss.str();
+                             return *this;
+                            }
+
+                            operator std::ostream &(void) { return os_; }
+
+     private:
+        std::ostream &      os_;
+        bool                bin_;
+
+        template<typename T>
+        void                rec_(BinTag tag, T v) {
+                             auto & buf = Debug::tout_().buf.str;
+                             if(buf.empty()) Debug::rec_cont_();
+                             buf += static_cast<char>(tag);
+                             buf.append(reinterpret_cast<const char*>(&v), sizeof(v));
+                            }
+        void                rec_str_(const char *s, uint32_t len) {
+                             rec_(arg_str, len);
+                             Debug::tout_().buf.str.append(s, len);
+                            }
+    };
+
                         Debug(void) = default;
     template<class X>   Debug(X &x) { x.DBG().severity(x); };
+                       ~Debug(void) { flush_suppressed_(); }     // report pending counts
 
     short               level(void) const { return udl_; }
     Debug &             level(short ul) { udl_=ul; return *this; }
@@ -391,16 +641,31 @@ class Debug {
     Debug &             stamped(bool x) { ts_ = x; return *this; }
     Debug &             stamp_ms(bool x) { ms_ = x; return *this; }
     Debug &             stamp_us(bool x) { us_ = x; return *this; }
-    Debug &             filter_out(bool x) { ft_ = x; return *this; }
-    Debug &             filter(const char *s) { filter_.push_back(s); return *this; }
+    Debug &             filter_out(bool x) { ft_ = x; ++fgen_; return *this; }
+    Debug &             filter(const char *s) { filter_.push_back(s); ++fgen_; return *this; }
     Debug &             reset_filter(void) { filter_.clear(); filter_out(false); return *this; }
-    std::mutex &        mutex(void) const { return Debug::mtx_; }
+    std::mutex &        mutex(void) const { return *Debug::mp_; }
     Debug &             mutex(std::mutex & mtx) { mp_ = &mtx; return *this; }
     Debug &             reset_mutex(void) { mp_ = &mtx_; return *this; }
-    std::ostream &      dout(void) const { return *op_; }
+    std::ostream &      dout(void) const
+                         { return async_.load(std::memory_order_relaxed)? tout_().os: *op_; }
+    Dout                out(void) const                         // DOUT() refers to it
+                         { return Dout{dout(), binary()}; }
     Debug &             use_ostream(std::ostream & os) { op_ = &os; return *this; }
     Debug &             reset_ostream(void) { op_ = &std::cout; return *this; }
+    bool                async(void) const { return async_; }
+    Debug &             async(bool x);                          // asynchronous outputs on/off
+    static void         commit(void);                           // hand off thread's buffer
+    bool                binary(void) const { return bin_.load(std::memory_order_relaxed); }
+    Debug &             binlog(const std::string &fname);       // turn on binary log into fname
+    Debug &             rate_limit(unsigned n) { rate_ = n; return *this; } // 0: unlimited
+    Debug &             sample(unsigned n) { sample_ = n; return *this; }   // 0, 1: all
+    Debug &             truncate(size_t n) { trunc_ = n; return *this; }    // 0: no truncation
     bool                operator()(short d, const char *fn=nullptr) const;// check and print prompt
+    bool                operator()(short d, Site &site) const;  // same, for DBG(n) placements
+    static constexpr bool
+                        compiled(int d)                         // is severity d compiled in?
+                         { return __DBG_COMPILED__(d); }
     std::string         prompt(const char *fn, int ms=0,
                                bool useTs=Debug::ts_, bool useAltPfx=false) const;
 
@@ -459,9 +724,6 @@ class Debug {
     short               ds_{0};                                 // my debug severity offset
 
  private:
-    #define MONTH Jan, Feb, Mar, Apr, May, Jun, Jul, Aug, Sep, Oct, Nov, Dec
-    ENUMSTR( Month, MONTH )
-
     static short        udl_;                                   // user debug level - set by user
     static bool         indented_;                              // is prompt indented?
     static std::string  indent_;                                // chars used for indenting (prefix)
@@ -474,18 +736,214 @@ class Debug {
     static std::mutex * mp_;                                    // pointer to currently used mutex
   static std::ostream * op_;                                    // pointer to currently ostream
     static bool         ft_;                                    // filter-in(true) or -out(false)
+  static std::atomic<unsigned>
+                        fgen_;                                  // generation of the filter
   static std::vector<std::string>
                         filter_;                                // facility filter
+  static std::atomic<bool>
+                        async_;                                 // asynchronous outputs?
+  static std::atomic<bool>
+                        bin_;                                   // binary log?
+  static std::atomic<unsigned>
+                        sites_;                                 // counter of debug call-sites
+  static std::atomic<Site*>
+                        throttled_;                             // list of throttled call-sites
+  static std::ofstream  binlog_;                                // binary log file
+    static unsigned     rate_;                                  // outputs per sec per placement
+    static unsigned     sample_;                                // let thru 1 of sample_ outputs
+    static size_t       trunc_;                                 // truncate string arguments
+    static Writer_      writer_;                                // background writer
+
+    class Tbuf_: public std::streambuf {
+     // per-thread debug buffer: accumulates all outputs into a string
+     public:
+        std::string         str;
+     protected:
+        int_type            overflow(int_type c) override {
+                             if(c != traits_type::eof()) str += traits_type::to_char_type(c);
+                             return c;
+                            }
+        std::streamsize     xsputn(const char *s, std::streamsize n) override
+                             { str.append(s, n); return n; }
+    };
+
+    struct Tout_ {
+        Tbuf_               buf;
+        std::ostream        os{&buf};
+    };
+
+    static Tout_ &      tout_(void)
+                         { thread_local Tout_ tout; return tout; }
+    static uint32_t     tid_(void) {
+                         thread_local uint32_t tid = std::hash<std::thread::id>{}(std::this_thread::get_id());
+                         return tid;
+                        }
+    void                prompt_(short d, Site &site) const;
+    static void         rec_site_(const Site &site);
+    static void         rec_entry_(short sev, const Site &site);
+    static void         rec_cont_(void);
+    template<typename T>
+    static void         rec_raw_(T v)
+                         { tout_().buf.str.append(reinterpret_cast<const char*>(&v), sizeof(v)); }
+    static void         rec_raw_(const char *s) {
+                         uint32_t len = strlen(s);
+                         rec_raw_(len);
+                         tout_().buf.str.append(s, len);
+                        }
 
     static const std::string
                         timestamp_(void);
-    static const std::string
-                        stamp_str_(time_t t_stamp);
     static bool         match_(const char *f);
+    static std::string  suppressed_report_(bool all);           // lines of suppressed counts
+    static void         flush_suppressed_(void);                // write all pending counts
 };
 
-STRINGIFY( Debug::Month, MONTH)
-#undef MONTH
+
+
+
+class Debug::Writer_ {
+ // background writer of asynchronous debug outputs:
+ // producers (any thread) commit their buffers into a bounded lock-free ring (the
+ // ring is MPSC: claiming a cell is a CAS on the head, a cell's sequence number
+ // tells whether it's free or filled), the writer thread drains it into Debug's
+ // ostream. Strings are swapped (not copied) in and out of the cells, so once
+ // warmed up, capacities are recycled and hand-offs do not allocate
+ public:
+                        Writer_(void) {
+                         for(size_t i = 0; i < RING_SIZE; ++i)
+                          ring_[i].seq.store(i, std::memory_order_relaxed);
+                        }
+                       ~Writer_(void) { stop(); }
+
+    void                push(std::string &str);                 // swaps str into the ring
+    void                stop(void);                             // drain the ring & join writer
+
+ private:
+    static constexpr size_t
+                        RING_SIZE{1024};                        // must be a power of 2
+    struct Cell_ {
+        std::atomic<size_t>     seq;
+        std::string             str;
+    };
+
+    Cell_               ring_[RING_SIZE];
+    std::atomic<size_t> head_{0};                               // next cell to fill (producers)
+    size_t              tail_{0};                               // next cell to drain (writer)
+    std::atomic<bool>   running_{false};
+    std::atomic<bool>   idle_{false};                           // writer is waiting for inputs
+    bool                stop_{false};
+    std::thread         thread_;
+    std::mutex          mtx_;                                   // guards start/stop & idle wait
+    std::condition_variable
+                        cv_;
+
+    bool                try_push_(std::string &str);
+    bool                try_pop_(std::string &str);
+    bool                empty_(void) const
+                         { return ring_[tail_ & (RING_SIZE-1)].seq.load(std::memory_order_acquire)
+                                  != tail_ + 1; }
+    void                start_(void);
+    void                run_(void);
+    void                wake_(void) {                           // only 1st producer wakes it up
+                         if(not idle_.load(std::memory_order_acquire)) return;
+                         if(not idle_.exchange(false, std::memory_order_acq_rel)) return;
+                         std::lock_guard<std::mutex> lck(mtx_);
+                         cv_.notify_one();
+                        }
+};
+
+
+
+void Debug::Writer_::push(std::string &str) {
+ // commit str into the ring (str receives a recycled empty string in return),
+ // when the ring is full, wait for the writer to catch up (debugs are not dropped)
+ if(not running_.load(std::memory_order_acquire)) start_();
+ while(not try_push_(str))
+  { wake_(); std::this_thread::yield(); }
+ wake_();
+}
+
+
+bool Debug::Writer_::try_push_(std::string &str) {
+ size_t pos = head_.load(std::memory_order_relaxed);
+ Cell_ * cell;
+ while(true) {
+  cell = &ring_[pos & (RING_SIZE-1)];
+  auto dif = static_cast<long>(cell->seq.load(std::memory_order_acquire)) -
+             static_cast<long>(pos);
+  if(dif == 0) {                                                // cell is free, claim it
+   if(head_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+  }
+  else
+   if(dif < 0) return false;                                    // ring is full
+   else pos = head_.load(std::memory_order_relaxed);            // cell claimed by other producer
+ }
+
+ cell->str.swap(str);
+ cell->seq.store(pos + 1, std::memory_order_release);           // publish filled cell
+ return true;
+}
+
+
+bool Debug::Writer_::try_pop_(std::string &str) {
+ Cell_ & cell = ring_[tail_ & (RING_SIZE-1)];
+ if(cell.seq.load(std::memory_order_acquire) != tail_ + 1) return false;
+ cell.str.swap(str);
+ cell.seq.store(tail_ + RING_SIZE, std::memory_order_release);  // release cell for producers
+ ++tail_;
+ return true;
+}
+
+
+void Debug::Writer_::start_(void) {
+ std::lock_guard<std::mutex> lck(mtx_);
+ if(running_.load(std::memory_order_relaxed)) return;           // started by another thread
+ stop_ = false;
+ thread_ = std::thread(&Writer_::run_, this);
+ running_.store(true, std::memory_order_release);
+}
+
+
+void Debug::Writer_::stop(void) {
+ {
+  std::lock_guard<std::mutex> lck(mtx_);
+  if(not thread_.joinable()) return;
+  stop_ = true;
+ }
+ cv_.notify_one();
+ thread_.join();
+ running_.store(false, std::memory_order_release);
+}
+
+
+void Debug::Writer_::run_(void) {
+ // drain the ring into Debug's ostream; when the ring is empty flush the stream and
+ // wait for more inputs (producers wake up the writer only if it's idle); once in
+ // DBG_REPORT_INTERVAL seconds write counts of suppressed outputs which are due
+ std::string str;
+ time_t reported = time(nullptr);
+ while(true) {
+  if(try_pop_(str)) {
+   Debug::op_->write(str.data(), str.size());
+   str.clear();                                                 // keep capacity for recycling
+   continue;
+  }
+
+  time_t now = time(nullptr);
+  if(now - reported >= DBG_REPORT_INTERVAL) {
+   reported = now;
+   str = Debug::suppressed_report_(false);
+   Debug::op_->write(str.data(), str.size());
+   str.clear();
+  }
+  Debug::op_->flush();
+  std::unique_lock<std::mutex> lck(mtx_);
+  if(stop_ and empty_()) break;
+  idle_.store(true, std::memory_order_release);
+  cv_.wait_for(lck, std::chrono::milliseconds(10), [this]{ return stop_ or not empty_(); });
+  idle_.store(false, std::memory_order_relaxed);
+ }
+}
 
 short                   Debug::udl_{0};                         // 0: debugs disabled
 bool                    Debug::indented_{true};                 // by default prompt is indented
@@ -499,7 +957,58 @@ std::mutex              Debug::mtx_;
 std::mutex *            Debug::mp_{&Debug::mtx_};
 std::ostream *          Debug::op_{&std::cout};
 bool                    Debug::ft_{false};                      // filter-in by default
+std::atomic<unsigned>   Debug::fgen_{1};                        // 0 is reserved: never matched
 std::vector<std::string>Debug::filter_;
+std::atomic<bool>       Debug::async_{false};
+std::atomic<bool>       Debug::bin_{false};
+std::atomic<unsigned>   Debug::sites_{0};
+std::atomic<Debug::Site*>
+                        Debug::throttled_{nullptr};
+std::ofstream           Debug::binlog_;
+unsigned                Debug::rate_{0};
+unsigned                Debug::sample_{0};
+size_t                  Debug::trunc_{0};
+Debug::Writer_          Debug::writer_;                         // must be the last one defined
+
+
+
+Debug & Debug::async(bool x) {
+ // turn on/off asynchronous outputs; turning off drains all pending outputs (and
+ // stops binary log) and writes all pending counts of suppressed outputs
+ if(not x and async_) {
+  commit();
+  bin_ = false;
+  async_ = false;
+  writer_.stop();
+ }
+ if(not x) flush_suppressed_();
+ async_ = x;
+ return *this;
+}
+
+
+void Debug::commit(void) {
+ // hand off thread's buffer to the background writer (asynchronous mode only)
+ auto & tout = tout_();
+ if(tout.buf.str.empty()) return;
+ writer_.push(tout.buf.str);
+}
+
+
+Debug & Debug::binlog(const std::string &fname) {
+ // open binary log and direct all debug outputs there (binary log is always async)
+ if(binary()) return *this;
+ binlog_.open(fname, std::ios::out | std::ios::binary | std::ios::trunc);
+ if(not binlog_) return *this;
+
+ async(false);                                                  // drain pending text outputs
+ use_ostream(binlog_);
+ async(true);
+ tout_().buf.str = DBG_BINLOG_MAGIC;                            // the header goes first
+ commit();
+ bin_ = true;
+ return *this;
+}
 
 
 bool Debug::operator()(short d, const char * fn) const {
@@ -513,20 +1022,165 @@ bool Debug::operator()(short d, const char * fn) const {
  return false;
  #endif
 
+ if(not compiled(d)) return false;                              // compiled out severity
+
  if(d + ds_ >= level()) return false;                           // severity lower than set by user
  if(fn == nullptr) return true;                                 // user does not want printed prompt
  if(not match_(fn)) return false;                               // filter does not match
 
- dout() << Debug::indent_ << prompt(fn, d);
+ if(binary())
+  out() << Debug::indent_ + prompt(fn, d);                      // binlog: record prompt as a str
+ else
+  dout() << Debug::indent_ << prompt(fn, d);
  return true;
 }
 
 
+bool Debug::operator()(short d, Site &site) const {
+ // same as above, but for debug placements (DBG(n) {...}), which also let
+ // recording binary debugs
+ if(not compiled(d)) return false;
+ if(d + ds_ >= level()) return false;
+ if(not site.match()) return false;
+
+ uint64_t suppressed;
+ if(not site.admit(suppressed)) return false;
+ if(suppressed > 0) {                                           // report suppressed outputs
+  prompt_(d, site);
+  out() << "[" << suppressed << " debug outputs suppressed]" << std::endl;
+ }
+ prompt_(d, site);
+ return true;
+}
+
+
+void Debug::prompt_(short d, Site &site) const {
+ // print (or record in the binary mode) the prompt of the debug placement
+ if(binary()) {
+  if(not site.logged()) rec_site_(site);
+  rec_entry_(d + ds_, site);
+  return;
+ }
+ dout() << Debug::indent_ << prompt(site.func(), d);
+}
+
+
+std::string Debug::suppressed_report_(bool all) {
+ // build a plain text line per each throttled placement, whose count of suppressed
+ // outputs is due (or all pending ones); counts are not reported into a binary log
+ std::string str;
+ if(op_ == &binlog_) return str;
+ time_t now = time(nullptr);
+ for(Site *site = throttled_.load(std::memory_order_acquire); site != nullptr; site = site->next()) {
+  uint64_t suppressed = site->take_suppressed(now, all);
+  if(suppressed > 0)
+   str.append(indent_).append(site->func()).append("()").append(suffix_)
+      .append("[").append(std::to_string(suppressed)).append(" debug outputs suppressed]\n");
+ }
+ return str;
+}
+
+
+void Debug::flush_suppressed_(void) {
+ // write all pending counts of suppressed outputs: via the background writer in
+ // asynchronous mode, otherwise under Debug's mutex (skipped if the mutex is busy,
+ // e.g. it's held by this very thread - the counts then stay pending)
+ if(throttled_.load(std::memory_order_acquire) == nullptr) return;  // nothing throttled
+ if(async_.load(std::memory_order_relaxed)) {
+  std::string str = suppressed_report_(true);
+  if(not str.empty()) writer_.push(str);
+  return;
+ }
+ std::unique_lock<std::mutex> lck(*mp_, std::try_to_lock);
+ if(not lck) return;
+ std::string str = suppressed_report_(true);
+ if(str.empty()) return;
+ op_->write(str.data(), str.size());
+ op_->flush();
+}
+
+
+bool Debug::Site::admit(uint64_t &suppressed) {
+ // apply sampling and rate-limiting (counters are approximate when the placement
+ // is hit by concurrent threads); suppressed returns the number of outputs to be
+ // reported (once in DBG_REPORT_INTERVAL seconds)
+ suppressed = 0;
+ if(Debug::sample_ < 2 and Debug::rate_ == 0) return true;      // no throttling
+
+ if(Debug::sample_ > 1 and hits_.fetch_add(1, std::memory_order_relaxed) % Debug::sample_ != 0)
+  { suppress_(); return false; }
+
+ time_t now = time(nullptr);
+ if(Debug::rate_ > 0) {
+  if(window_.exchange(now, std::memory_order_relaxed) != now)   // new window started
+   admitted_.store(0, std::memory_order_relaxed);
+  if(admitted_.fetch_add(1, std::memory_order_relaxed) >= Debug::rate_)
+   { suppress_(); return false; }
+ }
+
+ suppressed = take_suppressed(now, false);
+ return true;
+}
+
+
+uint64_t Debug::Site::take_suppressed(time_t now, bool all) {
+ // take the count of suppressed outputs if it's due (once in DBG_REPORT_INTERVAL
+ // seconds), or any pending count if all
+ if(suppressed_.load(std::memory_order_relaxed) == 0) return 0;
+ if(not all and now - reported_.load(std::memory_order_relaxed) < DBG_REPORT_INTERVAL) return 0;
+ reported_.store(now, std::memory_order_relaxed);
+ return suppressed_.exchange(0, std::memory_order_relaxed);
+}
+
+
+void Debug::Site::suppress_(void) {
+ // count a suppressed output; the 1st time round the placement enlists itself into
+ // the list of throttled placements, so its counts are reported even if the
+ // placement is never admitted again
+ suppressed_.fetch_add(1, std::memory_order_relaxed);
+ if(listed_.load(std::memory_order_relaxed) or listed_.exchange(true, std::memory_order_relaxed))
+  return;
+ next_ = Debug::throttled_.load(std::memory_order_relaxed);
+ while(not Debug::throttled_.compare_exchange_weak(next_, this, std::memory_order_release,
+                                                   std::memory_order_relaxed));
+}
+
+
+void Debug::rec_site_(const Site &site) {
+ // record site definition into the binary log
+ tout_().buf.str += static_cast<char>(bin_site);
+ rec_raw_(static_cast<uint32_t>(site.id()));
+ rec_raw_(static_cast<uint32_t>(site.line()));
+ rec_raw_(site.file());
+ rec_raw_(site.func());
+}
+
+
+void Debug::rec_entry_(short sev, const Site &site) {
+ // record the debug entry header (the prompt) into the binary log
+ timespec ts;
+ clock_gettime(CLOCK_REALTIME, &ts);
+
+ tout_().buf.str += static_cast<char>(bin_entry);
+ rec_raw_(static_cast<uint32_t>(site.id()));
+ rec_raw_(static_cast<int16_t>(sev));
+ rec_raw_(static_cast<int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec);
+ rec_raw_(tid_());
+}
+
+
+void Debug::rec_cont_(void) {
+ // arguments recorded outside of the debug placement (the buffer was already
+ // committed) are recorded under continuation record
+ tout_().buf.str += static_cast<char>(bin_cont);
+ rec_raw_(tid_());
+}
+
+
 std::string Debug::prompt(const char *fn, int msgSev, bool useTs, bool useAltPfx) const {
  // useAltPfx: use alternative prefix (indent)?
  // useTs: use Debug::ts to drive time-stamp update?
- static std::stringstream so;
- so.str("");
+ std::stringstream so;
 
  if(indented())
   for(int i=severity()+msgSev; i>0; --i)
@@ -540,60 +1194,44 @@ std::string Debug::prompt(const char *fn, int msgSev, bool useTs, bool useAltPfx
 
 
 const std::string Debug::timestamp_(void) {
- // build a time-stamp of the local TZ, possibly including ms and us
- static struct timeval t;
- static std::stringstream so;
-
- so.str("");
- gettimeofday(&t, nullptr);
+ // build a time-stamp of the local TZ (YYYY-MMM-DD hh:mm:ss), possibly including ms
+ // and us; the second-granular part comes pre-formatted from WallClock
+ char stamp[WALLCLOCK_STAMP_LEN + 8];
+ long usec = WallClock::stamp(stamp);
 
- so << stamp_str_(t.tv_sec);
  if(ms_) {
-  so << '.' << std::setfill('0') << std::setw(3) << t.tv_usec/1000;
-  if(us_)
-   so << '.' << std::setfill('0') << std::setw(3) << t.tv_usec%1000;
+  char *p = stamp + strlen(stamp);
+  for(int part: {int(usec / 1000), int(usec % 1000)}) {
+   *p++ = '.';
+   *p++ = '0' + part / 100;
+   *p++ = '0' + part / 10 % 10;
+   *p++ = '0' + part % 10;
+   if(not us_) break;
+  }
+  *p = '\0';
  }
 
- return so.str();
+ return stamp;
 };
 
 
-const std::string Debug::stamp_str_(time_t t_stamp) {
- // build a date-time-stamp in the format: YYYY-MMM-DD hh:mm:ss
- static std::stringstream so;
- static tm * tmp;
-
- so.str("");
- tmp = localtime(&t_stamp);
-
- so << tmp->tm_year+1900 << '-'
-    << Debug::Month_str[tmp->tm_mon] << '-'
-    << std::setfill('0') << std::setw(2) << tmp->tm_mday << ' '
-    << std::setfill('0') << std::setw(2) << tmp->tm_hour << ':'
-    << std::setfill('0') << std::setw(2) << tmp->tm_min << ':'
-    << std::setfill('0') << std::setw(2) << tmp->tm_sec;
-
- return so.str();
-}
-
-
 bool Debug::match_(const char *fn) {
  // filter-in or filter-out any matches setup in Debug::filter_
  // if Debug::filter is not set, always return true
  // match occurs from the beginning of the function's name only.
+ // DBG(n) placements cache the verdict per call-site (see Debug::Site::match())
  if( filter_.empty() )                                          // if filter wasn't setup
   return true;                                                  // match is always true
 
- std::string fname(fn);
  if(Debug::ft_) {                                                // filter-out
   for(auto &f: Debug::filter_)
-   { if(fname.find(f) == 0) return false; }
+   { if(strncmp(fn, f.c_str(), f.size()) == 0) return false; }
   return true;
  }
 
  // filter-in
  for(auto &f: Debug::filter_)
-  { if(fname.find(f) == 0) return true; }
+  { if(strncmp(fn, f.c_str(), f.size()) == 0) return true; }
  return false;
 }
 
@@ -18,19 +18,20 @@
  *  2. declare enums with ENUM macro if non-class declaration, or with ENUMSTR for in-class:
  *          ENUMSTR(trafficLightColors, MY_COLORS)
  *     - ENUM macro only declares trafficLightColors of enums, while ENUMSTR in addition
- *       declares an array of: static const char* trafficLightColors_[]
+ *       defines a constexpr array: static constexpr const char* trafficLightColors_str[]
+ *       (a compile-time table, no run-time initialization is involved)
  *
- *  3. initialize an array of c-strings to generated by STRINGIFY macro (non in-class):
+ *  3. provide out-of-class definition of the array with STRINGIFY macro (required in
+ *     c++14 when the array is odr-used):
  *          STRINGIFY(SomeClass::trafficLightColors, MY_COLORS)
- *     - declares STRINGIFY macro outside of class, for non in-class declaration drop the
- *     cдass qualifier:
- *          STRINGIFY(trafficLightColors, MY_COLORS)
+ *     - STRINGIFY is placed outside of class; for non in-class declarations (where
+ *       ENUMSTR defines the array itself) STRINGIFY is not required
  *
  *  Now, enum trafficLightColors is defined, as well as its c-string representation:
  *          cout << "All traffic-light colors:";
  *          for(int i=0; i<COUNT_ARGS(MY_COLORS); ++i)
  *           cout << ' ' << SomeClass::trafficLightColors_str[i];
- *           // or equally: cout << ' ' << STREN(trafficLightColors, i);
+ *           // or equally: cout << ' ' << ENUMS(trafficLightColors, i);
  *          cout << endl;
  *
  * Obvious caveat: enums declared that way do not allow value re-definition
@@ -40,7 +41,9 @@
 
 #pragma once
 #include <string>
-#include <vector>
+#include <type_traits>
+#include <stdint.h>
+#include <stddef.h>
 #include "macrolib.h"
 
 
@@ -56,11 +59,12 @@
 
 #define ENUMSTR(enum_class, enums...) \
   enum enum_class { MACRO_TO_ARGS(__COMMA_SEPARATED__, enums) }; \
-  static const char * enum_class ## _str[];
+  static constexpr const char * enum_class ## _str[] \
+   { MACRO_TO_ARGS(__STR_COMMA_SEPARATED__, enums) };
 
 
 #define STRINGIFY(enum_class, enums...) \
-  const char * enum_class ## _str[] { MACRO_TO_ARGS(__STR_COMMA_SEPARATED__, enums) };
+  constexpr const char * enum_class ## _str[];
 
 #define ENUMS(enum_class, enum_idx) enum_class ## _str[enum_idx]
 
@@ -86,25 +90,60 @@
  *
  * const char *x = "abc";
  * if(x AMONG(static_cast<const char*>("abc"), "def", "xyz")) ...
+ *
+ * AMONG builds a constexpr set (a plain array) of given values, thus no heap
+ * allocations occur; for enum values, those are also folded into a bitmask, so that
+ * membership test becomes a single bit test
  */
 
-
-
-template<class T>
-bool operator==(const T &a, std::vector<T> v) {
- for(auto &x: v)
-  if(x == a) return true;
- return false;
-}
-
-bool operator==(const std::string &a, std::vector<const char *> b) {
- for(auto x: b)
-  if(a == x) return true;
- return false;
-}
+template<class T, size_t N>
+class AmongSet_ {
+ public:
+    constexpr           AmongSet_(const T (&v)[N]) {
+                         for(size_t i = 0; i < N; ++i) {
+                          v_[i] = v[i];
+                          mask_ |= bit_(v[i], std::is_enum<T>{});
+                         }
+                        }
+
+    template<class A>
+    constexpr bool      has(const A &a) const {
+                         return has_(a, std::integral_constant<bool, std::is_enum<T>::value and
+                                                                    std::is_enum<A>::value>{});
+                        }
+
+ private:
+    template<class A>
+    constexpr bool      has_(const A &a, std::true_type) const {
+                         return static_cast<uint64_t>(a) < 64?
+                                 (mask_ >> static_cast<uint64_t>(a)) & 1: has_(a, std::false_type{});
+                        }
+    template<class A>
+    constexpr bool      has_(const A &a, std::false_type) const {
+                         for(size_t i = 0; i < N; ++i)
+                          if(a == v_[i]) return true;
+                         return false;
+                        }
+
+    static constexpr uint64_t
+                        bit_(const T &v, std::true_type)        // negatives are large too
+                         { return static_cast<uint64_t>(v) < 64? 1ULL << static_cast<uint64_t>(v): 0; }
+    static constexpr uint64_t
+                        bit_(const T &, std::false_type) { return 0; }
+
+    T                   v_[N]{};
+    uint64_t            mask_{0};
+};
+
+template<class T, size_t N>
+constexpr AmongSet_<T, N> among_set_(const T (&v)[N]) { return AmongSet_<T, N>(v); }
+
+template<class A, class T, size_t N>
+constexpr bool operator==(const A &a, const AmongSet_<T, N> &s) { return s.has(a); }
 
 #define AMONG(first, rest...) \
-        ==std::vector<decltype(first)>{first, MACRO_TO_ARGS(__COMMA_SEPARATED__, rest)}
+        ==among_set_<typename std::decay<decltype(first)>::type>( \
+           {first, MACRO_TO_ARGS(__COMMA_SEPARATED__, rest)})
 
 
 
@@ -126,11 +126,38 @@
  * (zero based index), or via Option's order(count) call (count here is option's
  * count, which is starts from 1 (minding always present default value)
  *
+ *
+ * Class OptLine is a reentrant parser of a single line in CLI syntax (e.g., lines
+ * of a batch manifest): it does not use getopt() (nor its global state), tokenizes
+ * the line itself (shell-like quoting) and keeps parsed values in a flat array
+ * indexed by the option character; all its storage is reused from line to line,
+ * thus parsing a line does not allocate once buffers have grown:
+ *
+ *    OptLine ol(opt);                  // same options as defined in Getopt opt
+ *    for(std::string line; std::getline(file, line);) {
+ *     try { ol.parse(line); }
+ *     catch(OptLine::stdException & e) { ...; continue; }
+ *     if(ol.hits('s') > 0) std::cout << "subject: " << ol.str('s') << std::endl;
+ *     ol.for_each('a', [](const char *a) { std::cout << "attachment: " << a << std::endl; });
+ *     for(size_t i = 0; i < ol.arguments(); ++i) std::cout << ol.arg(i) << std::endl;
+ *    }
+ *
+ * Line syntax:
+ *  - tokens are separated by blanks; a token starting with '#' comments out the rest
+ *  - 'single quoted' strings are taken literally, within "double quoted" strings
+ *    and outside of quotes a backslash escapes the next character (within double
+ *    quotes only \ and \" are escapes)
+ *  - options follow getopt() conventions: clustering (-ab), parameter attached or
+ *    given in the next token (-sX or -s X), "--" ends options, a bare '-' is recorded
+ *    as option '-'; options and standalone arguments may be intermixed
+ *
  */
 
 #pragma once
 
 #include <string.h>
+#include <ctype.h>
+#include <stdint.h>
 #include <iostream>
 #include <sstream>
 #include <map>
@@ -731,6 +758,202 @@ void Getopt::outputOpt_(std::stringstream &ss, int indent, const std::string &st
 
 
 
+#define OL_NIL UINT32_MAX                                       // null index
+
+class OptLine {
+ // reentrant parser of a CLI-syntax line (see the description at the top)
+ public:
+    #define THROWREASON \
+                invalid_option, \
+                opt_argument_missing, \
+                unterminated_quote, \
+                end_of_throw
+    ENUMSTR(ThrowReason, THROWREASON)
+
+                        OptLine(void) { reset_all_(); }
+                        OptLine(const char *fmt): OptLine() { format(fmt); }
+                        OptLine(Getopt &go): OptLine() { format(go); }
+
+    OptLine &           format(const char *fmt);                // getopt() style format, e.g. "ab:"
+    OptLine &           format(Getopt &go);                     // options defined in Getopt
+    OptLine &           parse(const char *line, size_t len);
+    OptLine &           parse(const std::string &line) { return parse(line.data(), line.size()); }
+    OptLine &           reset(void);                            // O(options hit in the last line)
+
+    size_t              hits(char opt) const { return opt_[idx_(opt)].hits; }
+    const char *        str(char opt) const                     // last given value, "" if none
+                         { auto v = opt_[idx_(opt)].last; return v == OL_NIL? "": buf_.c_str() + val_[v].pos; }
+    template<class F>
+    void                for_each(char opt, F f) const {         // every value of opt, in order
+                         for(auto v = opt_[idx_(opt)].first; v != OL_NIL; v = val_[v].next)
+                          f(buf_.c_str() + val_[v].pos);
+                        }
+    template<class F>
+    void                for_each_option(F f) const              // every option hit: f(char)
+                         { for(auto opt: hit_) f(static_cast<char>(opt)); }
+    size_t              arguments(void) const { return arg_.size(); }
+    const char *        arg(size_t idx) const { return buf_.c_str() + arg_[idx]; }
+    size_t              tokens(void) const { return tok_.size(); }  // 0: blank or comment line
+    char                exception(void) const { return exception_; }
+
+    EXCEPTIONS(ThrowReason)
+
+ private:
+    enum OptKind_ { undefined_, boolean_, parametric_ };
+
+    struct Opt_ {                                               // per option character
+        uint32_t            hits;
+        uint32_t            first;                              // first value (index in val_)
+        uint32_t            last;                               // last value
+    };
+    struct Val_ {
+        uint32_t            pos;                                // offset of value in buf_
+        uint32_t            next;                               // next value of the same option
+    };
+    struct Tok_ {
+        uint32_t            pos;                                // offset of token in buf_
+        bool                dash;                               // begins with unquoted '-'
+    };
+
+    unsigned char       kind_[256];                             // OptKind_ per option character
+    Opt_                opt_[256];
+    std::vector<unsigned char>
+                        hit_;                                   // options hit (for reset)
+    std::vector<Val_>   val_;
+    std::vector<uint32_t>
+                        arg_;                                   // standalone arguments
+    std::vector<Tok_>   tok_;
+    std::string         buf_;                                   // unquoted tokens, '\0' separated
+    char                exception_{0};                          // option caused exception
+
+    static unsigned char
+                        idx_(char c) { return static_cast<unsigned char>(c); }
+    void                reset_all_(void);
+    void                tokenize_(const char *line, size_t len);
+    void                record_(char opt, uint32_t pos = OL_NIL);
+};
+
+STRINGIFY(OptLine::ThrowReason, THROWREASON)
+#undef THROWREASON
+
+
+
+void OptLine::reset_all_(void) {
+ for(auto &k: kind_) k = undefined_;
+ for(auto &o: opt_) o = Opt_{0, OL_NIL, OL_NIL};
+ kind_[idx_('-')] = boolean_;                                   // bare qualifier is always defined
+}
+
+
+OptLine & OptLine::format(const char *fmt) {
+ // define options per getopt() format string
+ for(; *fmt != '\0'; ++fmt)
+  if(*fmt != ':')
+   kind_[idx_(*fmt)] = fmt[1] == ':'? parametric_: boolean_;
+ return *this;
+}
+
+
+OptLine & OptLine::format(Getopt &go) {
+ // define options same as in the given Getopt
+ for(auto &o: go)
+  if(o.second.kind() == Option::opt)
+   kind_[idx_(o.first)] = o.second.type() == Option::parametric? parametric_: boolean_;
+ return *this;
+}
+
+
+OptLine & OptLine::reset(void) {
+ // reset parsed values only (touching only options hit by the last parse)
+ for(auto opt: hit_)
+  opt_[opt] = Opt_{0, OL_NIL, OL_NIL};
+ hit_.clear();
+ val_.clear();
+ arg_.clear();
+ tok_.clear();
+ buf_.clear();
+ exception_ = 0;
+ return *this;
+}
+
+
+OptLine & OptLine::parse(const char *line, size_t len) {
+ // tokenize line, then sort out options and standalone arguments like getopt() does
+ reset();
+ tokenize_(line, len);
+
+ bool opts_done = false;                                        // "--" met
+ for(size_t i = 0; i < tok_.size(); ++i) {
+  const char *t = buf_.c_str() + tok_[i].pos;
+  if(opts_done or not tok_[i].dash or t[1] == '\0') {
+   if(not opts_done and tok_[i].dash) record_('-');             // bare qualifier
+   else arg_.push_back(tok_[i].pos);
+   continue;
+  }
+  if(t[1] == '-' and t[2] == '\0')
+   { opts_done = true; continue; }
+
+  for(const char *p = t + 1; *p != '\0'; ++p) {                 // process options cluster
+   if(kind_[idx_(*p)] == undefined_ or *p == '-')
+    { exception_ = *p; throw EXP(invalid_option); }
+   if(kind_[idx_(*p)] == boolean_)
+    { record_(*p); continue; }
+   if(p[1] != '\0')                                             // parameter is attached
+    { record_(*p, tok_[i].pos + (p + 1 - t)); break; }
+   if(++i == tok_.size())
+    { exception_ = *p; throw EXP(opt_argument_missing); }
+   record_(*p, tok_[i].pos);                                    // parameter is the next token
+   break;
+  }
+ }
+ return *this;
+}
+
+
+void OptLine::tokenize_(const char *line, size_t len) {
+ // split line into tokens (stored '\0' separated in buf_), minding quotes and escapes
+ const char *end = line + len;
+ while(line != end) {
+  if(isspace(static_cast<unsigned char>(*line))) { ++line; continue; }
+  if(*line == '#') break;                                       // comment till the end
+
+  tok_.push_back(Tok_{static_cast<uint32_t>(buf_.size()), *line == '-'});
+  char quote = 0;                                               // quote in effect
+  for(; line != end; ++line) {
+   char c = *line;
+   if(quote == 0 and isspace(static_cast<unsigned char>(c))) break;
+   if(quote == 0 and (c == '\'' or c == '"')) { quote = c; continue; }
+   if(quote != 0 and c == quote) { quote = 0; continue; }
+   if(c == '\\' and quote != '\'' and line + 1 != end and
+      (quote == 0 or line[1] == '\\' or line[1] == '"'))
+    c = *++line;
+   buf_ += c;
+  }
+  if(quote != 0) throw EXP(unterminated_quote);
+  buf_ += '\0';
+ }
+}
+
+
+void OptLine::record_(char opt, uint32_t pos) {
+ // record a hit of the option (and its value, if given)
+ Opt_ &o = opt_[idx_(opt)];
+ if(o.hits++ == 0) hit_.push_back(idx_(opt));
+ if(pos == OL_NIL) return;
+
+ val_.push_back(Val_{pos, OL_NIL});
+ uint32_t v = val_.size() - 1;
+ if(o.last == OL_NIL) o.first = v;
+ else val_[o.last].next = v;
+ o.last = v;
+}
+
+#undef OL_NIL
+
+
+
+
+
 #undef OPT_ARG_OFFSET
 #undef OPT_WIDTH
 